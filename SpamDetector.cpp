@@ -1,46 +1,528 @@
 #include <iostream>
+#include <string>
+#include <cstring>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
 #include <vector>
-#include "hashMap.hpp"
+#include <utility>
+#include <chrono>
+#include "scoringEngine.hpp"
+#include "messageInput.hpp"
+#include "batchScorer.hpp"
+#include "scoringServer.hpp"
+#include "verdictCache.hpp"
+#include "nearDuplicate.hpp"
+#include "bayesClassifier.hpp"
 
-int main()
+#define USAGE "Usage: SpamDetector <database path> <message path> <threshold>\n" \
+              "       SpamDetector batch <database path> <threshold> <directory|mbox|path list> [--threads N]\n" \
+              "                          [--io mmap|pread|uring] [--queue-depth N] [--pipeline STAGES] [--pin]\n" \
+              "                          [--early-exit] [--reload] [--deltas DIRECTORY] [--mime] [--html]\n" \
+              "                          [--deobfuscate] [--cache MEGABYTES] [--near-duplicates MEGABYTES]\n" \
+              "                          [--bayes WEIGHT] [--train-spam INPUT]... [--train-ham INPUT]...\n" \
+              "       SpamDetector serve <database path> <threshold> <socket path> [--threads N]\n" \
+              "                          [--pipeline STAGES] [--pin] [--early-exit] [--reload] [--deltas DIRECTORY]\n" \
+              "                          [--mime] [--html] [--deobfuscate] [--cache MEGABYTES]\n" \
+              "                          [--near-duplicates MEGABYTES] [--bayes WEIGHT] [--train-spam INPUT]...\n" \
+              "                          [--train-ham INPUT]...\n" \
+              "       (--reload reloads the database on SIGHUP and whenever its file changes)\n" \
+              "       (--deltas applies every *.delta file written to DIRECTORY, lines of +phrase,score -phrase\n" \
+              "        or =phrase,score)\n" \
+              "       (--mime matches the decoded text of MIME messages, base64 and quoted-printable bodies)\n" \
+              "       (--html matches the text of HTML, the text/html parts with --mime or whole messages without)\n" \
+              "       (--deobfuscate matches through leet, homoglyphs and invisible characters)\n" \
+              "       (--cache keeps the verdicts of messages by fingerprint, so duplicates aren't scored again)\n" \
+              "       (--near-duplicates keeps MinHash signatures of spam, so near copies of it are classified\n" \
+              "        without being scored, their scores are written with a '~')\n" \
+              "       (--bayes adds up to WEIGHT points of a naive Bayes classifier to the scores, or takes them\n" \
+              "        off, trained first on the spam and ham INPUTs, each a directory, an mbox or a path list)\n" \
+              "       (STAGES is like read=1,decode=1,normalize=2,match=4,score=1)\n" \
+              "       SpamDetector client <socket path> [--train spam|ham] <message path>...\n" \
+              "       SpamDetector compile <database path> -o <compiled database path>"
+#define INVALID_INPUT "Invalid input"
+#define BATCH_MODE "batch"
+#define SERVE_MODE "serve"
+#define CLIENT_MODE "client"
+#define COMPILE_MODE "compile"
+#define OUTPUT_FLAG "-o"
+#define THREADS_FLAG "--threads"
+#define IO_FLAG "--io"
+#define DEPTH_FLAG "--queue-depth"
+#define PIPELINE_FLAG "--pipeline"
+#define PIN_FLAG "--pin"
+#define EARLY_EXIT_FLAG "--early-exit"
+#define RELOAD_FLAG "--reload"
+#define DELTAS_FLAG "--deltas"
+#define MIME_FLAG "--mime"
+#define HTML_FLAG "--html"
+#define DEOBFUSCATE_FLAG "--deobfuscate"
+#define CACHE_FLAG "--cache"
+#define NEAR_DUPLICATES_FLAG "--near-duplicates"
+#define BAYES_FLAG "--bayes"
+#define TRAIN_SPAM_FLAG "--train-spam"
+#define TRAIN_HAM_FLAG "--train-ham"
+#define TRAIN_FLAG "--train"
+
+/**
+ * parses a threshold, a positive integer.
+ * @param str- the threshold as given on the command line.
+ * @return- the threshold.
+ */
+long long parseThreshold(const std::string &str)
 {
+    size_t parsed = 0;
+    long long threshold = 0;
     try
     {
-        std::vector<std::string> svec = std::vector<std::string>();
-        std::vector<int> ivec = std::vector<int>();
-        svec.push_back("hi");
-        svec.push_back("you");
-        svec.push_back("dick");
-        svec.push_back("hi");
-        ivec.push_back(15);
-        ivec.push_back(-5);
-        ivec.push_back(202);
-        ivec.push_back(-8);
-
-        HashMap<std::string, int> a;
-        a["asd"] = 4;
-        std::cout << a.at("asd") << std::endl;
-        std::cout << a.at("as") << std::endl;
-//        std::cout << a.size() << std::endl;
-//        a["nope"] = 555;
-//        std::cout << a["hi"] << std::endl;
-//        a.erase("nope");
-//        std::cout << a["nope"] << std::endl;
-//        std::cout << a.size() << std::endl;
-//        HashMap<std::string, int> b(a);
-//        b["hi"] = 6;
-//        std::cout << (b != a) << std::endl;
-//        a.printer();
-//        b.printer();
-//        b = a;
-//        b.printer();
+        threshold = std::stoll(str, &parsed);
+    }
+    catch (const std::exception &ex)
+    {
+        parsed = 0;
+    }
+    if (parsed != str.size() || threshold <= 0)
+    {
+        throw std::runtime_error("threshold must be a positive integer");
+    }
+    return threshold;
+}
+
+/**
+ * parses a count of threads or of reads in flight, a positive integer up to 4096.
+ * @param str- the count as given on the command line.
+ * @param what- what is counted, for the error.
+ * @return- the count.
+ */
+unsigned int parseCount(const std::string &str, const std::string &what)
+{
+    size_t parsed = 0;
+    unsigned long count = 0;
+    try
+    {
+        count = std::stoul(str, &parsed);
+    }
+    catch (const std::exception &ex)
+    {
+        parsed = 0;
+    }
+    if (parsed != str.size() || count == 0 || count > 4096)
+    {
+        throw std::runtime_error(what + " must be between 1 and 4096");
+    }
+    return (unsigned int) count;
+}
+
+/**
+ * parses an ingest backend name.
+ * @param str- the name as given on the command line.
+ * @return- the backend.
+ */
+IngestBackend parseBackend(const std::string &str)
+{
+    if (str == "mmap")
+    {
+        return INGEST_MMAP;
+    }
+    if (str == "pread")
+    {
+        return INGEST_PREAD;
+    }
+    if (str == "uring")
+    {
+        return INGEST_URING;
+    }
+    throw std::runtime_error("io must be mmap, pread or uring");
+}
+
+/**
+ * the options that come after the fixed arguments of the batch and daemon modes.
+ */
+struct Options
+{
+    BatchOptions batch;
+    PipelineConfig pipeline;
+    bool reload = false;
+    TextOptions text;
+    std::string deltas;
+    std::unique_ptr<VerdictCache> cache;
+    std::unique_ptr<NearDuplicateIndex> nearDuplicates;
+    std::unique_ptr<BayesClassifier> bayes;
+    std::vector<std::pair<std::string, bool>> training;
+};
+
+/**
+ * parses a pipeline layout, "stage=threads" pairs separated by commas (stages left out get one thread).
+ * @param str- the layout as given on the command line.
+ * @param config- the threads of its stages are set.
+ */
+void parsePipeline(const std::string &str, PipelineConfig &config)
+{
+    size_t start = 0;
+    while (start <= str.size())
+    {
+        size_t end = std::min(str.find(',', start), str.size());
+        std::string stage = str.substr(start, end - start);
+        size_t equals = stage.find('=');
+        size_t s = 0;
+        while (s < PIPELINE_STAGES && stage.substr(0, equals) != STAGE_NAMES[s])
+        {
+            s++;
+        }
+        if (equals == std::string::npos || s == PIPELINE_STAGES)
+        {
+            throw std::runtime_error("pipeline stages are read, decode, normalize, match and score");
+        }
+        config.threads[s] = parseCount(stage.substr(equals + 1), stage.substr(0, equals) + " threads");
+        start = end + 1;
+    }
+}
+
+/**
+ * parses the options from some argument on.
+ * @param argc- the number of arguments.
+ * @param argv- the arguments.
+ * @param first- the index of the first option.
+ * @param batch- true if the ingest options are allowed.
+ * @param options- set to the options.
+ * @return- false if there is an option that isn't known (or misses its value).
+ */
+bool parseOptions(int argc, char *argv[], int first, bool batch, Options &options)
+{
+    for (int i = first; i < argc; i++)
+    {
+        std::string flag = argv[i];
+        if (flag == PIN_FLAG)
+        {
+            options.pipeline.pin = true;
+            continue;
+        }
+        if (flag == EARLY_EXIT_FLAG)
+        {
+            options.batch.earlyExit = options.pipeline.earlyExit = true;
+            continue;
+        }
+        if (flag == RELOAD_FLAG)
+        {
+            options.reload = true;
+            continue;
+        }
+        if (flag == MIME_FLAG)
+        {
+            options.text.mime = true;
+            continue;
+        }
+        if (flag == HTML_FLAG)
+        {
+            options.text.html = true;
+            continue;
+        }
+        if (flag == DEOBFUSCATE_FLAG)
+        {
+            options.text.deobfuscate = true;
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            return false;
+        }
+        std::string value = argv[++i];
+        if (flag == THREADS_FLAG)
+        {
+            options.batch.threads = parseCount(value, "thread count");
+        }
+        else if (flag == PIPELINE_FLAG)
+        {
+            options.batch.pipeline = &options.pipeline;
+            parsePipeline(value, options.pipeline);
+        }
+        else if (flag == DELTAS_FLAG)
+        {
+            options.deltas = value;
+        }
+        else if (flag == CACHE_FLAG)
+        {
+            options.cache.reset(new VerdictCache((size_t) parseCount(value, "cache megabytes") << 20));
+            options.batch.cache = options.pipeline.cache = options.cache.get();
+        }
+        else if (flag == NEAR_DUPLICATES_FLAG)
+        {
+            options.nearDuplicates.reset(
+                    new NearDuplicateIndex((size_t) parseCount(value, "near duplicate megabytes") << 20));
+            options.batch.nearDuplicates = options.pipeline.nearDuplicates = options.nearDuplicates.get();
+        }
+        else if (flag == BAYES_FLAG)
+        {
+            options.bayes.reset(new BayesClassifier(parseCount(value, "Bayes weight")));
+            options.batch.bayes = options.pipeline.bayes = options.bayes.get();
+        }
+        else if (flag == TRAIN_SPAM_FLAG || flag == TRAIN_HAM_FLAG)
+        {
+            options.training.emplace_back(value, flag == TRAIN_SPAM_FLAG);
+        }
+        else if (batch && flag == IO_FLAG)
+        {
+            options.batch.backend = parseBackend(value);
+        }
+        else if (batch && flag == DEPTH_FLAG)
+        {
+            options.batch.depth = parseCount(value, "queue depth");
+        }
+        else
+        {
+            return false;
+        }
+    }
+    options.pipeline.report = &std::cerr;
+    // training needs a classifier to train
+    return options.training.empty() || options.bayes;
+}
+
+/**
+ * writes how much early exit saved, to stderr.
+ * @param engine- the engine that scored.
+ */
+void reportEarlyExit(const LiveEngine &engine)
+{
+    if (!engine.get()->canExitEarly())
+    {
+        std::cerr << "early exit: off, some phrase has a negative weight" << std::endl;
+        return;
+    }
+    std::cerr << "early exit: " << engine.earlyExits() << " messages stopped early, " << engine.bytesSaved()
+              << " bytes not scanned" << std::endl;
+}
+
+/**
+ * writes how often the verdict cache saved scoring a message, to stderr.
+ * @param cache- the cache.
+ */
+void reportCache(const VerdictCache &cache)
+{
+    std::cerr << "verdict cache: " << cache.hits() << " hits, " << cache.misses() << " misses, "
+              << cache.evictions() << " evictions (" << cache.capacity() << " verdicts at most)" << std::endl;
+}
+
+/**
+ * writes how often the near duplicate index saved scoring a message, to stderr.
+ * @param index- the index.
+ */
+void reportNearDuplicates(const NearDuplicateIndex &index)
+{
+    std::cerr << "near duplicates: " << index.hits() << " of " << index.lookups() << " messages were near copies of "
+              << "spam (" << index.capacity() << " signatures at most)" << std::endl;
+}
+
+/**
+ * writes what the Bayes classifier was trained on, to stderr.
+ * @param bayes- the classifier.
+ */
+void reportBayes(const BayesClassifier &bayes)
+{
+    std::cerr << "bayes: " << bayes.spamMessages() << " spam and " << bayes.hamMessages() << " ham messages trained, "
+              << bayes.vocabulary() << " tokens" << std::endl;
+}
+
+/**
+ * trains the Bayes classifier on the inputs given with --train-spam and --train-ham, writing how fast to stderr.
+ * @param engine- the engine of the batch scorer that collects the messages.
+ * @param options- the options.
+ */
+void trainBayes(const LiveEngine &engine, const Options &options)
+{
+    if (options.training.empty())
+    {
+        return;
+    }
+    auto started = std::chrono::steady_clock::now();
+    BatchScorer batch(engine, options.batch);
+    size_t count = 0;
+    for (const std::pair<std::string, bool> &training : options.training)
+    {
+        count += batch.train(training.first, training.second);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    std::cerr << "bayes: trained on " << count << " messages in " << elapsed.count() << "s" << std::endl;
+}
+
+/**
+ * the batch mode: loads the phrase database once (reloading it in the background with --reload, applying deltas
+ * with --deltas) and scores every message of a directory, an mbox file or a list of paths, writing a verdict line
+ * per message in input order.
+ * @param argc- the number of arguments.
+ * @param argv- the arguments, starting with "SpamDetector batch".
+ * @return- the exit code, a failure if some message couldn't be scored.
+ */
+int runBatch(int argc, char *argv[])
+{
+    Options options;
+    if (argc < 5 || !parseOptions(argc, argv, 5, true, options))
+    {
+        std::cerr << USAGE << std::endl;
+        return EXIT_FAILURE;
+    }
+    LiveEngine engine(argv[2], parseThreshold(argv[3]), &std::cerr, options.text);
+    engine.watch(options.reload, options.reload, options.deltas);
+    trainBayes(engine, options);
+    BatchScorer batch(engine, options.batch);
+    size_t failures = batch.run(argv[4], std::cout);
+    if (options.batch.earlyExit)
+    {
+        reportEarlyExit(engine);
+    }
+    if (options.cache)
+    {
+        reportCache(*options.cache);
+    }
+    if (options.nearDuplicates)
+    {
+        reportNearDuplicates(*options.nearDuplicates);
+    }
+    if (options.bayes)
+    {
+        reportBayes(*options.bayes);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * the daemon mode: loads the phrase database once (reloading it in the background with --reload, applying deltas
+ * with --deltas) and scores the messages sent to a Unix domain socket until SIGINT or SIGTERM.
+ * @param argc- the number of arguments.
+ * @param argv- the arguments, starting with "SpamDetector serve".
+ * @return- the exit code.
+ */
+int runServer(int argc, char *argv[])
+{
+    Options options;
+    if (argc < 5 || !parseOptions(argc, argv, 5, false, options))
+    {
+        std::cerr << USAGE << std::endl;
+        return EXIT_FAILURE;
+    }
+    LiveEngine engine(argv[2], parseThreshold(argv[3]), &std::cerr, options.text);
+    engine.watch(options.reload, options.reload, options.deltas);
+    trainBayes(engine, options);
+    ScoringServer server(engine, argv[4], options.batch.threads, options.batch.pipeline, options.batch.earlyExit,
+                         options.cache.get(), options.nearDuplicates.get(), options.bayes.get());
+    server.run();
+    if (options.batch.earlyExit)
+    {
+        reportEarlyExit(engine);
+    }
+    if (options.cache)
+    {
+        reportCache(*options.cache);
+    }
+    if (options.nearDuplicates)
+    {
+        reportNearDuplicates(*options.nearDuplicates);
+    }
+    if (options.bayes)
+    {
+        reportBayes(*options.bayes);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * the client mode: has every given message scored by a running daemon, writing a line per message with its
+ * name, score and verdict separated by tabs. with --train spam or --train ham the daemon's Bayes classifier is
+ * trained on the messages instead, and the lines hold its answers.
+ * @param argc- the number of arguments.
+ * @param argv- the arguments, starting with "SpamDetector client".
+ * @return- the exit code.
+ */
+int runClient(int argc, char *argv[])
+{
+    int first = 3;
+    bool training = argc >= 5 && std::strcmp(argv[3], TRAIN_FLAG) == 0;
+    if (training)
+    {
+        if (std::strcmp(argv[4], "spam") != 0 && std::strcmp(argv[4], "ham") != 0)
+        {
+            std::cerr << USAGE << std::endl;
+            return EXIT_FAILURE;
+        }
+        first = 5;
+    }
+    if (argc <= first)
+    {
+        std::cerr << USAGE << std::endl;
+        return EXIT_FAILURE;
+    }
+    ScoringClient client(argv[2]);
+    MessageInput input;
+    bool spam = training && std::strcmp(argv[4], "spam") == 0;
+    for (int i = first; i < argc; i++)
+    {
+        std::string_view message = input.open(argv[i]);
+        std::cout << argv[i] << '\t' << (training ? client.train(message, spam) : client.score(message)) << '\n';
+    }
+    std::cout.flush();
+    return EXIT_SUCCESS;
+}
 
+/**
+ * the compile mode: loads a phrase database (validating, case folding and deduplicating its phrases) and writes
+ * it as a compiled database, which every other mode then maps instead of parsing.
+ * @param argc- the number of arguments.
+ * @param argv- the arguments, starting with "SpamDetector compile".
+ * @return- the exit code.
+ */
+int runCompile(int argc, char *argv[])
+{
+    if (argc != 5 || std::strcmp(argv[3], OUTPUT_FLAG) != 0)
+    {
+        std::cerr << USAGE << std::endl;
+        return EXIT_FAILURE;
+    }
+    HashMap<std::string, int> phrases;
+    size_t rows = 0;
+    loadDatabase(argv[2], phrases, &rows);
+    compileDatabase(phrases, argv[4]);
+    CompiledDatabase compiled(argv[4]);
+    std::cerr << "compiled " << compiled.size() << " phrases (" << rows - phrases.size()
+              << " duplicates dropped) into " << argv[4] << ", version " << compiled.version() << ", checksum "
+              << std::hex << compiled.checksum() << std::dec << std::endl;
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        if (argc >= 2 && std::strcmp(argv[1], BATCH_MODE) == 0)
+        {
+            return runBatch(argc, argv);
+        }
+        if (argc >= 2 && std::strcmp(argv[1], SERVE_MODE) == 0)
+        {
+            return runServer(argc, argv);
+        }
+        if (argc >= 2 && std::strcmp(argv[1], CLIENT_MODE) == 0)
+        {
+            return runClient(argc, argv);
+        }
+        if (argc >= 2 && std::strcmp(argv[1], COMPILE_MODE) == 0)
+        {
+            return runCompile(argc, argv);
+        }
+        if (argc != 4)
+        {
+            std::cerr << USAGE << std::endl;
+            return EXIT_FAILURE;
+        }
+        long long threshold = parseThreshold(argv[3]);
+        ScoringEngine engine(argv[1], threshold);
+        MessageInput input;
+        std::cout << engine.verdict(engine.scoreForVerdict(input.open(argv[2]))) << std::endl;
     }
     catch (const std::exception &ex)
     {
-        std::cout << "wow, you did it!" << std::endl;
-        return 1;
+        std::cerr << INVALID_INPUT << ": " << ex.what() << std::endl;
+        return EXIT_FAILURE;
     }
-    std::cout << "you failed you failure" << std::endl;
-    return 0;
+    return EXIT_SUCCESS;
 }
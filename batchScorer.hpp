@@ -0,0 +1,744 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <ostream>
+#include <algorithm>
+#include <stdexcept>
+#include <dirent.h>
+#include <deque>
+#include <sys/stat.h>
+#include "scoringEngine.hpp"
+#include "liveEngine.hpp"
+#include "messageInput.hpp"
+#include "messageIngest.hpp"
+#include "scoringPipeline.hpp"
+#include "workStealing.hpp"
+#include "verdictCache.hpp"
+#include "nearDuplicate.hpp"
+#include "bayesClassifier.hpp"
+
+#ifndef SPAMDETECTOR_BATCHSCORER_HPP
+#define SPAMDETECTOR_BATCHSCORER_HPP
+
+#define MBOX_SEPARATOR "From "
+#define BATCH_ERROR "ERROR"
+#define BATCH_CHUNK_SIZE (1UL << 20)
+#define BATCH_SPLIT_MIN (2 * BATCH_CHUNK_SIZE)
+
+/**
+ * one message of a batch: either a file of its own ('path'), or a slice of a mapped mbox ('slice').
+ */
+struct BatchItem
+{
+    std::string name;
+    std::string path;
+    std::string_view slice;
+};
+
+/**
+ * the outcome of scoring one message of a batch.
+ */
+struct BatchResult
+{
+    long long score = 0;
+    bool failed = false;
+    bool stopped = false;
+    bool nearDuplicate = false;
+    std::string error;
+};
+
+/**
+ * how a batch is scored.
+ * threads- the number of worker threads.
+ * backend- how the message files are read: mapped by the workers themselves (INGEST_MMAP), or read ahead of
+ * them with pread or io_uring.
+ * depth- how many messages are read ahead, for pread and io_uring.
+ * pipeline- if not null, the messages are scored on a pipeline of stages laid out like this instead (and
+ * 'threads', 'backend' and 'depth' are ignored).
+ * earlyExit- score every message only as far as its verdict needs, a score that stopped early is written with a
+ * '+' after it since it is only a lower bound.
+ * cache- if not null, the verdicts of messages are looked up in it before they are scored, and cached after.
+ * nearDuplicates- if not null, a message that is a near copy of spam in it is classified without scoring it (its
+ * score, the one of that spam, is written with a '~' after it), and the signatures of the spam messages scored
+ * are added to it.
+ * bayes- if not null, the points its Bayes classifier gives a message are added to its phrase score (and early
+ * exit stops only once the phrases alone reach the threshold plus the most points it can take off).
+ */
+struct BatchOptions
+{
+    unsigned int threads = std::thread::hardware_concurrency();
+    IngestBackend backend = INGEST_MMAP;
+    size_t depth = INGEST_DEF_DEPTH;
+    const PipelineConfig *pipeline = nullptr;
+    bool earlyExit = false;
+    VerdictCache *cache = nullptr;
+    NearDuplicateIndex *nearDuplicates = nullptr;
+    BayesClassifier *bayes = nullptr;
+};
+
+struct SplitMessage;
+
+/**
+ * a task of the batch scheduler: a whole message, or a chunk [begin, end) of a message that was split.
+ */
+struct BatchTask
+{
+    size_t index;
+    size_t begin;
+    size_t end;
+    SplitMessage *split;
+};
+
+/**
+ * a message too big for one worker, split into chunks that are scored as tasks of their own. it holds on to the
+ * message (taking its mapping over from the worker that opened it) and to the engine snapshot all of its chunks
+ * are scored with until the last of its chunks is done.
+ */
+struct SplitMessage
+{
+    std::shared_ptr<const ScoringEngine> engine;
+    MessageKey key;
+    MessageInput input;
+    std::string_view message;
+    std::vector<BatchTask> chunks;
+    std::atomic<size_t> remaining;
+    std::atomic<long long> score;
+    std::mutex lock;
+    std::string error;
+};
+
+/**
+ * scores a whole batch of messages with one loaded phrase database, on a pool of worker threads.
+ * a batch is a directory (every regular file under it, in sorted order), an mbox file (every message in it) or
+ * a text file with a path on every line. the messages are scored on a work stealing pool, big ones split into
+ * chunks so they are spread over the workers too, and the verdict lines are written in input order as soon as
+ * every message before them is done. instead of having the workers map the message files, a MessageIngest can
+ * read them ahead with pread or io_uring, which keeps a fast disk busy on a cold rescan.
+ * every message is scored with the engine that is current when its scoring starts, so a reload in the middle of
+ * a batch applies to the messages after it.
+ */
+class BatchScorer
+{
+private:
+    const LiveEngine &_engine;
+    BatchOptions _options;
+    MessageInput _mbox;
+    std::vector<BatchItem> _items;
+    std::vector<BatchResult> _results;
+    std::vector<std::atomic<bool>> _done;
+    std::vector<MessageInput> _inputs;
+    std::vector<std::string> _buffers;
+    std::mutex _lock;
+    std::condition_variable _ready;
+
+    /**
+     * adds every regular file under a directory to the batch, going into subdirectories, in sorted order.
+     * @param dir- the path of the directory.
+     */
+    void collectDirectory(const std::string &dir)
+    {
+        DIR *handle = opendir(dir.c_str());
+        if (handle == nullptr)
+        {
+            throw std::runtime_error("can't open directory " + dir);
+        }
+        std::vector<std::string> names;
+        for (dirent *entry = readdir(handle); entry != nullptr; entry = readdir(handle))
+        {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..")
+            {
+                names.push_back(name);
+            }
+        }
+        closedir(handle);
+        std::sort(names.begin(), names.end());
+        for (const std::string &name : names)
+        {
+            std::string path = dir + "/" + name;
+            struct stat info = {};
+            if (stat(path.c_str(), &info) != 0)
+            {
+                continue;
+            }
+            if (S_ISDIR(info.st_mode))
+            {
+                collectDirectory(path);
+            }
+            else if (S_ISREG(info.st_mode))
+            {
+                _items.push_back({path, path, std::string_view()});
+            }
+        }
+    }
+
+    /**
+     * maps an mbox file and adds every message in it to the batch. a message starts on the line after a
+     * "From " separator line and runs up to the next one.
+     * @param path- the path of the mbox file.
+     * @param content- the mapped mbox.
+     */
+    void collectMbox(const std::string &path, std::string_view content)
+    {
+        size_t start = 0;
+        size_t count = 0;
+        while (start < content.size())
+        {
+            size_t body = content.find('\n', start);
+            body = body == std::string_view::npos ? content.size() : body + 1;
+            // the newline that ends the previous line belongs to the search, so a separator right at 'body' counts
+            size_t next = content.find("\n" MBOX_SEPARATOR, body - 1);
+            next = next == std::string_view::npos ? content.size() : next + 1;
+            count++;
+            _items.push_back({path + ":" + std::to_string(count), std::string(),
+                              content.substr(body, next - body)});
+            start = next;
+        }
+    }
+
+    /**
+     * adds every path listed in a text file (one per line, empty lines skipped) to the batch. the list is parsed
+     * from what was already read of it, so a list coming through a pipe isn't read twice (the second read would
+     * find it empty).
+     * @param content- the list.
+     */
+    void collectList(std::string_view content)
+    {
+        size_t start = 0;
+        while (start < content.size())
+        {
+            size_t end = content.find('\n', start);
+            end = end == std::string_view::npos ? content.size() : end;
+            std::string_view line = content.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.remove_suffix(1);
+            }
+            if (!line.empty())
+            {
+                _items.push_back({std::string(line), std::string(line), std::string_view()});
+            }
+            start = end + 1;
+        }
+    }
+
+    /**
+     * figures out what kind of batch the input is and collects its messages.
+     * @param input- a directory, an mbox file or a list of paths.
+     */
+    void collect(const std::string &input)
+    {
+        struct stat info = {};
+        if (stat(input.c_str(), &info) != 0)
+        {
+            throw std::runtime_error("can't open batch " + input);
+        }
+        if (S_ISDIR(info.st_mode))
+        {
+            collectDirectory(input);
+            return;
+        }
+        std::string_view content = _mbox.open(input);
+        if (content.substr(0, std::string_view(MBOX_SEPARATOR).size()) == MBOX_SEPARATOR)
+        {
+            collectMbox(input, content);
+        }
+        else
+        {
+            collectList(content);
+            _mbox.close();
+        }
+    }
+
+    /**
+     * looks the verdict of a message up in the cache, and then for a near copy of spam in the near duplicate
+     * index, if there are.
+     * @param engine- the engine the message is scored with.
+     * @param message- the message.
+     * @param key- set to the keys of the message.
+     * @param result- the result of the message, set if the verdict was found.
+     * @return- true if it was.
+     */
+    bool lookUp(const ScoringEngine &engine, std::string_view message, MessageKey &key, BatchResult &result) const
+    {
+        if (_options.cache != nullptr)
+        {
+            key.fingerprint = fingerprint(message);
+            if (_options.cache->find(key.fingerprint, engine.version(), result.score, result.stopped))
+            {
+                return true;
+            }
+        }
+        if (_options.nearDuplicates != nullptr)
+        {
+            minHash(message, key.signature);
+            result.nearDuplicate = key.signature.valid &&
+                                   _options.nearDuplicates->find(key.signature, engine.version(), result.score,
+                                                                 result.stopped);
+        }
+        return result.nearDuplicate;
+    }
+
+    /**
+     * caches the verdict of a message, and adds its signature to the near duplicate index if it is spam, if there
+     * are a cache and an index.
+     * @param engine- the engine the message was scored with.
+     * @param key- the keys of the message.
+     * @param result- the result of the message.
+     */
+    void remember(const ScoringEngine &engine, const MessageKey &key, const BatchResult &result) const
+    {
+        if (result.failed)
+        {
+            return;
+        }
+        if (_options.cache != nullptr)
+        {
+            _options.cache->insert(key.fingerprint, engine.version(), result.score, result.stopped);
+        }
+        if (_options.nearDuplicates != nullptr && key.signature.valid && result.score >= engine.threshold())
+        {
+            _options.nearDuplicates->insert(key.signature, engine.version(), result.score, result.stopped);
+        }
+    }
+
+    /**
+     * adds the points of the Bayes classifier to the phrase score of a message, if there is a classifier.
+     * @param message- the message.
+     * @param result- the result of the message.
+     */
+    void classify(std::string_view message, BatchResult &result) const
+    {
+        if (_options.bayes != nullptr && !result.failed)
+        {
+            result.score += _options.bayes->points(message);
+        }
+    }
+
+    /**
+     * scores a whole message into its result, only as far as its verdict needs with early exit, and caches it.
+     * @param engine- the engine to score with.
+     * @param key- the keys of the message.
+     * @param message- the message.
+     * @param buffer- the worker's fold buffer.
+     * @param result- the result of the message.
+     */
+    void score(const ScoringEngine &engine, const MessageKey &key, std::string_view message, std::string &buffer,
+               BatchResult &result) const
+    {
+        long long margin = _options.bayes != nullptr ? _options.bayes->weight() : 0;
+        result.score = _options.earlyExit ? engine.scoreForVerdict(message, buffer, &result.stopped, margin) :
+                       engine.score(message, buffer);
+        remember(engine, key, result);
+    }
+
+    /**
+     * splits a big message into chunks and spawns a task for each of them on the worker's deque, where the idle
+     * workers will steal them from.
+     * @param index- the index of the message.
+     * @param message- the message.
+     * @param engine- the engine to score it with.
+     * @param key- the keys of the message.
+     * @param input- the worker's input, the message is taken over from it if it opened the message.
+     * @param worker- the index of the worker.
+     * @param pool- the scheduler.
+     */
+    void split(size_t index, std::string_view message, std::shared_ptr<const ScoringEngine> engine,
+               const MessageKey &key, MessageInput &input, unsigned int worker, WorkStealingPool<BatchTask> &pool)
+    {
+        auto *split = new SplitMessage();
+        split->engine = std::move(engine);
+        split->key = key;
+        if (!_items[index].path.empty())
+        {
+            split->input.swap(input);
+        }
+        split->message = message;
+        size_t count = (message.size() + BATCH_CHUNK_SIZE - 1) / BATCH_CHUNK_SIZE;
+        split->remaining.store(count, std::memory_order_relaxed);
+        split->score.store(0, std::memory_order_relaxed);
+        for (size_t c = 0; c < count; c++)
+        {
+            split->chunks.push_back({index, c * BATCH_CHUNK_SIZE,
+                                     std::min(message.size(), (c + 1) * BATCH_CHUNK_SIZE), split});
+        }
+        for (BatchTask &chunk : split->chunks)
+        {
+            pool.spawn(worker, &chunk);
+        }
+    }
+
+    /**
+     * scores one message of the batch into its result, or splits it if it is big and there are other workers
+     * to share it with (and no early exit), unless its verdict is cached or it is a near copy of spam.
+     * @param index- the index of the message.
+     * @param worker- the index of the worker.
+     * @param pool- the scheduler.
+     */
+    void scoreItem(size_t index, unsigned int worker, WorkStealingPool<BatchTask> &pool)
+    {
+        const BatchItem &item = _items[index];
+        BatchResult &result = _results[index];
+        MessageInput &input = _inputs[worker];
+        try
+        {
+            std::string_view message = item.path.empty() ? item.slice : input.open(item.path);
+            std::shared_ptr<const ScoringEngine> engine = _engine.get();
+            MessageKey key = {};
+            if (!lookUp(*engine, message, key, result))
+            {
+                // with early exit a message is scored front to back, most spam is over with long before a chunk
+                // ends
+                if (message.size() >= BATCH_SPLIT_MIN && pool.workers() > 1 && !_options.earlyExit &&
+                    engine->canSplit())
+                {
+                    split(index, message, std::move(engine), key, input, worker, pool);
+                    input.close();
+                    return;
+                }
+                score(*engine, key, message, _buffers[worker], result);
+            }
+            classify(message, result);
+        }
+        catch (const std::exception &ex)
+        {
+            result.failed = true;
+            result.error = ex.what();
+        }
+        input.close();
+        finish(index);
+    }
+
+    /**
+     * scores one chunk of a split message, and when it is the last one to finish, the whole message's result.
+     * @param chunk- the chunk.
+     * @param worker- the index of the worker.
+     */
+    void scoreChunk(const BatchTask &chunk, unsigned int worker)
+    {
+        SplitMessage *split = chunk.split;
+        try
+        {
+            split->score.fetch_add(split->engine->scoreChunk(split->message, chunk.begin, chunk.end,
+                                                             _buffers[worker]), std::memory_order_relaxed);
+        }
+        catch (const std::exception &ex)
+        {
+            std::lock_guard<std::mutex> guard(split->lock);
+            split->error = ex.what();
+        }
+        if (split->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        {
+            return;
+        }
+        size_t index = chunk.index;
+        BatchResult &result = _results[index];
+        result.score = split->score.load(std::memory_order_relaxed);
+        if (!split->error.empty())
+        {
+            result.failed = true;
+            result.error = split->error;
+        }
+        remember(*split->engine, split->key, result);
+        classify(split->message, result);
+        delete split;
+        finish(index);
+    }
+
+    /**
+     * marks a message as done and wakes up the writer.
+     * @param index- the index of the message.
+     */
+    void finish(size_t index)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _done[index].store(true, std::memory_order_release);
+        }
+        _ready.notify_one();
+    }
+
+    /**
+     * writes the verdict line of a message: its name, score and verdict separated by tabs.
+     * @param index- the index of the message.
+     * @param out- the stream to write to.
+     */
+    void writeResult(size_t index, std::ostream &out) const
+    {
+        const BatchResult &result = _results[index];
+        if (result.failed)
+        {
+            out << _items[index].name << '\t' << '-' << '\t' << BATCH_ERROR << ' ' << result.error << '\n';
+        }
+        else
+        {
+            out << _items[index].name << '\t' << result.score << (result.stopped ? "+" : "")
+                << (result.nearDuplicate ? "~" : "") << '\t'
+                << _engine.verdict(result.score) << '\n';
+        }
+    }
+
+    /**
+     * scores all the collected messages on a work stealing pool, calling finish(index) for each. the messages
+     * are dealt out to the workers round robin up front, and from then on a worker that runs out steals from the
+     * others, so one huge message only holds up the worker that got it until the others steal its chunks.
+     */
+    void scoreAll()
+    {
+        WorkStealingPool<BatchTask> pool(_options.threads);
+        _inputs = std::vector<MessageInput>(pool.workers());
+        _buffers = std::vector<std::string>(pool.workers());
+        std::vector<BatchTask> tasks(_items.size());
+        for (size_t i = 0; i < _items.size(); i++)
+        {
+            tasks[i] = {i, 0, 0, nullptr};
+            pool.spawn((unsigned int) (i % pool.workers()), &tasks[i]);
+        }
+        pool.run([this, &pool](BatchTask *task, unsigned int worker)
+                 {
+                     if (task->split == nullptr)
+                     {
+                         scoreItem(task->index, worker, pool);
+                     }
+                     else
+                     {
+                         scoreChunk(*task, worker);
+                     }
+                 });
+        _inputs.clear();
+    }
+
+    /**
+     * scores one message handed over by the ingest, calling finish(index) for it.
+     * @param ingested- the message.
+     * @param ingest- the ingest, its slot is given back to it.
+     * @param input- the worker's input, for the messages too big for the slots.
+     * @param buffer- the worker's fold buffer.
+     */
+    void scoreIngested(const IngestedMessage &ingested, MessageInput &input, MessageIngest &ingest,
+                       std::string &buffer)
+    {
+        BatchResult &result = _results[ingested.index];
+        try
+        {
+            if (!ingested.error.empty())
+            {
+                throw std::runtime_error(ingested.error);
+            }
+            std::string_view message = ingested.oversized ? input.open(_items[ingested.index].path) :
+                                       ingested.message;
+            std::shared_ptr<const ScoringEngine> engine = _engine.get();
+            MessageKey key = {};
+            if (!lookUp(*engine, message, key, result))
+            {
+                score(*engine, key, message, buffer, result);
+            }
+            classify(message, result);
+        }
+        catch (const std::exception &ex)
+        {
+            result.failed = true;
+            result.error = ex.what();
+        }
+        input.close();
+        ingest.release(ingested.slot);
+        finish(ingested.index);
+    }
+
+    /**
+     * scores all the collected messages as the ingest reads them, calling finish(index) for each. one thread
+     * runs the ingest, which reads the message files ahead into its slots, and the workers score whatever it
+     * has read (the slices of an mbox, which are already in memory, go to the workers straight away).
+     */
+    void scoreIngestedAll()
+    {
+        MessageIngest ingest(_options.backend, _options.depth);
+        std::deque<IngestedMessage> ready;
+        bool ingested = false;
+        std::mutex lock;
+        std::condition_variable readyChanged;
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < _items.size(); i++)
+        {
+            paths.push_back(_items[i].path);
+            if (_items[i].path.empty())
+            {
+                ready.push_back({i, _items[i].slice, NO_SLOT, false, ""});
+            }
+        }
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < _options.threads; t++)
+        {
+            workers.emplace_back([this, &ingest, &ready, &ingested, &lock, &readyChanged]
+                                 {
+                                     MessageInput input;
+                                     std::string buffer;
+                                     while (true)
+                                     {
+                                         std::unique_lock<std::mutex> guard(lock);
+                                         readyChanged.wait(guard, [&ready, &ingested]
+                                         { return ingested || !ready.empty(); });
+                                         if (ready.empty())
+                                         {
+                                             return;
+                                         }
+                                         IngestedMessage message = std::move(ready.front());
+                                         ready.pop_front();
+                                         guard.unlock();
+                                         scoreIngested(message, input, ingest, buffer);
+                                     }
+                                 });
+        }
+        std::string failure;
+        try
+        {
+            ingest.run(paths, [&ready, &lock, &readyChanged](IngestedMessage &&message)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    ready.push_back(std::move(message));
+                }
+                readyChanged.notify_one();
+            });
+        }
+        catch (const std::exception &ex)
+        {
+            failure = ex.what();
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ingested = true;
+        }
+        readyChanged.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        // if the ingest broke down, the messages it never handed over fail with its error
+        for (size_t i = 0; i < _items.size() && !failure.empty(); i++)
+        {
+            if (!_done[i].load(std::memory_order_acquire))
+            {
+                _results[i].failed = true;
+                _results[i].error = failure;
+                finish(i);
+            }
+        }
+    }
+
+    /**
+     * scores all the collected messages on a pipeline of stages, calling finish(index) for each.
+     */
+    void scorePipelined()
+    {
+        ScoringPipeline pipeline(_engine, *_options.pipeline);
+        pipeline.start([this](ScoringItem *item)
+                       {
+                           size_t index = item->id;
+                           BatchResult &result = _results[index];
+                           result.score = item->score;
+                           result.failed = item->failed;
+                           result.stopped = item->stopped;
+                           result.nearDuplicate = item->nearDuplicate;
+                           result.error = item->error;
+                           delete item;
+                           finish(index);
+                       });
+        for (size_t i = 0; i < _items.size(); i++)
+        {
+            auto *item = new ScoringItem();
+            item->id = i;
+            item->path = _items[i].path;
+            item->message = _items[i].slice;
+            pipeline.submit(item);
+        }
+        pipeline.finish();
+    }
+
+public:
+    /**
+     * constructor.
+     * @param engine- the engine to score with, shared by all the workers.
+     * @param options- how to score the batch.
+     */
+    BatchScorer(const LiveEngine &engine, const BatchOptions &options) : _engine(engine), _options(options)
+    {
+        _options.threads = std::max(_options.threads, 1U);
+    }
+
+    /**
+     * trains the Bayes classifier on every message of a batch.
+     * @param input- a directory, an mbox file or a list of paths.
+     * @param spam- true if the messages are spam, false if they are ham.
+     * @return- the number of messages trained on.
+     */
+    size_t train(const std::string &input, bool spam)
+    {
+        if (_options.bayes == nullptr)
+        {
+            throw std::runtime_error("no Bayes classifier to train");
+        }
+        collect(input);
+        MessageInput message;
+        for (const BatchItem &item : _items)
+        {
+            _options.bayes->train(item.path.empty() ? item.slice : message.open(item.path), spam);
+            message.close();
+        }
+        size_t count = _items.size();
+        _items.clear();
+        _mbox.close();
+        return count;
+    }
+
+    /**
+     * scores every message of a batch and writes one verdict line per message, in input order.
+     * @param input- a directory, an mbox file or a list of paths.
+     * @param out- the stream to write the verdict lines to.
+     * @return- the number of messages that couldn't be scored.
+     */
+    size_t run(const std::string &input, std::ostream &out)
+    {
+        collect(input);
+        _results = std::vector<BatchResult>(_items.size());
+        _done = std::vector<std::atomic<bool>>(_items.size());
+        std::thread scorer([this]
+                           {
+                               if (_options.pipeline != nullptr)
+                               {
+                                   scorePipelined();
+                               }
+                               else if (_options.backend == INGEST_MMAP)
+                               {
+                                   scoreAll();
+                               }
+                               else
+                               {
+                                   scoreIngestedAll();
+                               }
+                           });
+        size_t failures = 0;
+        for (size_t i = 0; i < _items.size(); i++)
+        {
+            if (!_done[i].load(std::memory_order_acquire))
+            {
+                out.flush();
+                std::unique_lock<std::mutex> guard(_lock);
+                _ready.wait(guard, [this, i]
+                { return _done[i].load(std::memory_order_acquire); });
+            }
+            writeResult(i, out);
+            failures += _results[i].failed;
+        }
+        scorer.join();
+        out.flush();
+        return failures;
+    }
+};
+
+#endif //SPAMDETECTOR_BATCHSCORER_HPP
@@ -0,0 +1,299 @@
+#include <string_view>
+#include <vector>
+#include <shared_mutex>
+#include <mutex>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "hashMap.hpp"
+#include "wordSplitter.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BAYESCLASSIFIER_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_BAYESCLASSIFIER_HPP
+#define SPAMDETECTOR_BAYESCLASSIFIER_HPP
+
+#define BAYES_BYTES_MAX (64UL << 10)
+#define BAYES_VOCABULARY_MAX (1UL << 20)
+
+/**
+ * how many times a token was seen in the spam and in the ham the classifier was trained on.
+ */
+struct TokenCounts
+{
+    uint32_t spam;
+    uint32_t ham;
+};
+
+/**
+ * the coefficients of log2(1 + t) ~ t * (c0 + t * (c1 + ... + t * c5)) over 0 <= t < 1, a least squares fit
+ * that is off by at most 5e-6.
+ */
+static const float LOG2_COEFFICIENTS[6] = {1.44251696f, -0.71789728f, 0.45688866f, -0.27735293f, 0.12190201f,
+                                           -0.02606180f};
+
+/**
+ * the natural log of a positive float, by splitting it into its exponent and its mantissa and running the
+ * mantissa through the LOG2_COEFFICIENTS polynomial (the scalar twin of the AVX2 one in logRatioSumAvx2).
+ * @param x- the float.
+ * @return- its log.
+ */
+inline float fastLog(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    auto exponent = (float) ((int) (bits >> 23) - 127);
+    bits = (bits & 0x7FFFFF) | 0x3F800000;
+    float t;
+    std::memcpy(&t, &bits, sizeof(t));
+    t -= 1.0f;
+    float p = LOG2_COEFFICIENTS[5];
+    for (int k = 4; k >= 0; k--)
+    {
+        p = p * t + LOG2_COEFFICIENTS[k];
+    }
+    return (exponent + p * t) * 0.69314718f;
+}
+
+/**
+ * sums log((spam[i] + 1) / (ham[i] + 1)) over the tokens of a message, one token at a time.
+ * @param spam- the spam counts of the tokens.
+ * @param ham- their ham counts.
+ * @param count- the number of tokens.
+ * @return- the sum.
+ */
+inline double logRatioSumScalar(const float *spam, const float *ham, size_t count)
+{
+    double sum = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        sum += fastLog((spam[i] + 1.0f) / (ham[i] + 1.0f));
+    }
+    return sum;
+}
+
+#ifdef BAYESCLASSIFIER_X86
+
+/**
+ * sums log((spam[i] + 1) / (ham[i] + 1)) over the tokens of a message with AVX2, 8 tokens to a vector: the
+ * ratios are divided out, split into exponents and mantissas, and the mantissas go through the LOG2_COEFFICIENTS
+ * polynomial, the logs piling up in one vector that is added across at the end. the tail is left to
+ * logRatioSumScalar.
+ * @param spam- the spam counts of the tokens.
+ * @param ham- their ham counts.
+ * @param count- the number of tokens.
+ * @return- the sum.
+ */
+__attribute__((target("avx2")))
+inline double logRatioSumAvx2(const float *spam, const float *ham, size_t count)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256i mantissa = _mm256_set1_epi32(0x7FFFFF);
+    const __m256i bias = _mm256_set1_epi32(127);
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 ratio = _mm256_div_ps(_mm256_add_ps(_mm256_loadu_ps(spam + i), one),
+                                     _mm256_add_ps(_mm256_loadu_ps(ham + i), one));
+        __m256i bits = _mm256_castps_si256(ratio);
+        __m256 exponent = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), bias));
+        __m256 t = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, mantissa),
+                                                                       _mm256_castps_si256(one))), one);
+        __m256 p = _mm256_set1_ps(LOG2_COEFFICIENTS[5]);
+        for (int k = 4; k >= 0; k--)
+        {
+            p = _mm256_add_ps(_mm256_mul_ps(p, t), _mm256_set1_ps(LOG2_COEFFICIENTS[k]));
+        }
+        sum = _mm256_add_ps(sum, _mm256_add_ps(exponent, _mm256_mul_ps(p, t)));
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, sum);
+    double total = 0;
+    for (float lane : lanes)
+    {
+        total += lane;
+    }
+    return total * 0.69314718 + logRatioSumScalar(spam + i, ham + i, count - i);
+}
+
+#endif
+
+/**
+ * a multinomial naive Bayes classifier over the words of messages (case insensitive for ASCII, see hashWord),
+ * as a second signal next to the phrase score. the tokens are kept by their 64 bit hashes, in a HashMap from
+ * token to its spam and ham counts, and trained online: a message is split outside the lock and then every one
+ * of its tokens is counted with a single probe upsert. the vocabulary stops growing at BAYES_VOCABULARY_MAX
+ * tokens, after that only the tokens it has are counted.
+ * a message is classified by the log odds of spam over ham, log(spam messages / ham messages) plus, for every
+ * known token, log(P(token | spam) / P(token | ham)) with add one smoothing, which is
+ * log((spam count + 1) / (ham count + 1)) + log((ham tokens + vocabulary) / (spam tokens + vocabulary)). the counts
+ * of the tokens are gathered under the lock and the logs are summed after it, vectorized.
+ * its probability goes into the score as points: weight * (2p - 1), from -weight for sure ham to +weight for sure
+ * spam, nothing until it was trained on both.
+ */
+class BayesClassifier
+{
+private:
+    mutable std::shared_mutex _lock;
+    HashMap<uint64_t, TokenCounts> _tokens;
+    uint64_t _spamMessages;
+    uint64_t _hamMessages;
+    uint64_t _spamTokens;
+    uint64_t _hamTokens;
+    long long _weight;
+
+    /**
+     * splits a message into the hashes of its tokens.
+     * @param message- the message.
+     * @param tokens- set to the hashes, in order (a token that occurs twice is in it twice).
+     */
+    static void tokenize(std::string_view message, std::vector<uint64_t> &tokens)
+    {
+        tokens.clear();
+        splitWords(message, BAYES_BYTES_MAX, [&tokens](uint64_t token)
+        { tokens.push_back(token); });
+    }
+
+public:
+    /**
+     * constructor, for an untrained classifier.
+     * @param weight- the most points the classifier adds to (or takes off) a score.
+     */
+    explicit BayesClassifier(long long weight) : _spamMessages(0), _hamMessages(0), _spamTokens(0), _hamTokens(0),
+            _weight(weight)
+    {
+    }
+
+    /**
+     * trains the classifier on a message.
+     * @param message- the message.
+     * @param spam- true if it is spam, false if it is ham.
+     */
+    void train(std::string_view message, bool spam)
+    {
+        thread_local std::vector<uint64_t> tokens;
+        tokenize(message, tokens);
+        std::unique_lock<std::shared_mutex> guard(_lock);
+        size_t counted = 0;
+        for (uint64_t token : tokens)
+        {
+            TokenCounts *counts;
+            if (_tokens.size() < BAYES_VOCABULARY_MAX)
+            {
+                counts = &_tokens.upsert(token, {0, 0});
+            }
+            else if ((counts = _tokens.find(token)) == nullptr)
+            {
+                continue;
+            }
+            (spam ? counts->spam : counts->ham)++;
+            counted++;
+        }
+        (spam ? _spamMessages : _hamMessages)++;
+        (spam ? _spamTokens : _hamTokens) += counted;
+    }
+
+    /**
+     * classifies a message.
+     * @param message- the message.
+     * @return- the probability that it is spam, 0.5 until the classifier was trained on both spam and ham.
+     */
+    double probability(std::string_view message) const
+    {
+#ifdef BAYESCLASSIFIER_X86
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+        thread_local std::vector<uint64_t> tokens;
+        thread_local std::vector<float> spam;
+        thread_local std::vector<float> ham;
+        tokenize(message, tokens);
+        spam.clear();
+        ham.clear();
+        double logOdds;
+        {
+            std::shared_lock<std::shared_mutex> guard(_lock);
+            if (_spamMessages == 0 || _hamMessages == 0)
+            {
+                return 0.5;
+            }
+            for (uint64_t token : tokens)
+            {
+                const TokenCounts *counts = _tokens.find(token);
+                if (counts != nullptr)
+                {
+                    spam.push_back((float) counts->spam);
+                    ham.push_back((float) counts->ham);
+                }
+            }
+            auto vocabulary = (double) _tokens.size();
+            logOdds = std::log((double) _spamMessages / (double) _hamMessages) +
+                      (double) spam.size() * std::log((_hamTokens + vocabulary) / (_spamTokens + vocabulary));
+        }
+#ifdef BAYESCLASSIFIER_X86
+        if (avx2)
+        {
+            logOdds += logRatioSumAvx2(spam.data(), ham.data(), spam.size());
+        }
+        else
+#endif
+        {
+            logOdds += logRatioSumScalar(spam.data(), ham.data(), spam.size());
+        }
+        return 1 / (1 + std::exp(-logOdds));
+    }
+
+    /**
+     * the points the classifier gives a message.
+     * @param message- the message.
+     * @return- weight * (2p - 1) rounded, p being its probability of being spam.
+     */
+    long long points(std::string_view message) const
+    {
+        return std::llround((double) _weight * (2 * probability(message) - 1));
+    }
+
+    /**
+     * getter for the most points the classifier adds to (or takes off) a score.
+     * @return- the weight.
+     */
+    long long weight() const
+    {
+        return _weight;
+    }
+
+    /**
+     * getter for the number of spam messages trained on.
+     * @return- the number of spam messages.
+     */
+    uint64_t spamMessages() const
+    {
+        std::shared_lock<std::shared_mutex> guard(_lock);
+        return _spamMessages;
+    }
+
+    /**
+     * getter for the number of ham messages trained on.
+     * @return- the number of ham messages.
+     */
+    uint64_t hamMessages() const
+    {
+        std::shared_lock<std::shared_mutex> guard(_lock);
+        return _hamMessages;
+    }
+
+    /**
+     * getter for the number of distinct tokens seen.
+     * @return- the size of the vocabulary.
+     */
+    size_t vocabulary() const
+    {
+        std::shared_lock<std::shared_mutex> guard(_lock);
+        return _tokens.size();
+    }
+};
+
+#endif //SPAMDETECTOR_BAYESCLASSIFIER_HPP
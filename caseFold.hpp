@@ -0,0 +1,259 @@
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define CASEFOLD_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_CASEFOLD_HPP
+#define SPAMDETECTOR_CASEFOLD_HPP
+
+#define TWO_BYTE_LAST 0x7FF
+
+/**
+ * the table of lowercase code points for every code point that UTF-8 encodes in two bytes (U+0080 to U+07FF),
+ * covering Latin-1, Latin Extended-A, Greek, Cyrillic and Armenian. a code point maps to itself if it has no
+ * lowercase form, or if its lowercase form is encoded in a different number of bytes (so folding never changes
+ * the length of a text and can always be done in place).
+ */
+class TwoByteFoldTable
+{
+private:
+    uint16_t _lower[TWO_BYTE_LAST + 1];
+
+    /**
+     * maps a range of uppercase code points to lowercase ones at a fixed distance.
+     * @param first- the first uppercase code point.
+     * @param last- the last uppercase code point.
+     * @param delta- the distance to the lowercase code point.
+     */
+    void shift(uint16_t first, uint16_t last, uint16_t delta)
+    {
+        for (uint16_t c = first; c <= last; c++)
+        {
+            _lower[c] = c + delta;
+        }
+    }
+
+    /**
+     * maps a range of alternating uppercase and lowercase code points, every uppercase one followed by its
+     * lowercase one.
+     * @param first- the first uppercase code point.
+     * @param last- the last code point of the range.
+     */
+    void pairs(uint16_t first, uint16_t last)
+    {
+        for (uint16_t c = first; c < last; c += 2)
+        {
+            _lower[c] = c + 1;
+        }
+    }
+
+public:
+    /**
+     * constructor, fills the table.
+     */
+    TwoByteFoldTable() : _lower()
+    {
+        for (uint16_t c = 0; c <= TWO_BYTE_LAST; c++)
+        {
+            _lower[c] = c;
+        }
+        shift(0x00C0, 0x00D6, 0x20);
+        shift(0x00D8, 0x00DE, 0x20);
+        pairs(0x0100, 0x012F);
+        pairs(0x0132, 0x0137);
+        pairs(0x0139, 0x0148);
+        pairs(0x014A, 0x0177);
+        _lower[0x0178] = 0x00FF;
+        pairs(0x0179, 0x017E);
+        _lower[0x0386] = 0x03AC;
+        shift(0x0388, 0x038A, 0x25);
+        _lower[0x038C] = 0x03CC;
+        shift(0x038E, 0x038F, 0x3F);
+        shift(0x0391, 0x03A1, 0x20);
+        shift(0x03A3, 0x03AB, 0x20);
+        shift(0x0400, 0x040F, 0x50);
+        shift(0x0410, 0x042F, 0x20);
+        pairs(0x0460, 0x0481);
+        pairs(0x048A, 0x04BF);
+        shift(0x0531, 0x0556, 0x30);
+    }
+
+    /**
+     * the lowercase form of a two byte code point.
+     * @param c- the code point, U+0080 to U+07FF.
+     * @return- its lowercase code point, also a two byte one.
+     */
+    uint16_t lower(uint16_t c) const
+    {
+        return _lower[c];
+    }
+
+    /**
+     * the shared table.
+     * @return- the table, built on first use.
+     */
+    static const TwoByteFoldTable &get()
+    {
+        static const TwoByteFoldTable table;
+        return table;
+    }
+};
+
+/**
+ * folds a run of non ASCII bytes with the two byte table, until the first ASCII byte.
+ * anything that isn't a valid two byte sequence is copied as is.
+ * @param src- the bytes.
+ * @param dst- where the folded bytes go, may be 'src' itself.
+ * @param i- the position to start from, moved to the first ASCII byte after the run (or 'length').
+ * @param length- the number of bytes.
+ */
+inline void foldNonAscii(const unsigned char *src, unsigned char *dst, size_t &i, size_t length)
+{
+    const TwoByteFoldTable &table = TwoByteFoldTable::get();
+    while (i < length && src[i] >= 0x80)
+    {
+        unsigned char lead = src[i];
+        if (lead >= 0xC2 && lead <= 0xDF && i + 1 < length && (src[i + 1] & 0xC0) == 0x80)
+        {
+            uint16_t c = table.lower((uint16_t) (((lead & 0x1F) << 6) | (src[i + 1] & 0x3F)));
+            dst[i] = (unsigned char) (0xC0 | (c >> 6));
+            dst[i + 1] = (unsigned char) (0x80 | (c & 0x3F));
+            i += 2;
+        }
+        else
+        {
+            dst[i] = lead;
+            i++;
+        }
+    }
+}
+
+/**
+ * folds ASCII bytes with plain arithmetic until the first non ASCII byte.
+ * @param src- the bytes.
+ * @param dst- where the folded bytes go, may be 'src' itself.
+ * @param i- the position to start from, moved to the first non ASCII byte (or 'length').
+ * @param length- the number of bytes.
+ */
+inline void foldAsciiScalar(const unsigned char *src, unsigned char *dst, size_t &i, size_t length)
+{
+    for (; i < length && src[i] < 0x80; i++)
+    {
+        unsigned char c = src[i];
+        dst[i] = (unsigned char) ((unsigned int) (c - 'A') < 26 ? c + 0x20 : c);
+    }
+}
+
+#ifdef CASEFOLD_X86
+
+/**
+ * folds blocks of 32 bytes with AVX2 while they are all ASCII.
+ * @param src- the bytes.
+ * @param dst- where the folded bytes go, may be 'src' itself.
+ * @param i- the position to start from, moved to the first block that isn't all ASCII (or the tail).
+ * @param length- the number of bytes.
+ */
+__attribute__((target("avx2")))
+inline void foldAsciiAvx2(const unsigned char *src, unsigned char *dst, size_t &i, size_t length)
+{
+    const __m256i beforeA = _mm256_set1_epi8('A' - 1);
+    const __m256i afterZ = _mm256_set1_epi8('Z' + 1);
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        if (_mm256_movemask_epi8(bytes) != 0)
+        {
+            return;
+        }
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, beforeA), _mm256_cmpgt_epi8(afterZ, bytes));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_or_si256(bytes, _mm256_and_si256(upper, bit)));
+    }
+}
+
+/**
+ * folds blocks of 16 bytes with SSE2 while they are all ASCII.
+ * @param src- the bytes.
+ * @param dst- where the folded bytes go, may be 'src' itself.
+ * @param i- the position to start from, moved to the first block that isn't all ASCII (or the tail).
+ * @param length- the number of bytes.
+ */
+inline void foldAsciiSse2(const unsigned char *src, unsigned char *dst, size_t &i, size_t length)
+{
+    const __m128i beforeA = _mm_set1_epi8('A' - 1);
+    const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        if (_mm_movemask_epi8(bytes) != 0)
+        {
+            return;
+        }
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, beforeA), _mm_cmpgt_epi8(afterZ, bytes));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(bytes, _mm_and_si128(upper, bit)));
+    }
+}
+
+#endif
+
+/**
+ * lowercases a text: ASCII 32 (AVX2) or 16 (SSE2) bytes at a time, and the non ASCII runs with the two byte
+ * UTF-8 table. the folded text always has the same length as the original one.
+ * @param src- the text.
+ * @param length- the length of the text.
+ * @param dst- where the folded text goes, 'length' bytes, may be 'src' itself to fold in place.
+ */
+inline void foldCase(const char *src, size_t length, char *dst)
+{
+    const auto *in = reinterpret_cast<const unsigned char *>(src);
+    auto *out = reinterpret_cast<unsigned char *>(dst);
+#ifdef CASEFOLD_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    size_t i = 0;
+    while (i < length)
+    {
+#ifdef CASEFOLD_X86
+        if (avx2)
+        {
+            foldAsciiAvx2(in, out, i, length);
+        }
+        foldAsciiSse2(in, out, i, length);
+#endif
+        // the block the vector loop stopped at (or the tail) goes one byte at a time up to its first non ASCII
+        // byte, then the non ASCII run is folded and the vector loop picks up again after it
+        foldAsciiScalar(in, out, i, std::min(length, i + 32));
+        foldNonAscii(in, out, i, length);
+    }
+}
+
+/**
+ * lowercases a string in place.
+ * @param str- the string.
+ */
+inline void foldCase(std::string &str)
+{
+    foldCase(&str[0], str.size(), &str[0]);
+}
+
+/**
+ * lowercases a text into a reusable buffer, which only ever grows so scoring many messages with the same
+ * buffer doesn't allocate once it is big enough.
+ * @param src- the text.
+ * @param length- the length of the text.
+ * @param buffer- the buffer, resized to 'length' and filled with the folded text.
+ */
+inline void foldCase(const char *src, size_t length, std::string &buffer)
+{
+    buffer.resize(length);
+    foldCase(src, length, &buffer[0]);
+}
+
+#endif //SPAMDETECTOR_CASEFOLD_HPP
@@ -0,0 +1,295 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include "mimeWalker.hpp"
+#include "htmlStripper.hpp"
+#include "obfuscationFold.hpp"
+#include "nearDuplicate.hpp"
+#include "bayesClassifier.hpp"
+#include "wordSplitter.hpp"
+
+#define CHECK_ROUNDS 500
+#define CHECK_SEED 20261016
+#define CHECK_LENGTH_MAX 4096
+#define CHECK_PIECE_MAX 31
+#define CHECK_LOG_TOLERANCE 1e-4
+
+/**
+ * checks the SIMD kernels against their scalar twins on random inputs, the way the scorer runs them. the
+ * streaming decoders (base64, HTML) have their scalar path checked by feeding them the same text in pieces
+ * shorter than a vector block, which never reach the AVX2 kernel, and comparing with the text fed whole.
+ * the kernels that need AVX2 are skipped on a CPU without it.
+ */
+
+static std::mt19937 random32(CHECK_SEED);
+static size_t failures = 0;
+
+/**
+ * reports a mismatch.
+ * @param kernel- the kernel that disagrees with its twin.
+ * @param round- the round of random input it happened on.
+ */
+static void fail(const std::string &kernel, size_t round)
+{
+    std::cerr << kernel << ": vector and scalar paths differ on round " << round << std::endl;
+    failures++;
+}
+
+/**
+ * a random number below some bound.
+ * @param bound- the bound.
+ * @return- the number.
+ */
+static size_t below(size_t bound)
+{
+    return std::uniform_int_distribution<size_t>(0, bound - 1)(random32);
+}
+
+/**
+ * a random text made of pieces out of a list, with a random byte thrown in now and then.
+ * @param pieces- the pieces.
+ * @param count- the number of pieces.
+ * @return- the text, CHECK_LENGTH_MAX bytes at most.
+ */
+static std::string randomText(const char *const *pieces, size_t count)
+{
+    std::string text;
+    size_t length = below(CHECK_LENGTH_MAX);
+    while (text.size() < length)
+    {
+        if (below(16) == 0)
+        {
+            text += (char) below(256);
+        }
+        else
+        {
+            text += pieces[below(count)];
+        }
+    }
+    text.resize(length);
+    return text;
+}
+
+/**
+ * cuts a text into random pieces shorter than a vector block and hands them over one by one.
+ * @param text- the text.
+ * @param each- called as each(piece, length).
+ */
+template<typename eachT>
+static void inPieces(const std::string &text, const eachT &each)
+{
+    for (size_t i = 0; i < text.size();)
+    {
+        size_t length = std::min(text.size() - i, 1 + below(CHECK_PIECE_MAX));
+        each(text.data() + i, length);
+        i += length;
+    }
+}
+
+/**
+ * checks Base64Decoder::decodeAvx2 against the decoder's table loop.
+ */
+static void checkBase64()
+{
+    static const char *const pieces[] = {
+            "QUJD", "ZGVm", "aGlq", "a2xt", "bm9w", "cXJz", "dHV2", "d3h5", "ejAx", "MjM0", "NTY3", "ODkr", "Lw==",
+            "YQ=", "\r\n", "\n", " ", "!", "Zm9vYmFyYmF6cXV4cXV1eGZyZWRwbHVnaG9nZQ"
+    };
+    for (size_t round = 0; round < CHECK_ROUNDS; round++)
+    {
+        std::string text = randomText(pieces, sizeof(pieces) / sizeof(*pieces));
+        std::string whole(Base64Decoder::maxDecoded(text.size()), '\0');
+        Base64Decoder decoder;
+        size_t written = decoder.decode(text.data(), text.size(), &whole[0]);
+        written += decoder.finish(&whole[written]);
+        whole.resize(written);
+
+        std::string pieced;
+        std::string buffer(Base64Decoder::maxDecoded(CHECK_PIECE_MAX), '\0');
+        inPieces(text, [&decoder, &pieced, &buffer](const char *piece, size_t length)
+        {
+            pieced.append(buffer.data(), decoder.decode(piece, length, &buffer[0]));
+        });
+        pieced.append(buffer.data(), decoder.finish(&buffer[0]));
+        if (whole != pieced)
+        {
+            fail("Base64Decoder::decodeAvx2", round);
+        }
+    }
+}
+
+/**
+ * checks HtmlStripper::copyTextAvx2 against the stripper's byte loop.
+ */
+static void checkHtml()
+{
+    static const char *const pieces[] = {
+            "buy viagra now ", "plain text without markup, long enough to fill a vector block. ", "<p>", "</p>",
+            "<b>", "</b>", "<br/>", "&amp;", "&nbsp;", "&#x41;", "&#66;", "&bogus;", "a < b", "<!-- note -->",
+            "<!-->", "<a href=\"x>y\">", "<span title=it's>", "<script>var x = '<b>';</script>", "\xC3\xA9"
+    };
+    for (size_t round = 0; round < CHECK_ROUNDS; round++)
+    {
+        std::string text = randomText(pieces, sizeof(pieces) / sizeof(*pieces));
+        std::string whole;
+        stripHtml(text.data(), text.size(), whole);
+
+        HtmlStripper stripper;
+        std::string pieced;
+        std::string buffer(HtmlStripper::maxStripped(CHECK_PIECE_MAX), '\0');
+        inPieces(text, [&stripper, &pieced, &buffer](const char *piece, size_t length)
+        {
+            pieced.append(buffer.data(), stripper.strip(piece, length, &buffer[0]));
+        });
+        pieced.append(buffer.data(), stripper.finish(&buffer[0]));
+        if (whole != pieced)
+        {
+            fail("HtmlStripper::copyTextAvx2", round);
+        }
+    }
+}
+
+/**
+ * checks foldObfuscationAvx2 against foldObfuscationScalar, offsets included.
+ */
+static void checkObfuscation()
+{
+    static const char *const pieces[] = {
+            "v1agra ", "fr33 m0n3y ", "c@sh ", "$ave ", "0123456789:;<=>? ", "plain words go here ",
+            "\xD0\xB0", "\xE2\x80\x8B", "\xC2\xAD", "\xEF\xBC\xA1", "\xF0\x9D\x90\x9A"
+    };
+    for (size_t round = 0; round < CHECK_ROUNDS; round++)
+    {
+        std::string text = randomText(pieces, sizeof(pieces) / sizeof(*pieces));
+        const auto *in = reinterpret_cast<const unsigned char *>(text.data());
+        std::string scalar(text.size(), '\0');
+        std::vector<uint32_t> scalarOffsets(text.size());
+        size_t i = 0;
+        size_t o = 0;
+        foldObfuscationScalar(in, reinterpret_cast<unsigned char *>(&scalar[0]), i, o, text.size(), text.size(),
+                              scalarOffsets.data());
+        scalar.resize(o);
+        scalarOffsets.resize(o);
+
+        std::string vector(text.size(), '\0');
+        std::vector<uint32_t> vectorOffsets(text.size());
+        vector.resize(foldObfuscation(text.data(), text.size(), &vector[0], vectorOffsets.data()));
+        vectorOffsets.resize(vector.size());
+        if (scalar != vector || scalarOffsets != vectorOffsets)
+        {
+            fail("foldObfuscationAvx2", round);
+        }
+    }
+}
+
+#ifdef NEARDUPLICATE_X86
+
+/**
+ * checks minHashAvx2 against minHashScalar.
+ */
+static void checkMinHash()
+{
+    for (size_t round = 0; round < CHECK_ROUNDS; round++)
+    {
+        std::vector<uint64_t> shingles(below(CHECK_LENGTH_MAX));
+        for (uint64_t &shingle : shingles)
+        {
+            shingle = (uint64_t) random32() << 32 | random32();
+        }
+        uint32_t scalar[MINHASH_FUNCTIONS];
+        uint32_t vector[MINHASH_FUNCTIONS];
+        std::fill(scalar, scalar + MINHASH_FUNCTIONS, UINT32_MAX);
+        std::fill(vector, vector + MINHASH_FUNCTIONS, UINT32_MAX);
+        minHashScalar(shingles.data(), shingles.size(), scalar);
+        minHashAvx2(shingles.data(), shingles.size(), vector);
+        if (!std::equal(scalar, scalar + MINHASH_FUNCTIONS, vector))
+        {
+            fail("minHashAvx2", round);
+        }
+    }
+}
+
+#endif
+
+#ifdef BAYESCLASSIFIER_X86
+
+/**
+ * checks logRatioSumAvx2 against logRatioSumScalar, up to the rounding of summing the logs in another order.
+ */
+static void checkLogRatioSum()
+{
+    for (size_t round = 0; round < CHECK_ROUNDS; round++)
+    {
+        size_t count = below(CHECK_LENGTH_MAX);
+        std::vector<float> spam(count);
+        std::vector<float> ham(count);
+        for (size_t k = 0; k < count; k++)
+        {
+            spam[k] = (float) below(1 << (1 + below(20)));
+            ham[k] = (float) below(1 << (1 + below(20)));
+        }
+        double scalar = logRatioSumScalar(spam.data(), ham.data(), count);
+        double vector = logRatioSumAvx2(spam.data(), ham.data(), count);
+        if (std::fabs(scalar - vector) > CHECK_LOG_TOLERANCE * (1 + count))
+        {
+            fail("logRatioSumAvx2", round);
+        }
+    }
+}
+
+#endif
+
+#ifdef WORDSPLITTER_X86
+
+/**
+ * checks wordMaskAvx2 against wordMaskScalar.
+ */
+static void checkWordMask()
+{
+    static const char *const pieces[] = {"word ", "Mixed09 ", "a-b_c.d ", "\xC3\xA9t\xC3\xA9 ", "{|}~`@[\\]^ "};
+    for (size_t round = 0; round < CHECK_ROUNDS; round++)
+    {
+        std::string text = randomText(pieces, sizeof(pieces) / sizeof(*pieces));
+        const auto *in = reinterpret_cast<const unsigned char *>(text.data());
+        std::vector<uint64_t> scalar((text.size() + 63) / 64);
+        std::vector<uint64_t> vector(scalar.size());
+        wordMaskScalar(in, text.size(), scalar.data());
+        wordMaskAvx2(in, text.size(), vector.data());
+        if (scalar != vector)
+        {
+            fail("wordMaskAvx2", round);
+        }
+    }
+}
+
+#endif
+
+int main()
+{
+    checkBase64();
+    checkHtml();
+    checkObfuscation();
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        checkMinHash();
+        checkLogRatioSum();
+        checkWordMask();
+    }
+    else
+    {
+        std::cout << "no AVX2, only the streaming and folding kernels were checked" << std::endl;
+    }
+#endif
+    if (failures != 0)
+    {
+        std::cerr << failures << " mismatches" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "every kernel agrees with its scalar twin" << std::endl;
+    return EXIT_SUCCESS;
+}
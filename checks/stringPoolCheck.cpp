@@ -0,0 +1,127 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include "hashMap.hpp"
+#include "stringPool.hpp"
+
+#define CHECK_SEED 20261016
+#define CHECK_PHRASES 20000
+#define CHECK_OPERATIONS 200000
+
+/**
+ * checks the interned key mode of HashMap: two InternedMaps share one StringPool and are kept in step with a
+ * HashMap<std::string, int> through random inserts, updates and erases, then every phrase is looked up in all of
+ * them the way a reader would, through pool.find.
+ */
+
+static size_t failures = 0;
+
+/**
+ * reports a failed check.
+ * @param what- what went wrong.
+ */
+static void fail(const std::string &what)
+{
+    std::cerr << what << std::endl;
+    failures++;
+}
+
+int main()
+{
+    std::mt19937 random32(CHECK_SEED);
+    std::vector<std::string> phrases;
+    for (size_t k = 0; k < CHECK_PHRASES; k++)
+    {
+        phrases.push_back("phrase " + std::to_string(random32() % (CHECK_PHRASES / 2)) + " of " +
+                          std::to_string(k % 7));
+    }
+
+    StringPool pool;
+    InternedMap<int> scores;
+    InternedMap<int> hits;
+    HashMap<std::string, int> expected;
+    for (size_t k = 0; k < CHECK_OPERATIONS; k++)
+    {
+        const std::string &phrase = phrases[random32() % phrases.size()];
+        InternedKey key = pool.intern(phrase);
+        int value = (int) (random32() % 100);
+        if (random32() % 4 == 0)
+        {
+            scores.erase(key);
+            expected.erase(phrase);
+        }
+        else if (scores.containsKey(key))
+        {
+            *scores.find(key) = value;
+            *expected.find(phrase) = value;
+        }
+        else
+        {
+            scores.insert(key, value);
+            expected.insert(phrase, value);
+        }
+        if (!hits.insert(key, 1))
+        {
+            (*hits.find(key))++;
+        }
+    }
+
+    // the maps keying on the same phrase share its characters in the pool
+    HashMap<std::string, int> distinct;
+    for (const std::string &phrase : phrases)
+    {
+        distinct.insert(phrase, 0);
+    }
+    if (pool.size() > distinct.size())
+    {
+        fail("the pool has " + std::to_string(pool.size()) + " strings for " + std::to_string(distinct.size()) +
+             " distinct phrases");
+    }
+    if (scores.size() != expected.size())
+    {
+        fail("the interned map has " + std::to_string(scores.size()) + " phrases instead of " +
+             std::to_string(expected.size()));
+    }
+    size_t counted = 0;
+    for (const std::string &phrase : phrases)
+    {
+        InternedKey key = {};
+        if (!pool.find(phrase, key))
+        {
+            continue;
+        }
+        if (pool.str(key) != phrase)
+        {
+            fail("\"" + phrase + "\" interned as \"" + pool.str(key) + "\"");
+        }
+        const int *score = scores.find(key);
+        const int *wanted = expected.find(phrase);
+        if ((score == nullptr) != (wanted == nullptr) || (score != nullptr && *score != *wanted))
+        {
+            fail("\"" + phrase + "\" has the wrong score in the interned map");
+        }
+    }
+    for (auto i = hits.begin(); i != hits.end(); i++)
+    {
+        counted += (*i).second;
+    }
+    if (counted != CHECK_OPERATIONS)
+    {
+        fail("the hit counts add up to " + std::to_string(counted) + " instead of " +
+             std::to_string(CHECK_OPERATIONS));
+    }
+    InternedKey missing = {};
+    if (pool.find(std::string("not a phrase"), missing))
+    {
+        fail("a string that was never interned was found");
+    }
+    if (failures != 0)
+    {
+        std::cerr << failures << " failures" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << pool.size() << " phrases in " << pool.bytes() << " pooled bytes, shared by both maps" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,372 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashMap.hpp"
+
+#ifndef SPAMDETECTOR_COMPILEDDATABASE_HPP
+#define SPAMDETECTOR_COMPILEDDATABASE_HPP
+
+#define SDB_MAGIC "SPAMSDB"
+#define SDB_MAGIC_SIZE 8
+#define SDB_VERSION 2
+#define SDB_BYTE_ORDER 0x01020304U
+#define SDB_ALIGNMENT 8
+#define SDB_TEMP_SUFFIX ".tmp"
+
+/**
+ * the header at the start of a compiled phrase database. all the offsets are from the start of the file, and every
+ * section starts on an SDB_ALIGNMENT boundary so it can be used in place once the file is mapped.
+ * the checksum covers everything after the header.
+ */
+struct SdbHeader
+{
+    char magic[SDB_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t fileSize;
+    uint64_t checksum;
+    uint64_t phraseCount;
+    uint64_t entriesOffset;
+    uint64_t charsOffset;
+    uint64_t charsSize;
+};
+
+/**
+ * a phrase of a compiled database: where its characters are in the character section and its score.
+ */
+struct SdbEntry
+{
+    uint64_t offset;
+    uint32_t length;
+    int32_t score;
+};
+
+/**
+ * the checksum of a compiled database body, FNV-1a over 64 bit words (the body is always a whole number of
+ * words) with a final mix. it catches truncated, torn and bit flipped files, it isn't meant to stop tampering.
+ * @param data- the body.
+ * @param size- the size of the body, a multiple of 8.
+ * @return- the 64 bit checksum.
+ */
+inline uint64_t sdbChecksum(const char *data, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * rounds a size up to the section alignment.
+ * @param size- the size.
+ * @return- the smallest multiple of SDB_ALIGNMENT that is at least 'size'.
+ */
+inline uint64_t sdbAlign(uint64_t size)
+{
+    return (size + SDB_ALIGNMENT - 1) & ~(uint64_t) (SDB_ALIGNMENT - 1);
+}
+
+/**
+ * writes a compiled phrase database: the phrases sorted (so the same phrases always compile to the same bytes) and
+ * their characters back to back. the file is written next to its path and renamed over it once complete, so a
+ * reader never maps a half written database.
+ * the phrases are expected to be normalized already (case folded, deduplicated), the way loadDatabase leaves them.
+ * @param phrases- the map from phrase to score.
+ * @param path- the path of the compiled database.
+ */
+inline void compileDatabase(const HashMap<std::string, int> &phrases, const std::string &path)
+{
+    if (phrases.size() >= UINT32_MAX)
+    {
+        throw std::runtime_error("can't compile more than " + std::to_string(UINT32_MAX - 1) + " phrases");
+    }
+    std::vector<std::pair<std::string, int>> sorted;
+    sorted.reserve(phrases.size());
+    for (auto i = phrases.begin(); i != phrases.end(); i++)
+    {
+        if ((*i).first.empty() || (*i).first.size() > UINT32_MAX)
+        {
+            throw std::runtime_error("can't compile a phrase of length " + std::to_string((*i).first.size()));
+        }
+        sorted.emplace_back((*i).first, (*i).second);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<SdbEntry> entries(sorted.size());
+    std::string chars;
+    for (size_t k = 0; k < sorted.size(); k++)
+    {
+        const std::string &phrase = sorted[k].first;
+        entries[k] = {chars.size(), (uint32_t) phrase.size(), sorted[k].second};
+        chars += phrase;
+    }
+
+    SdbHeader header = {};
+    std::memcpy(header.magic, SDB_MAGIC, sizeof(SDB_MAGIC));
+    header.version = SDB_VERSION;
+    header.byteOrder = SDB_BYTE_ORDER;
+    header.phraseCount = entries.size();
+    header.entriesOffset = sdbAlign(sizeof(SdbHeader));
+    header.charsOffset = sdbAlign(header.entriesOffset + entries.size() * sizeof(SdbEntry));
+    header.charsSize = chars.size();
+    header.fileSize = sdbAlign(header.charsOffset + chars.size());
+
+    std::string image(header.fileSize, '\0');
+    std::memcpy(&image[header.entriesOffset], entries.data(), entries.size() * sizeof(SdbEntry));
+    std::memcpy(&image[header.charsOffset], chars.data(), chars.size());
+    header.checksum = sdbChecksum(image.data() + sizeof(SdbHeader), image.size() - sizeof(SdbHeader));
+    std::memcpy(&image[0], &header, sizeof(SdbHeader));
+
+    std::string temp = path + SDB_TEMP_SUFFIX;
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("can't create " + temp + ": " + std::strerror(errno));
+    }
+    for (size_t written = 0; written < image.size();)
+    {
+        ssize_t put = ::write(fd, image.data() + written, image.size() - written);
+        if (put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (put <= 0)
+        {
+            int saved = errno;
+            ::close(fd);
+            ::unlink(temp.c_str());
+            throw std::runtime_error("can't write " + temp + ": " + std::strerror(saved));
+        }
+        written += put;
+    }
+    bool synced = ::fsync(fd) == 0;
+    int saved = errno;
+    if (::close(fd) != 0 && synced)
+    {
+        synced = false;
+        saved = errno;
+    }
+    if (!synced)
+    {
+        ::unlink(temp.c_str());
+        throw std::runtime_error("can't write " + temp + ": " + std::strerror(saved));
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        saved = errno;
+        ::unlink(temp.c_str());
+        throw std::runtime_error("can't write " + path + ": " + std::strerror(saved));
+    }
+}
+
+/**
+ * a compiled phrase database mapped read only into memory. opening it checks the header, the layout and the
+ * checksum, after which the phrases are read as views into the mapping: nothing is parsed, folded or
+ * deduplicated, and a phrase is only copied once, into whatever map is built from it. the mapping is shared by
+ * every process that opens the same file.
+ */
+class CompiledDatabase
+{
+private:
+    const char *_data;
+    size_t _size;
+    const SdbHeader *_header;
+    const SdbEntry *_entries;
+    const char *_chars;
+
+    /**
+     * checks that the mapped file is a well formed compiled database.
+     * @param path- the path of the file, for errors.
+     */
+    void validate(const std::string &path) const
+    {
+        if (_size < sizeof(SdbHeader) || std::memcmp(_header->magic, SDB_MAGIC, sizeof(SDB_MAGIC)) != 0)
+        {
+            throw std::runtime_error(path + " isn't a compiled database");
+        }
+        if (_header->version != SDB_VERSION || _header->byteOrder != SDB_BYTE_ORDER)
+        {
+            throw std::runtime_error(path + " was compiled as version " + std::to_string(_header->version) +
+                                     ", this build reads version " + std::to_string(SDB_VERSION));
+        }
+        const SdbHeader &h = *_header;
+        bool laidOut = h.fileSize == _size && _size % SDB_ALIGNMENT == 0 &&
+                       h.entriesOffset >= sizeof(SdbHeader) && h.entriesOffset % SDB_ALIGNMENT == 0 &&
+                       h.entriesOffset <= _size && h.charsOffset <= _size &&
+                       h.phraseCount <= (_size - h.entriesOffset) / sizeof(SdbEntry) &&
+                       h.charsOffset >= h.entriesOffset + h.phraseCount * sizeof(SdbEntry) &&
+                       h.charsSize <= _size - h.charsOffset;
+        if (!laidOut)
+        {
+            throw std::runtime_error(path + " is truncated or corrupt");
+        }
+        if (sdbChecksum(_data + sizeof(SdbHeader), _size - sizeof(SdbHeader)) != h.checksum)
+        {
+            throw std::runtime_error(path + " failed its checksum");
+        }
+        for (size_t k = 0; k < h.phraseCount; k++)
+        {
+            if (_entries[k].offset > h.charsSize || _entries[k].length > h.charsSize - _entries[k].offset)
+            {
+                throw std::runtime_error(path + " is corrupt");
+            }
+        }
+    }
+
+public:
+    /**
+     * constructor, maps and checks a compiled database.
+     * @param path- the path of the compiled database.
+     */
+    explicit CompiledDatabase(const std::string &path) : _data(nullptr), _size(0), _header(nullptr),
+            _entries(nullptr), _chars(nullptr)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("can't open database " + path + ": " + std::strerror(errno));
+        }
+        struct stat info = {};
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(SdbHeader))
+        {
+            ::close(fd);
+            throw std::runtime_error(path + " isn't a compiled database");
+        }
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        int saved = errno;
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            throw std::runtime_error("can't map database " + path + ": " + std::strerror(saved));
+        }
+        _data = static_cast<const char *>(mapped);
+        _size = info.st_size;
+        _header = reinterpret_cast<const SdbHeader *>(_data);
+        _entries = reinterpret_cast<const SdbEntry *>(_data + _header->entriesOffset % _size);
+        _chars = _data + _header->charsOffset % _size;
+        try
+        {
+            validate(path);
+        }
+        catch (...)
+        {
+            munmap(const_cast<char *>(_data), _size);
+            throw;
+        }
+    }
+
+    CompiledDatabase(const CompiledDatabase &) = delete;
+
+    CompiledDatabase &operator=(const CompiledDatabase &) = delete;
+
+    /**
+     * destructor, unmaps the file.
+     */
+    ~CompiledDatabase()
+    {
+        munmap(const_cast<char *>(_data), _size);
+    }
+
+    /**
+     * states wether a file is a compiled database, by its magic (the rest of it is checked when it is opened).
+     * @param path- the path of the file.
+     * @return- true if the file starts with SDB_MAGIC and false otherwise (unreadable files included).
+     */
+    static bool isCompiled(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        char magic[SDB_MAGIC_SIZE] = {};
+        ssize_t got = ::read(fd, magic, sizeof(magic));
+        ::close(fd);
+        return got == (ssize_t) sizeof(magic) && std::memcmp(magic, SDB_MAGIC, sizeof(SDB_MAGIC)) == 0;
+    }
+
+    /**
+     * getter for a phrase.
+     * @param k- the index of the phrase, below size().
+     * @return- a view of the phrase, into the mapping.
+     */
+    std::string_view phrase(size_t k) const
+    {
+        return std::string_view(_chars + _entries[k].offset, _entries[k].length);
+    }
+
+    /**
+     * getter for the score of a phrase.
+     * @param k- the index of the phrase, below size().
+     * @return- the score.
+     */
+    int score(size_t k) const
+    {
+        return _entries[k].score;
+    }
+
+    /**
+     * getter for the number of phrases.
+     * @return- the number of phrases.
+     */
+    size_t size() const
+    {
+        return _header->phraseCount;
+    }
+
+    /**
+     * getter for the format version the database was compiled as.
+     * @return- the version.
+     */
+    uint32_t version() const
+    {
+        return _header->version;
+    }
+
+    /**
+     * getter for the checksum of the database, which also identifies the build of the rules it holds.
+     * @return- the checksum.
+     */
+    uint64_t checksum() const
+    {
+        return _header->checksum;
+    }
+
+    /**
+     * copies every phrase into a map, through its bulk insert of views (the phrases are already normalized and
+     * distinct, so nothing is folded or deduplicated, and each is copied once, from the mapping into the map).
+     * @param phrases- the map to fill.
+     */
+    void copyTo(HashMap<std::string, int> &phrases) const
+    {
+        std::vector<std::string_view> keys;
+        std::vector<int> values;
+        keys.reserve(size());
+        values.reserve(size());
+        for (size_t k = 0; k < size(); k++)
+        {
+            keys.push_back(phrase(k));
+            values.push_back(score(k));
+        }
+        phrases.insertAll(keys, values);
+    }
+};
+
+#endif //SPAMDETECTOR_COMPILEDDATABASE_HPP
@@ -0,0 +1,184 @@
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSVSCANNER_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_CSVSCANNER_HPP
+#define SPAMDETECTOR_CSVSCANNER_HPP
+
+#define CSV_BLOCK 32
+#define CSV_NO_DELIMITER SIZE_MAX
+
+/**
+ * a simdcsv style scanner for line based "field,field" files, splits a whole text into rows without looking at
+ * its bytes one by one.
+ * every 32 byte block is compared against '\n' and the delimiter at once (one AVX2 compare, or two SSE2 ones),
+ * giving a bitmask of the newlines and one of the delimiters in the block. the rows then fall out of the masks:
+ * every set newline bit ends a row, and the highest delimiter bit below it (or the last one carried over from
+ * earlier blocks of the same row) is the last delimiter of that row. the scalar fallback builds the same masks a
+ * byte at a time, and also handles the tail shorter than a block.
+ * there is no quoting, a row is split at its last delimiter.
+ */
+class CsvScanner
+{
+private:
+    enum Kernel
+    {
+        SCALAR, SSE2, AVX2
+    };
+
+    char _delimiter;
+    Kernel _kernel;
+
+    /**
+     * the scalar kernel, masks a block of up to 32 bytes.
+     * @param block- the bytes.
+     * @param length- the number of bytes, at most CSV_BLOCK.
+     * @param delimiters- set to the mask of the delimiters.
+     * @return- the mask of the newlines.
+     */
+    uint32_t masksScalar(const unsigned char *block, size_t length, uint32_t &delimiters) const
+    {
+        uint32_t newlines = 0;
+        delimiters = 0;
+        for (size_t i = 0; i < length; i++)
+        {
+            newlines |= uint32_t(block[i] == '\n') << i;
+            delimiters |= uint32_t(block[i] == (unsigned char) _delimiter) << i;
+        }
+        return newlines;
+    }
+
+#ifdef CSVSCANNER_X86
+
+    /**
+     * the SSE2 kernel, masks a whole block as two 16 byte halves.
+     * @param block- the bytes, CSV_BLOCK of them.
+     * @param delimiters- set to the mask of the delimiters.
+     * @return- the mask of the newlines.
+     */
+    uint32_t masksSse2(const unsigned char *block, uint32_t &delimiters) const
+    {
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i delimiter = _mm_set1_epi8(_delimiter);
+        __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+        __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16));
+        delimiters = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(low, delimiter)) |
+                     ((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(high, delimiter)) << 16);
+        return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(low, newline)) |
+               ((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(high, newline)) << 16);
+    }
+
+    /**
+     * the AVX2 kernel, masks a whole block at once.
+     * @param block- the bytes, CSV_BLOCK of them.
+     * @param delimiters- set to the mask of the delimiters.
+     * @return- the mask of the newlines.
+     */
+    __attribute__((target("avx2")))
+    uint32_t masksAvx2(const unsigned char *block, uint32_t &delimiters) const
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+        delimiters = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(_delimiter)));
+        return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')));
+    }
+
+#endif
+
+    /**
+     * masks a block with the best kernel the CPU has.
+     * @param block- the bytes.
+     * @param length- the number of bytes, at most CSV_BLOCK (the vector kernels only take whole blocks).
+     * @param delimiters- set to the mask of the delimiters.
+     * @return- the mask of the newlines.
+     */
+    uint32_t masks(const unsigned char *block, size_t length, uint32_t &delimiters) const
+    {
+#ifdef CSVSCANNER_X86
+        if (length == CSV_BLOCK)
+        {
+            switch (_kernel)
+            {
+                case AVX2:
+                    return masksAvx2(block, delimiters);
+                case SSE2:
+                    return masksSse2(block, delimiters);
+                default:
+                    break;
+            }
+        }
+#endif
+        return masksScalar(block, length, delimiters);
+    }
+
+public:
+    /**
+     * constructor, picks the kernel for the CPU it runs on.
+     * @param delimiter- the byte that separates the fields of a row.
+     */
+    explicit CsvScanner(char delimiter) : _delimiter(delimiter), _kernel(SCALAR)
+    {
+#ifdef CSVSCANNER_X86
+        if (__builtin_cpu_supports("avx2"))
+        {
+            _kernel = AVX2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            _kernel = SSE2;
+        }
+#endif
+    }
+
+    /**
+     * splits a text into rows.
+     * @param text- the text.
+     * @param length- the length of the text.
+     * @param onRow- called as onRow(line, begin, delimiter, end) for every row in order, empty ones included: 'line'
+     * is the 1 based line number, [begin, end) the row without its newline (a '\r' before it is left in), and
+     * 'delimiter' the position of the last delimiter in the row, or CSV_NO_DELIMITER if there is none. a last row
+     * without a newline is reported too.
+     */
+    template<typename onRowT>
+    void scan(const char *text, size_t length, const onRowT &onRow) const
+    {
+        const auto *bytes = reinterpret_cast<const unsigned char *>(text);
+        size_t line = 1;
+        size_t begin = 0;
+        size_t delimiter = CSV_NO_DELIMITER;
+        for (size_t base = 0; base < length; base += CSV_BLOCK)
+        {
+            size_t width = length - base < CSV_BLOCK ? length - base : CSV_BLOCK;
+            uint32_t delimiters;
+            uint32_t newlines = masks(bytes + base, width, delimiters);
+            while (newlines != 0)
+            {
+                unsigned int bit = __builtin_ctz(newlines);
+                uint32_t before = delimiters & ((1U << bit) - 1);
+                if (before != 0)
+                {
+                    delimiter = base + 31 - __builtin_clz(before);
+                }
+                onRow(line++, begin, delimiter, base + bit);
+                begin = base + bit + 1;
+                delimiter = CSV_NO_DELIMITER;
+                // the delimiters up to this newline belong to rows that are done (2U << 31 wraps to 0, all ones)
+                delimiters &= ~((2U << bit) - 1);
+                newlines &= newlines - 1;
+            }
+            if (delimiters != 0)
+            {
+                delimiter = base + 31 - __builtin_clz(delimiters);
+            }
+        }
+        if (begin < length)
+        {
+            onRow(line, begin, delimiter, length);
+        }
+    }
+};
+
+#endif //SPAMDETECTOR_CSVSCANNER_HPP
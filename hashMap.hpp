@@ -1,5 +1,12 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <new>
+#include <cstddef>
+#include <thread>
+#include <exception>
+#include <type_traits>
+#include <sys/mman.h>
 
 #ifndef SPAMDETECTOR_HASHMAP_HPP
 #define SPAMDETECTOR_HASHMAP_HPP
@@ -9,48 +16,324 @@
 #define DEF_CAPACITY 16
 #define UP 1
 #define DOWN 0
+#define HUGE_TABLE_MIN_BYTES (64UL << 20)
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define PARALLEL_BUILD_MIN 65536
+#define PARTITIONS_PER_THREAD 4
+#define DEF_INLINE_SIZE 8
 
 /**
  * a class that represents a generic hash map with 'keyT' as keys and 'valueT' as values.
  * saves for each map it's size (actual number of pairs in it), capacity (how much pairs you can put in it) and an
  * array of vectors of pairs that actually stores the pairs.
+ * small maps (up to 'inlineN' pairs) keep their pairs inline in the object itself and search them linearly,
+ * the bucket array is only allocated once the map grows past that, so building a small map never touches the heap.
  * @tparam keyT- generic key type.
  * @tparam valueT- generic value type.
+ * @tparam inlineN- the number of pairs that are stored inline before spilling to the buckets.
  */
-template<typename keyT, typename valueT>
+template<typename keyT, typename valueT, size_t inlineN = DEF_INLINE_SIZE>
 class HashMap
 {
 private:
     std::vector<std::pair<keyT, valueT>> *_buckets;
-    int _size;
-    int _capacity;
+    size_t _size;
+    size_t _capacity;
+    typename std::aligned_storage<sizeof(std::pair<keyT, valueT>), alignof(std::pair<keyT, valueT>)>::type
+            _inline[inlineN == 0 ? 1 : inlineN];
 
     /**
      * the hash function that clamps each key to it's number.
+     * @tparam lookupT- the type of the item, a key or a view that hashes like one (see insertAll).
      * @param item- the received item (key).
-     * @return- an int which is the hash of the given item.
+     * @return- a size_t which is the hash of the given item.
      */
-    int hashy(const keyT &item) const
+    template<typename lookupT = keyT>
+    size_t hashy(const lookupT &item) const
     {
-        return std::hash<keyT>()(item) & (_capacity - 1);
+        return std::hash<lookupT>()(item) & (_capacity - 1);
     }
 
     /**
-     * function that finds the first index of the bucket that has any value, or returns the capacity
-     * (not possible number) to indicate that no item was found.
-     * *this was made to make something in the iterator implementation easier.
-     * @return- the index of the first bucket that isn't empty.
+     * states wether the map is still in small mode, that is it keeps its pairs inline and has no buckets.
+     * @return- true if the map is small and false otherwise.
      */
-    int first() const
+    bool small() const
     {
-        for (int i = 0; i < _capacity; i++)
+        return _buckets == nullptr;
+    }
+
+    /**
+     * the inline pairs of a small map, the first '_size' of them are alive.
+     * @return- a pointer to the first inline pair.
+     */
+    std::pair<keyT, valueT> *inlinePairs()
+    {
+        return reinterpret_cast<std::pair<keyT, valueT> *>(_inline);
+    }
+
+    /**
+     * the inline pairs of a small map, the first '_size' of them are alive.
+     * @return- a pointer to the first inline pair.
+     */
+    const std::pair<keyT, valueT> *inlinePairs() const
+    {
+        return reinterpret_cast<const std::pair<keyT, valueT> *>(_inline);
+    }
+
+    /**
+     * finds the pair of the given key.
+     * @tparam lookupT- the type of the key, a key or a view that hashes like one (see insertAll).
+     * @param key- the received key.
+     * @return- a pointer to the pair of the key if it is in the map and nullptr otherwise.
+     */
+    template<typename lookupT = keyT>
+    std::pair<keyT, valueT> *findPair(const lookupT &key) const
+    {
+        if (small())
         {
-            if (!_buckets[i].empty())
+            auto *pairs = const_cast<std::pair<keyT, valueT> *>(inlinePairs());
+            for (size_t i = 0; i < _size; i++)
             {
-                return i;
+                if (pairs[i].first == key)
+                {
+                    return pairs + i;
+                }
             }
+            return nullptr;
+        }
+        auto &bucket = _buckets[hashy(key)];
+        for (size_t j = 0; j < bucket.size(); j++)
+        {
+            if (bucket[j].first == key)
+            {
+                return &bucket[j];
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * moves the inline pairs of a small map into a freshly allocated bucket array, after which the map is a
+     * regular bucket map for good. does nothing if the map already has buckets.
+     */
+    void spill()
+    {
+        if (!small())
+        {
+            return;
+        }
+        std::vector<std::pair<keyT, valueT>> *buckets = allocBuckets(_capacity);
+        std::pair<keyT, valueT> *pairs = inlinePairs();
+        for (size_t i = 0; i < _size; i++)
+        {
+            buckets[std::hash<keyT>()(pairs[i].first) & (_capacity - 1)].push_back(std::move(pairs[i]));
+            pairs[i].~pair();
+        }
+        _buckets = buckets;
+    }
+
+    /**
+     * destroys all the pairs and frees the buckets, leaving the map small and without pairs ('_size' is left for
+     * the caller to reset).
+     */
+    void release()
+    {
+        if (small())
+        {
+            std::pair<keyT, valueT> *pairs = inlinePairs();
+            for (size_t i = 0; i < _size; i++)
+            {
+                pairs[i].~pair();
+            }
+        }
+        else
+        {
+            freeBuckets(_buckets, _capacity);
+            _buckets = nullptr;
+        }
+    }
+
+    /**
+     * moves the iterator position (bucket index and position in it) forward to the next pair, if the position
+     * is not on a pair already. a small map is walked as a single bucket.
+     * @param index- the bucket index, ends up as the number of buckets if there are no more pairs.
+     * @param pos- the position in the bucket.
+     */
+    void settle(size_t &index, size_t &pos) const
+    {
+        if (small())
+        {
+            if (index == 0 && pos >= _size)
+            {
+                index = 1;
+                pos = 0;
+            }
+            return;
+        }
+        while (index < _capacity && pos >= _buckets[index].size())
+        {
+            index++;
+            pos = 0;
+        }
+        if (index >= _capacity)
+        {
+            pos = 0;
+        }
+    }
+
+    /**
+     * the number of buckets an iterator walks over, which is a single one for a small map.
+     * @return- the number of buckets.
+     */
+    size_t bucketCount() const
+    {
+        return small() ? 1 : _capacity;
+    }
+
+    /**
+     * the pair at the given iterator position.
+     * @param index- the bucket index.
+     * @param pos- the position in the bucket.
+     * @return- the pair.
+     */
+    const std::pair<keyT, valueT> &pairAt(size_t index, size_t pos) const
+    {
+        return small() ? inlinePairs()[pos] : _buckets[index][pos];
+    }
+
+    /**
+     * checks (once) wether a value initialized bucket is made of zero bytes only, which is the case for the
+     * std::vector of every mainstream standard library.
+     * if it is, fresh anonymous mmap pages are already valid empty buckets and don't have to be touched.
+     * @return- true if an empty bucket is all zero bytes and false otherwise.
+     */
+    static bool emptyBucketIsZero()
+    {
+        static const bool zero = []
+        {
+            alignas(std::vector<std::pair<keyT, valueT>>) unsigned char raw[sizeof(std::vector<std::pair<keyT,
+                    valueT>>)] = {};
+            auto *probe = new(raw) std::vector<std::pair<keyT, valueT>>();
+            bool allZero = std::all_of(raw, raw + sizeof(raw), [](unsigned char c)
+            { return c == 0; });
+            probe->~vector();
+            return allZero;
+        }();
+        return zero;
+    }
+
+    /**
+     * allocates an array of 'count' empty buckets.
+     * small arrays come from new[], huge ones (HUGE_TABLE_MIN_BYTES and up) are mapped directly with mmap and
+     * advised to use transparent huge pages, so the TLB covers them with few entries and the kernel hands out
+     * zero pages lazily instead of us touching all the memory up front.
+     * @param count- the number of buckets.
+     * @return- a pointer to the bucket array, to be released with freeBuckets(count).
+     */
+    static std::vector<std::pair<keyT, valueT>> *allocBuckets(size_t count)
+    {
+        size_t bytes = count * sizeof(std::vector<std::pair<keyT, valueT>>);
+        if (bytes < HUGE_TABLE_MIN_BYTES)
+        {
+            return new std::vector<std::pair<keyT, valueT>>[count];
+        }
+        size_t mapped = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *mem = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                         0);
+        if (mem == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(mem, mapped, MADV_HUGEPAGE);
+#endif
+        auto *buckets = static_cast<std::vector<std::pair<keyT, valueT>> *>(mem);
+        if (!emptyBucketIsZero())
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                new(buckets + i) std::vector<std::pair<keyT, valueT>>();
+            }
+        }
+        return buckets;
+    }
+
+    /**
+     * releases a bucket array that was made by allocBuckets.
+     * @param buckets- the bucket array.
+     * @param count- the number of buckets it was allocated with.
+     */
+    static void freeBuckets(std::vector<std::pair<keyT, valueT>> *buckets, size_t count)
+    {
+        size_t bytes = count * sizeof(std::vector<std::pair<keyT, valueT>>);
+        if (bytes < HUGE_TABLE_MIN_BYTES)
+        {
+            delete[] buckets;
+            return;
+        }
+        bool zero = emptyBucketIsZero();
+        for (size_t i = 0; i < count; i++)
+        {
+            // buckets that were never used are still zero pages, destroying them would only fault them in
+            if (!zero || buckets[i].capacity() != 0)
+            {
+                buckets[i].~vector();
+            }
+        }
+        munmap(buckets, (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    }
+
+    /**
+     * moves all the pairs into a new bucket array of the given capacity.
+     * @param newCapacity- the new capacity, a power of 2.
+     */
+    void rehash(size_t newCapacity)
+    {
+        if (small())
+        {
+            // the inline pairs don't depend on the capacity
+            _capacity = newCapacity;
+            return;
+        }
+        std::vector<std::pair<keyT, valueT>> *saved = _buckets;
+        size_t savedCapacity = _capacity;
+        _buckets = allocBuckets(newCapacity);
+        _capacity = newCapacity;
+        for (size_t i = 0; i < savedCapacity; i++)
+        {
+            for (auto &pair : saved[i])
+            {
+                _buckets[hashy(pair.first)].push_back(std::move(pair));
+            }
+        }
+        freeBuckets(saved, savedCapacity);
+    }
+
+    /**
+     * adds a pair whose key is known not to be in the map, spilling a full small map to the buckets and
+     * resizing if there was a need to.
+     * @param pair- the new pair.
+     */
+    void insertNew(std::pair<keyT, valueT> &&pair)
+    {
+        if (small() && _size == inlineN)
+        {
+            spill();
+        }
+        if (small())
+        {
+            new(inlinePairs() + _size) std::pair<keyT, valueT>(std::move(pair));
+        }
+        else
+        {
+            _buckets[hashy(pair.first)].push_back(std::move(pair));
+        }
+        _size++;
+        if (getLoadFactor() > DEF_HIGH_BOUND)
+        {
+            resize(UP);
         }
-        return _capacity;
     }
 
     /**
@@ -60,65 +343,462 @@ private:
      */
     void resize(int way)
     {
-        int savedCapacity = _capacity;
         if (way == UP)
         {
-            _capacity *= 2;
+            rehash(_capacity * 2);
         }
-        else
+        else if (_capacity > 1)
         {
-            _capacity /= 2;
+            rehash(_capacity / 2);
         }
-        std::vector<std::pair<keyT, valueT>> *saved = _buckets;
+    }
+
+    /**
+     * the smallest capacity (a power of 2, at least DEF_CAPACITY) that holds 'count' pairs without crossing
+     * DEF_HIGH_BOUND, which is the capacity inserting them one by one would end up with.
+     * @param count- the number of pairs.
+     * @return- the fitting capacity.
+     */
+    static size_t capacityFor(size_t count)
+    {
+        size_t capacity = DEF_CAPACITY;
+        while (double(count) / capacity > DEF_HIGH_BOUND)
+        {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    /**
+     * runs 'job(part)' for every part in [0, parts) on its own thread (the last one on the calling thread) and
+     * waits for all of them. if any of the jobs threw, the first exception is rethrown here.
+     * @param parts- the number of jobs.
+     * @param job- the function to run, receives the index of its part.
+     */
+    template<typename jobT>
+    static void runParallel(unsigned int parts, const jobT &job)
+    {
+        std::vector<std::exception_ptr> errors(parts);
+        std::vector<std::thread> workers;
+        for (unsigned int part = 0; part + 1 < parts; part++)
+        {
+            workers.emplace_back([&job, &errors, part]
+                                 {
+                                     try
+                                     {
+                                         job(part);
+                                     }
+                                     catch (...)
+                                     {
+                                         errors[part] = std::current_exception();
+                                     }
+                                 });
+        }
+        try
+        {
+            job(parts - 1);
+        }
+        catch (...)
+        {
+            errors[parts - 1] = std::current_exception();
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        for (auto &error : errors)
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    /**
+     * fills an empty map from the keys and values vectors, values[i] being the value of keys[i] and later
+     * duplicates running over earlier ones.
+     * big inputs are built on 'threads' threads: every key is hashed once, the keys are partitioned by the high
+     * bits of their bucket index (a counting sort that keeps the input order inside each partition) and every
+     * partition is then filled on its own, since no two partitions share a bucket.
+     * a key is only turned into a keyT once it turns out to be new.
+     * @tparam sourceT- the type of the keys, keyT or a view that hashes like it (see insertAll).
+     * @param keys- the keys vector.
+     * @param values- the values vector.
+     * @param threads- the number of threads to build with.
+     */
+    template<typename sourceT>
+    void bulkBuild(const std::vector<sourceT> &keys, const std::vector<valueT> &values, unsigned int threads)
+    {
+        if (keys.size() != values.size())
+        {
+            throw std::exception();
+        }
+        size_t count = keys.size();
+        if (threads <= 1 || count < PARALLEL_BUILD_MIN)
+        {
+            // an empty map is sized for all the keys up front rather than doubled over and over on the way
+            bool presized = _size == 0 && count > inlineN;
+            if (presized)
+            {
+                reserve(count);
+            }
+            for (size_t index = 0; index != count; index++)
+            {
+                std::pair<keyT, valueT> *pair = findPair(keys[index]);
+                if (pair != nullptr)
+                {
+                    pair->second = values[index];
+                }
+                else
+                {
+                    insertNew(std::pair<keyT, valueT>(keyT(keys[index]), values[index]));
+                }
+            }
+            if (presized && capacityFor(_size) != _capacity)
+            {
+                rehash(capacityFor(_size));
+            }
+            return;
+        }
+
+        size_t capacity = capacityFor(count);
+        unsigned int partitionBits = 0;
+        while ((1UL << partitionBits) < threads * PARTITIONS_PER_THREAD && (2UL << partitionBits) <= capacity)
+        {
+            partitionBits++;
+        }
+        size_t partitions = 1UL << partitionBits;
+        unsigned int shift = 0;
+        while ((partitions << shift) < capacity)
+        {
+            shift++;
+        }
+
+        // pass 1: hash every key and count how many of each chunk fall in each partition
+        std::vector<size_t> hashes(count);
+        std::vector<std::vector<size_t>> offsets(threads, std::vector<size_t>(partitions, 0));
+        size_t chunk = (count + threads - 1) / threads;
+        runParallel(threads, [&](unsigned int t)
+        {
+            size_t end = std::min(count, (t + 1) * chunk);
+            for (size_t i = t * chunk; i < end; i++)
+            {
+                hashes[i] = std::hash<sourceT>()(keys[i]);
+                offsets[t][(hashes[i] & (capacity - 1)) >> shift]++;
+            }
+        });
+
+        // turn the counts into starting offsets, partition major and chunk minor so the input order survives
+        std::vector<size_t> partitionStart(partitions + 1, 0);
+        size_t running = 0;
+        for (size_t p = 0; p < partitions; p++)
+        {
+            partitionStart[p] = running;
+            for (unsigned int t = 0; t < threads; t++)
+            {
+                size_t here = offsets[t][p];
+                offsets[t][p] = running;
+                running += here;
+            }
+        }
+        partitionStart[partitions] = running;
+
+        // pass 2: scatter the key indices into their partitions
+        std::vector<size_t> order(count);
+        runParallel(threads, [&](unsigned int t)
+        {
+            size_t end = std::min(count, (t + 1) * chunk);
+            for (size_t i = t * chunk; i < end; i++)
+            {
+                order[offsets[t][(hashes[i] & (capacity - 1)) >> shift]++] = i;
+            }
+        });
+
+        // pass 3: every thread fills the buckets of its own partitions
+        std::vector<std::pair<keyT, valueT>> *fresh = allocBuckets(capacity);
+        release();
+        _buckets = fresh;
+        _capacity = capacity;
+        std::vector<size_t> added(threads, 0);
+        runParallel(threads, [&](unsigned int t)
+        {
+            for (size_t p = t; p < partitions; p += threads)
+            {
+                for (size_t k = partitionStart[p]; k < partitionStart[p + 1]; k++)
+                {
+                    size_t i = order[k];
+                    auto &bucket = _buckets[hashes[i] & (capacity - 1)];
+                    bool found = false;
+                    for (auto &pair : bucket)
+                    {
+                        if (pair.first == keys[i])
+                        {
+                            pair.second = values[i];
+                            found = true;
+                            break;
+                        }
+                    }
+                    if (!found)
+                    {
+                        bucket.push_back(std::pair<keyT, valueT>(keyT(keys[i]), values[i]));
+                        added[t]++;
+                    }
+                }
+            }
+        });
         _size = 0;
-        _buckets = new std::vector<std::pair<keyT, valueT>>[_capacity];
-        clear();
-        for (int i = 0; i < savedCapacity; i++)
+        for (size_t a : added)
         {
-            for (auto &pair : saved[i])
+            _size += a;
+        }
+
+        // duplicates may have left the table bigger than inserting one by one would have
+        if (capacityFor(_size) != _capacity)
+        {
+            rehash(capacityFor(_size));
+        }
+    }
+
+    /**
+     * hands out a pair of a const map for copying.
+     * @param pair- the pair.
+     * @return- the same pair.
+     */
+    static const std::pair<keyT, valueT> &take(const std::pair<keyT, valueT> &pair)
+    {
+        return pair;
+    }
+
+    /**
+     * hands out a pair of a map that is being spliced for moving.
+     * @param pair- the pair.
+     * @return- the same pair, as an rvalue.
+     */
+    static std::pair<keyT, valueT> &&take(std::pair<keyT, valueT> &pair)
+    {
+        return std::move(pair);
+    }
+
+    /**
+     * the number of threads a bulk operation over 'count' pairs and 'buckets' buckets should use.
+     * @param threads- the requested number of threads.
+     * @param count- the number of pairs the operation goes over.
+     * @param buckets- the number of buckets that are split between the threads.
+     * @return- the number of parts to run.
+     */
+    static unsigned int partsFor(unsigned int threads, size_t count, size_t buckets)
+    {
+        if (threads <= 1 || count < PARALLEL_BUILD_MIN)
+        {
+            return 1;
+        }
+        return (unsigned int) std::min<size_t>(threads, buckets);
+    }
+
+    /**
+     * merges the pairs of 'other' into this map, copying them when 'other' is const and moving them otherwise.
+     * this map is grown to at least other's capacity first, so the keys of other's bucket j can only land in
+     * buckets of this map whose index is j modulo other's capacity. splitting other's buckets into ranges thus
+     * gives every thread a disjoint set of buckets in both maps and no locking is needed.
+     * @param other- the map to merge in.
+     * @param combiner- called as combiner(mine, theirs) for keys that are in both maps, returns the new value.
+     * @param threads- the number of threads to use.
+     */
+    template<typename otherT, typename combinerT>
+    void mergeBuckets(otherT &other, const combinerT &combiner, unsigned int threads)
+    {
+        if (other.small())
+        {
+            // at most inlineN pairs, not worth any threads
+            auto *pairs = other.inlinePairs();
+            for (size_t i = 0; i < other._size; i++)
+            {
+                std::pair<keyT, valueT> *mine = findPair(pairs[i].first);
+                if (mine != nullptr)
+                {
+                    mine->second = combiner(mine->second, pairs[i].second);
+                }
+                else
+                {
+                    insertNew(std::pair<keyT, valueT>(take(pairs[i])));
+                }
+            }
+            return;
+        }
+        spill();
+        if (other._capacity > _capacity)
+        {
+            rehash(other._capacity);
+        }
+        size_t theirCapacity = other._capacity;
+        unsigned int parts = partsFor(threads, other._size, theirCapacity);
+        std::vector<size_t> added(parts, 0);
+        runParallel(parts, [&](unsigned int t)
+        {
+            size_t end = theirCapacity * (t + 1) / parts;
+            for (size_t j = theirCapacity * t / parts; j < end; j++)
             {
-                insert(pair.first, pair.second);
+                // _buckets is a pointer, so constness has to be carried over to the bucket by hand
+                typename std::conditional<std::is_const<otherT>::value, const std::vector<std::pair<keyT, valueT>>,
+                        std::vector<std::pair<keyT, valueT>>>::type &theirs = other._buckets[j];
+                for (auto &pair : theirs)
+                {
+                    auto &bucket = _buckets[hashy(pair.first)];
+                    bool found = false;
+                    for (auto &mine : bucket)
+                    {
+                        if (mine.first == pair.first)
+                        {
+                            mine.second = combiner(mine.second, pair.second);
+                            found = true;
+                            break;
+                        }
+                    }
+                    if (!found)
+                    {
+                        bucket.push_back(take(pair));
+                        added[t]++;
+                    }
+                }
             }
+        });
+        for (size_t a : added)
+        {
+            _size += a;
+        }
+        if (getLoadFactor() > DEF_HIGH_BOUND)
+        {
+            rehash(capacityFor(_size));
         }
-        delete[] saved;
     }
 
-public:
     /**
-     * constructor for the hash map, initializes the bucket array and sets it's vectors and the size to 0.
+     * keeps only the pairs whose key is (or isn't) in 'other', each thread filtering its own range of buckets.
+     * @param other- the map to check the keys against.
+     * @param shared- true to keep the keys that are in 'other', false to keep the ones that aren't.
+     * @param combiner- called as combiner(mine, theirs) on every kept key that is in both maps.
+     * @param threads- the number of threads to use.
      */
-    HashMap() try : _buckets(new std::vector<std::pair<keyT, valueT>>[DEF_CAPACITY]), _size(0),
-                    _capacity(DEF_CAPACITY)
+    template<typename combinerT>
+    void retain(const HashMap &other, bool shared, const combinerT &combiner, unsigned int threads)
     {
-        for (int i = 0; i < DEF_CAPACITY; i++)
+        if (small())
+        {
+            std::pair<keyT, valueT> *pairs = inlinePairs();
+            size_t kept = 0;
+            for (size_t j = 0; j < _size; j++)
+            {
+                const std::pair<keyT, valueT> *theirs = other.findPair(pairs[j].first);
+                if ((theirs != nullptr) == shared)
+                {
+                    if (theirs != nullptr)
+                    {
+                        pairs[j].second = combiner(pairs[j].second, theirs->second);
+                    }
+                    if (kept != j)
+                    {
+                        pairs[kept] = std::move(pairs[j]);
+                    }
+                    kept++;
+                }
+            }
+            for (size_t j = kept; j < _size; j++)
+            {
+                pairs[j].~pair();
+            }
+            _size = kept;
+            while (getLoadFactor() < DEF_LOW_BOUND && _capacity > 1)
+            {
+                resize(DOWN);
+            }
+            return;
+        }
+        unsigned int parts = partsFor(threads, _size, _capacity);
+        std::vector<size_t> removed(parts, 0);
+        runParallel(parts, [&](unsigned int t)
+        {
+            size_t end = _capacity * (t + 1) / parts;
+            for (size_t i = _capacity * t / parts; i < end; i++)
+            {
+                auto &bucket = _buckets[i];
+                size_t kept = 0;
+                for (size_t j = 0; j < bucket.size(); j++)
+                {
+                    const std::pair<keyT, valueT> *theirs = other.findPair(bucket[j].first);
+                    if ((theirs != nullptr) == shared)
+                    {
+                        if (theirs != nullptr)
+                        {
+                            bucket[j].second = combiner(bucket[j].second, theirs->second);
+                        }
+                        if (kept != j)
+                        {
+                            bucket[kept] = std::move(bucket[j]);
+                        }
+                        kept++;
+                    }
+                }
+                removed[t] += bucket.size() - kept;
+                bucket.erase(bucket.begin() + kept, bucket.end());
+            }
+        });
+        for (size_t r : removed)
+        {
+            _size -= r;
+        }
+        if (getLoadFactor() < DEF_LOW_BOUND && capacityFor(_size) < _capacity)
         {
-            _buckets[i] = std::vector<std::pair<keyT, valueT>>(0);
+            rehash(capacityFor(_size));
         }
     }
-    catch (const std::exception &ex)
+
+public:
+    /**
+     * constructor for the hash map, starts it small (no bucket array until it holds more than 'inlineN' pairs)
+     * with the default capacity and the size 0.
+     */
+    HashMap() : _buckets(nullptr), _size(0), _capacity(DEF_CAPACITY)
     {
-        throw ex;
     }
 
     /**
      * a constructor that receives two vectors representing the keys and values each, to build the map with.
      * it is arranged as : values[i] is the value of key[i], if duplicates are found the constructor
      * runs over the old value with the new one.
+     * big inputs are built in parallel on all the hardware threads.
      * @param keys- the keys vector.
      * @param values- the values vector.
      */
     HashMap(const std::vector<keyT> &keys, const std::vector<valueT> &values) try
-            : _buckets(new std::vector<std::pair<keyT, valueT>>[DEF_CAPACITY]), _size(0), _capacity(DEF_CAPACITY)
+            : HashMap(keys, values, std::thread::hardware_concurrency())
     {
-        if (keys.size() != values.size())
+    }
+    catch (const std::exception &ex)
+    {
+        throw ex;
+    }
+
+    /**
+     * a constructor that receives two vectors representing the keys and values each, to build the map with,
+     * using the given number of threads.
+     * it is arranged as : values[i] is the value of key[i], if duplicates are found the constructor
+     * runs over the old value with the new one.
+     * @param keys- the keys vector.
+     * @param values- the values vector.
+     * @param threads- the number of threads to build with (inputs under PARALLEL_BUILD_MIN are built serially).
+     */
+    HashMap(const std::vector<keyT> &keys, const std::vector<valueT> &values, unsigned int threads) try
+            : _buckets(nullptr), _size(0), _capacity(DEF_CAPACITY)
+    {
+        try
         {
-            throw std::exception();
+            bulkBuild(keys, values, threads);
         }
-        int index = 0;
-        while (index != keys.size())
+        catch (...)
         {
-            (*this)[keys[index]] = values[index];
-            index++;
+            release();
+            throw;
         }
     }
     catch (const std::exception &ex)
@@ -130,13 +810,8 @@ public:
      * copy constructor, initilizes the members to the received hash map.
      * @param other- another hash map.
      */
-    HashMap(const HashMap &other) try : _buckets(
-            new std::vector<std::pair<keyT, valueT>>[other._capacity]), _size(other._size), _capacity(other._capacity)
+    HashMap(const HashMap &other) try : _buckets(nullptr), _size(0), _capacity(other._capacity)
     {
-        for (int i = 0; i < other._capacity; i++)
-        {
-            _buckets[i] = std::vector<std::pair<keyT, valueT>>(0);
-        }
         for (auto i = other.begin(); i != other.end(); i++)
         {
             insert((*i).first, (*i).second);
@@ -148,18 +823,18 @@ public:
     }
 
     /**
-     * destructor, destructs '_buckets' the buckets array.
+     * destructor, destructs the pairs and '_buckets' the buckets array.
      */
     ~HashMap()
     {
-        delete[] _buckets;
+        release();
     }
 
     /**
      * getter for the '_size' member.
      * @return this hash maps '_size'.
      */
-    int size() const
+    size_t size() const
     {
         return _size;
     }
@@ -168,7 +843,7 @@ public:
     * getter for the '_capacity' member.
     * @return this hash maps '_capacity'.
     */
-    int capacity() const
+    size_t capacity() const
     {
         return _capacity;
     }
@@ -182,6 +857,44 @@ public:
         return double(_size) / _capacity;
     }
 
+    /**
+     * grows the map in a single rehash so it can hold 'count' pairs without crossing DEF_HIGH_BOUND.
+     * meant for huge tables (billions of pairs), where doubling one step at a time would rehash everything
+     * over and over again.
+     * @param count- the number of pairs the map should be able to hold.
+     */
+    void reserve(size_t count)
+    {
+        size_t newCapacity = _capacity;
+        while (double(count) / newCapacity > DEF_HIGH_BOUND)
+        {
+            newCapacity *= 2;
+        }
+        if (newCapacity != _capacity)
+        {
+            rehash(newCapacity);
+        }
+    }
+
+    /**
+     * inserts the pairs of two vectors, values[i] being the value of keys[i], running over the values of keys
+     * that are already in the map (and later duplicates over earlier ones). an empty map is filled the way the
+     * vectors constructor builds one, in parallel for big inputs.
+     * the keys may also be views of keys (std::string_view for std::string keys) that hash the same as the keys
+     * they stand for, so a parser can hand over keys that still point into its input, and only the keys that are
+     * actually new get copied.
+     * @tparam sourceT- the type of the keys, keyT or a view of it that std::hash hashes the same way.
+     * @param keys- the keys vector.
+     * @param values- the values vector.
+     * @param threads- the number of threads to build an empty map with.
+     */
+    template<typename sourceT>
+    void insertAll(const std::vector<sourceT> &keys, const std::vector<valueT> &values,
+                   unsigned int threads = std::thread::hardware_concurrency())
+    {
+        bulkBuild(keys, values, _size == 0 ? threads : 1);
+    }
+
     /**
      * function that states wether the whole map is empty.
      * @return- true if the map is empty and false otherwise.
@@ -198,16 +911,31 @@ public:
      */
     bool containsKey(const keyT &key) const
     {
-        try
-        {
-            // if bucketIndex threw exception then the key isn't in the map
-            bucketIndex(key);
-            return true;
-        }
-        catch (std::exception &ex)
-        {
-            return false;
-        }
+        return findPair(key) != nullptr;
+    }
+
+    /**
+     * looks a key up without throwing if it isn't there.
+     * @param key- the received key.
+     * @return- a pointer to the value of the key if it is in the map and nullptr otherwise, valid until the map
+     * changes.
+     */
+    const valueT *find(const keyT &key) const
+    {
+        const std::pair<keyT, valueT> *pair = findPair(key);
+        return pair == nullptr ? nullptr : &pair->second;
+    }
+
+    /**
+     * looks a key up without throwing if it isn't there.
+     * @param key- the received key.
+     * @return- a pointer to the value of the key if it is in the map and nullptr otherwise, valid until the map
+     * changes.
+     */
+    valueT *find(const keyT &key)
+    {
+        std::pair<keyT, valueT> *pair = findPair(key);
+        return pair == nullptr ? nullptr : &pair->second;
     }
 
     /**
@@ -225,15 +953,47 @@ public:
         }
         else
         {
-            int keyHash = hashy(key);
-            _buckets[keyHash].push_back(std::pair<keyT, valueT>(key, value));
-            _size++;
-            if (getLoadFactor() > DEF_HIGH_BOUND)
+            insertNew(std::pair<keyT, valueT>(key, value));
+            return true;
+        }
+    }
+
+    /**
+     * looks a key up and inserts it with an initial value if it isn't there, probing its bucket once (containsKey
+     * followed by insert probes it twice, and operator[] three times), for counters that are bumped in place.
+     * @param key- the key.
+     * @param initial- the value the key is inserted with if it isn't in the map.
+     * @return- a reference to the value of the key, valid until the map changes.
+     */
+    valueT &upsert(const keyT &key, const valueT &initial)
+    {
+        if (small())
+        {
+            std::pair<keyT, valueT> *pair = findPair(key);
+            if (pair != nullptr)
             {
-                resize(UP);
+                return pair->second;
+            }
+            insertNew(std::pair<keyT, valueT>(key, initial));
+            // the map may have spilled, the pair is wherever it went
+            return findPair(key)->second;
+        }
+        std::vector<std::pair<keyT, valueT>> &bucket = _buckets[hashy(key)];
+        for (auto &pair : bucket)
+        {
+            if (pair.first == key)
+            {
+                return pair.second;
             }
-            return true;
         }
+        bucket.emplace_back(key, initial);
+        _size++;
+        if (getLoadFactor() > DEF_HIGH_BOUND)
+        {
+            resize(UP);
+            return findPair(key)->second;
+        }
+        return bucket.back().second;
     }
 
     /**
@@ -244,11 +1004,31 @@ public:
      */
     bool erase(const keyT &key)
     {
+        if (small())
+        {
+            std::pair<keyT, valueT> *pair = findPair(key);
+            if (pair == nullptr)
+            {
+                return false;
+            }
+            std::pair<keyT, valueT> *last = inlinePairs() + _size - 1;
+            for (; pair != last; pair++)
+            {
+                *pair = std::move(*(pair + 1));
+            }
+            last->~pair();
+            _size--;
+            if (getLoadFactor() < DEF_LOW_BOUND)
+            {
+                resize(DOWN);
+            }
+            return true;
+        }
         try
         {
             // if bucketIndex threw exception then the key isn't in the map
-            int i = bucketIndex(key);
-            for (int j = 0; j < _buckets[i].size(); j++)
+            size_t i = bucketIndex(key);
+            for (size_t j = 0; j < _buckets[i].size(); j++)
             {
                 if (_buckets[i][j].first == key)
                 {
@@ -263,6 +1043,7 @@ public:
                     return true;
                 }
             }
+            return false;
         }
         catch (std::exception &ex)
         {
@@ -278,22 +1059,12 @@ public:
      */
     valueT at(const keyT &key) const
     {
-        try
-        {
-            // if bucketIndex threw exception then the key isn't in the map
-            int i = bucketIndex(key);
-            for (int j = 0; j < _buckets[i].size(); j++)
-            {
-                if (_buckets[i][j].first == key)
-                {
-                    return _buckets[i][j].second;
-                }
-            }
-        }
-        catch (const std::exception &ex)
+        const std::pair<keyT, valueT> *pair = findPair(key);
+        if (pair == nullptr)
         {
-            throw ex;
+            throw std::exception();
         }
+        return pair->second;
     }
 
     /**
@@ -302,11 +1073,18 @@ public:
      * @return- the size of the bucket of the given key if it is in the map, if it isn't no return value will be
      * received and the function would throw an error outside.
      */
-    int bucketSize(const keyT &key) const
+    size_t bucketSize(const keyT &key) const
     {
         try
         {
-            int i = bucketIndex(key);
+            size_t i = bucketIndex(key);
+            if (small())
+            {
+                // the bucket the key would be in, had the map spilled
+                return std::count_if(inlinePairs(), inlinePairs() + _size, [this, i](const std::pair<keyT,
+                        valueT> &pair)
+                { return hashy(pair.first) == i; });
+            }
             return _buckets[i].size();
         }
         catch (const std::exception &ex)
@@ -321,17 +1099,13 @@ public:
      * @return- the index of the bucket of the given key if it is in the map, if it isn't no return value will be
      * received and the function would throw an error outside.
      */
-    int bucketIndex(const keyT &key) const
+    size_t bucketIndex(const keyT &key) const
     {
-        int i = hashy(key);
-        for (int j = 0; j < _buckets[i].size(); j++)
+        if (findPair(key) == nullptr)
         {
-            if (_buckets[i][j].first == key)
-            {
-                return i;
-            }
+            throw std::exception();
         }
-        throw std::exception();
+        return hashy(key);
     }
 
     /**
@@ -339,34 +1113,132 @@ public:
      */
     void clear()
     {
-        for (int i = 0; i < _capacity; i++)
+        if (small())
+        {
+            release();
+        }
+        else
+        {
+            for (size_t i = 0; i < _capacity; i++)
+            {
+                _buckets[i].clear();
+            }
+        }
+        _size = 0;
+    }
+
+    /**
+     * merges another map into this one, the reduce step of per worker maps into a global one.
+     * keys that are only in 'other' are copied over, keys that are in both get combiner(mine, theirs), for example
+     * std::plus<valueT>() to add up counters. every key of 'other' is hashed and probed once, and big maps are
+     * merged on several threads that each own a disjoint range of buckets.
+     * @param other- the map to merge in.
+     * @param combiner- the function that combines the values of keys that are in both maps.
+     * @param threads- the number of threads to use.
+     */
+    template<typename combinerT>
+    void merge(const HashMap &other, const combinerT &combiner,
+               unsigned int threads = std::thread::hardware_concurrency())
+    {
+        if (this != &other)
+        {
+            mergeBuckets(other, combiner, threads);
+        }
+    }
+
+    /**
+     * merges another map into this one by moving its pairs instead of copying them (the keys and values keep
+     * their heap storage), leaving 'other' empty. if this map is empty it just takes over other's buckets.
+     * @param other- the map to splice in, empty when the function returns.
+     * @param combiner- the function that combines the values of keys that are in both maps.
+     * @param threads- the number of threads to use.
+     */
+    template<typename combinerT>
+    void merge(HashMap &&other, const combinerT &combiner,
+               unsigned int threads = std::thread::hardware_concurrency())
+    {
+        if (this == &other)
+        {
+            return;
+        }
+        if (_size == 0 && !other.small() && other._capacity >= _capacity)
+        {
+            release();
+            std::swap(_buckets, other._buckets);
+            std::swap(_capacity, other._capacity);
+            std::swap(_size, other._size);
+            return;
+        }
+        mergeBuckets(other, combiner, threads);
+        other.clear();
+    }
+
+    /**
+     * keeps only the keys that are also in 'other', leaving their values as they are.
+     * @param other- the map to intersect with.
+     * @param threads- the number of threads to use.
+     */
+    void intersect(const HashMap &other, unsigned int threads = std::thread::hardware_concurrency())
+    {
+        intersect(other, [](const valueT &mine, const valueT &)
+        { return mine; }, threads);
+    }
+
+    /**
+     * keeps only the keys that are also in 'other', and sets their values to combiner(mine, theirs).
+     * a number in place of the combiner is the thread count of the overload above, not a combiner.
+     * @param other- the map to intersect with.
+     * @param combiner- the function that combines the values of the kept keys.
+     * @param threads- the number of threads to use.
+     */
+    template<typename combinerT, typename = std::enable_if_t<!std::is_integral<combinerT>::value>>
+    void intersect(const HashMap &other, const combinerT &combiner,
+                   unsigned int threads = std::thread::hardware_concurrency())
+    {
+        if (this != &other)
         {
-            _buckets[i].clear();
+            retain(other, true, combiner, threads);
         }
     }
 
+    /**
+     * removes every key that is also in 'other'.
+     * @param other- the map whose keys should be removed from this one.
+     * @param threads- the number of threads to use.
+     */
+    void subtract(const HashMap &other, unsigned int threads = std::thread::hardware_concurrency())
+    {
+        if (this == &other)
+        {
+            clear();
+            return;
+        }
+        retain(other, false, [](const valueT &mine, const valueT &)
+        { return mine; }, threads);
+    }
+
     /**
      * a const forward iterator that runs on HashMap.
-     * saves the map as composition and runs on the iterators of its's inner vectors.
-     * also has the index of the bucket that it is working on.
+     * saves the map as composition and the position it is on: the index of the bucket and the position of the
+     * pair in that bucket (a small map is walked as a single bucket of its inline pairs).
      */
     class iterator
     {
     private:
         const HashMap *_hm;
-        typename std::vector<std::pair<keyT, valueT>>::iterator _it;
-        int _index;
+        size_t _index;
+        size_t _pos;
     public:
         /**
-         * constructor for the iterator, receives the map it will be linked to, an iterator of ont of it's inner
-         * vectors, and the bucket index that that vector is.
+         * constructor for the iterator, receives the map it will be linked to and a position in it, and moves
+         * forward to the first pair at or after that position.
          * @param hm- the HashMap object this iterator belongs to.
-         * @param it- the iterator of the vector we are currently on.
-         * @param bucketIndex- the index of the vector from last line.
+         * @param bucketIndex- the index of the bucket.
+         * @param pos- the position of the pair in the bucket.
          */
-        iterator(const HashMap *hm, typename std::vector<std::pair<keyT, valueT>>::iterator it, int bucketIndex) : _hm(
-                hm), _it(it), _index(bucketIndex)
+        iterator(const HashMap *hm, size_t bucketIndex, size_t pos) : _hm(hm), _index(bucketIndex), _pos(pos)
         {
+            _hm->settle(_index, _pos);
         }
 
         /**
@@ -375,13 +1247,9 @@ public:
          */
         iterator operator++(int)
         {
-            _it++;
-            while (_it == _hm->_buckets[_index].end() and _index < (_hm->_capacity - 1))
-            {
-                _index++;
-                _it = _hm->_buckets[_index].begin();
-            }
-            return iterator(_hm, _it, _index);
+            _pos++;
+            _hm->settle(_index, _pos);
+            return *this;
         }
 
         /**
@@ -390,27 +1258,27 @@ public:
          */
         iterator operator++()
         {
-            auto save = _it;
+            iterator save = *this;
             (*this)++;
-            return iterator(_hm, save, _index);
+            return save;
         }
 
         /**
-         * dereferance operator, gets the pair from the vector iterator.
+         * dereferance operator, gets the pair from the map.
          * @return- the pair of 'keyT', 'valueT' that the iterator is currently pointing to.
          */
         const std::pair<keyT, valueT> &operator*() const
         {
-            return *_it;
+            return _hm->pairAt(_index, _pos);
         }
 
         /**
-         * dereferance operator, gets the pair from the vector iterator.
+         * dereferance operator, gets the pair from the map.
          * @return- the pair of 'keyT', 'valueT' that the iterator is currently pointing to.
          */
         const std::pair<keyT, valueT> *operator->() const
         {
-            return _it;
+            return &_hm->pairAt(_index, _pos);
         }
 
         /**
@@ -420,7 +1288,7 @@ public:
          */
         bool operator==(const iterator &rhs) const
         {
-            return (_it == rhs._it);
+            return _index == rhs._index && _pos == rhs._pos;
         }
 
         /**
@@ -430,34 +1298,26 @@ public:
          */
         bool operator!=(const iterator &rhs) const
         {
-            return (_it != rhs._it);
+            return !(*this == rhs);
         }
     };
 
     /**
-     * the end iterator of the map, points to the end of the last buckets vector.
+     * the end iterator of the map, points to one after the last bucket.
      * @return- an iterator to one after the last items possible in the map.
      */
     iterator end() const
     {
-        return iterator(this, _buckets[_capacity - 1].end(), _capacity - 1);
+        return iterator(this, bucketCount(), 0);
     }
 
     /**
-     * the begin iterator of the map, points to the begin of the first buckets vector.
+     * the begin iterator of the map, points to the first pair of the first bucket that isn't empty.
      * @return- an iterator to the first possible item in the map.
      */
     iterator begin() const
     {
-        int i = first();
-        if (i == _capacity)
-        {
-            return end();
-        }
-        else
-        {
-            return iterator(this, _buckets[i].begin(), i);
-        }
+        return iterator(this, 0, 0);
     }
 
     /**
@@ -469,14 +1329,9 @@ public:
     {
         if (this != &other)
         {
-            delete[] _buckets;
+            release();
             _size = 0;
-            _buckets = new std::vector<std::pair<keyT, valueT>>[other._capacity];
             _capacity = other._capacity;
-            for (int i = 0; i < _capacity; i++)
-            {
-                _buckets[i] = std::vector<std::pair<keyT, valueT>>(0);
-            }
             for (auto i = other.begin(); i != other.end(); i++)
             {
                 insert((*i).first, (*i).second);
@@ -498,14 +1353,7 @@ public:
             valueT a;
             insert(key, a);
         }
-        int h = hashy(key);
-        for (int i = 0; i < _buckets[h].size(); i++)
-        {
-            if (_buckets[h][i].first == key)
-            {
-                return _buckets[h][i].second;
-            }
-        }
+        return findPair(key)->second;
     }
 
     /**
@@ -516,17 +1364,7 @@ public:
      */
     valueT &operator[](const keyT &key) const
     {
-        if (containsKey(key))
-        {
-            int h = hashy(key);
-            for (int i = 0; i < _buckets[h].size(); i++)
-            {
-                if (_buckets[h][i].first == key)
-                {
-                    return _buckets[h][i].second;
-                }
-            }
-        }
+        return findPair(key)->second;
     }
 
     /**
@@ -0,0 +1,682 @@
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cctype>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTMLSTRIPPER_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_HTMLSTRIPPER_HPP
+#define SPAMDETECTOR_HTMLSTRIPPER_HPP
+
+#define HTML_NAME_MAX 10
+#define HTML_NAME_SLOTS 128
+#define HTML_ENTITY_MAX 32
+#define HTML_SLACK 40
+#define HTML_REPLACEMENT 0xFFFD
+
+/**
+ * a named character reference and the code point it stands for.
+ */
+struct HtmlEntity
+{
+    std::string_view name;
+    uint32_t codePoint;
+};
+
+/**
+ * the named character references that are decoded, the ones mail actually uses. a no-break space is decoded to
+ * a plain space, so phrases match across it the way they do across a space.
+ */
+static const HtmlEntity HTML_ENTITIES[] = {
+        {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''}, {"nbsp", ' '}, {"shy", 0xAD},
+        {"copy", 0xA9}, {"reg", 0xAE}, {"trade", 0x2122}, {"euro", 0x20AC}, {"pound", 0xA3}, {"yen", 0xA5},
+        {"cent", 0xA2}, {"hellip", 0x2026}, {"ndash", 0x2013}, {"mdash", 0x2014}, {"lsquo", 0x2018},
+        {"rsquo", 0x2019}, {"ldquo", 0x201C}, {"rdquo", 0x201D}, {"laquo", 0xAB}, {"raquo", 0xBB},
+        {"bull", 0x2022}, {"middot", 0xB7}, {"times", 0xD7}, {"zwnj", 0x200C}, {"zwj", 0x200D},
+        {"ZeroWidthSpace", 0x200B}, {"agrave", 0xE0}, {"aacute", 0xE1}, {"acirc", 0xE2}, {"auml", 0xE4},
+        {"ccedil", 0xE7}, {"egrave", 0xE8}, {"eacute", 0xE9}, {"ecirc", 0xEA}, {"iacute", 0xED},
+        {"ntilde", 0xF1}, {"oacute", 0xF3}, {"ouml", 0xF6}, {"uacute", 0xFA}, {"uuml", 0xFC}, {"szlig", 0xDF},
+        {"Eacute", 0xC9}, {"Auml", 0xC4}, {"Ouml", 0xD6}, {"Uuml", 0xDC}
+};
+
+/**
+ * the elements that break a line (or start a block) when rendered, a tag of theirs becomes a space so the words
+ * on either side of it don't run together.
+ */
+static const std::string_view HTML_BREAKING[] = {
+        "br", "p", "div", "li", "ul", "ol", "tr", "td", "th", "table", "h1", "h2", "h3", "h4", "h5", "h6", "hr",
+        "title", "blockquote", "pre", "section", "article", "header", "footer", "dt", "dd", "center"
+};
+
+/**
+ * a streaming HTML to text converter: tags, comments, declarations and the contents of script and style
+ * elements are dropped, and character references (named ones from HTML_ENTITIES, decimal and hex ones) are
+ * decoded to UTF-8. a tag of an element from HTML_BREAKING becomes a space, any other tag goes away without a
+ * trace, so a phrase split by markup ("vi<b></b>agra") comes out whole.
+ * the text may come in any number of pieces, cut anywhere: the state machine carries over from piece to piece,
+ * and a character reference cut in two is held back (in the stripper, not allocated) until it ends. the text
+ * between tags is copied 32 bytes at a time with AVX2, up to the next '<' or '&'.
+ */
+class HtmlStripper
+{
+private:
+    enum State
+    {
+        TEXT, TAG_OPEN, TAG_NAME, TAG, VALUE, UNQUOTED, QUOTED, DECLARATION, COMMENT, RAW, ENTITY
+    };
+
+    State _state;
+    bool _closing;
+    char _name[HTML_NAME_MAX];
+    size_t _nameLength;
+    char _quote;
+    unsigned int _dashes;
+    bool _commentStart;
+    bool _bang;
+    const char *_rawEnd;
+    size_t _rawMatched;
+    char _entity[HTML_ENTITY_MAX];
+    size_t _entityLength;
+
+    /**
+     * states wether a byte is an ASCII letter (without the locale std::isalpha goes through).
+     * @param c- the byte.
+     * @return- true if it is.
+     */
+    static bool alpha(unsigned char c)
+    {
+        return (unsigned char) ((c | 0x20) - 'a') < 26;
+    }
+
+    /**
+     * states wether a byte is an ASCII letter or digit.
+     * @param c- the byte.
+     * @return- true if it is.
+     */
+    static bool alnum(unsigned char c)
+    {
+        return alpha(c) || (unsigned char) (c - '0') < 10;
+    }
+
+    /**
+     * encodes a code point in UTF-8.
+     * @param c- the code point.
+     * @param out- where the bytes go, 4 of them at most.
+     * @return- the number of bytes written.
+     */
+    static size_t encode(uint32_t c, unsigned char *out)
+    {
+        if (c < 0x80)
+        {
+            out[0] = (unsigned char) c;
+            return 1;
+        }
+        if (c < 0x800)
+        {
+            out[0] = (unsigned char) (0xC0 | c >> 6);
+            out[1] = (unsigned char) (0x80 | (c & 0x3F));
+            return 2;
+        }
+        if (c < 0x10000)
+        {
+            out[0] = (unsigned char) (0xE0 | c >> 12);
+            out[1] = (unsigned char) (0x80 | (c >> 6 & 0x3F));
+            out[2] = (unsigned char) (0x80 | (c & 0x3F));
+            return 3;
+        }
+        out[0] = (unsigned char) (0xF0 | c >> 18);
+        out[1] = (unsigned char) (0x80 | (c >> 12 & 0x3F));
+        out[2] = (unsigned char) (0x80 | (c >> 6 & 0x3F));
+        out[3] = (unsigned char) (0x80 | (c & 0x3F));
+        return 4;
+    }
+
+    /**
+     * packs a name into a number, its first 7 characters and its length, so names are compared at once.
+     * @param name- the name.
+     * @param length- its length.
+     * @return- the number.
+     */
+    static uint64_t nameKey(const char *name, size_t length)
+    {
+        uint64_t key = 0;
+        std::memcpy(&key, name, std::min<size_t>(length, 7));
+        return key | (uint64_t) length << 56;
+    }
+
+    /**
+     * a set of names in a small open addressing table of their keys, so a name is looked up with a probe or two
+     * instead of being compared with every one of them. names longer than 7 characters can share a key, the
+     * caller checks those.
+     */
+    class NameTable
+    {
+    private:
+        uint64_t _key[HTML_NAME_SLOTS];
+        uint8_t _index[HTML_NAME_SLOTS];
+
+        static size_t home(uint64_t key)
+        {
+            return (key * 0x9E3779B97F4A7C15ULL) >> 57;
+        }
+
+    public:
+        /**
+         * constructor.
+         * @param count- the number of names, less than HTML_NAME_SLOTS.
+         * @param nameOf- gives the k-th name.
+         */
+        template<typename nameOfT>
+        NameTable(size_t count, const nameOfT &nameOf) : _key(), _index()
+        {
+            for (size_t k = 0; k < count; k++)
+            {
+                std::string_view name = nameOf(k);
+                size_t s = home(nameKey(name.data(), name.size()));
+                while (_key[s] != 0)
+                {
+                    s = (s + 1) % HTML_NAME_SLOTS;
+                }
+                _key[s] = nameKey(name.data(), name.size());
+                _index[s] = (uint8_t) k;
+            }
+        }
+
+        /**
+         * looks a name up.
+         * @param key- the key of the name.
+         * @return- the index of the name with that key, or -1 if there is none.
+         */
+        int find(uint64_t key) const
+        {
+            for (size_t s = home(key); _key[s] != 0; s = (s + 1) % HTML_NAME_SLOTS)
+            {
+                if (_key[s] == key)
+                {
+                    return _index[s];
+                }
+            }
+            return -1;
+        }
+    };
+
+    /**
+     * the code point of the character reference held back, if it is one.
+     * @param semicolon- true if it ended with a ';'.
+     * @param c- set to the code point.
+     * @return- false if it isn't a reference that is decoded (a named one has to end with a ';').
+     */
+    bool reference(bool semicolon, uint32_t &c) const
+    {
+        if (_entityLength == 0)
+        {
+            return false;
+        }
+        if (_entity[0] != '#')
+        {
+            static const NameTable entities(sizeof(HTML_ENTITIES) / sizeof(*HTML_ENTITIES), [](size_t k)
+            {
+                return HTML_ENTITIES[k].name;
+            });
+            int k = semicolon ? entities.find(nameKey(_entity, _entityLength)) : -1;
+            if (k < 0 || HTML_ENTITIES[k].name != std::string_view(_entity, _entityLength))
+            {
+                return false;
+            }
+            c = HTML_ENTITIES[k].codePoint;
+            return true;
+        }
+        bool hex = _entityLength > 1 && (_entity[1] == 'x' || _entity[1] == 'X');
+        size_t first = hex ? 2 : 1;
+        if (first == _entityLength)
+        {
+            return false;
+        }
+        uint64_t value = 0;
+        for (size_t k = first; k < _entityLength; k++)
+        {
+            auto digit = (unsigned char) _entity[k];
+            if (!(hex ? std::isxdigit(digit) : std::isdigit(digit)))
+            {
+                return false;
+            }
+            int v = std::isdigit(digit) ? digit - '0' : std::tolower(digit) - 'a' + 10;
+            value = std::min<uint64_t>(value * (hex ? 16 : 10) + v, 0x110000);
+        }
+        // like a browser, anything that isn't a scalar value (or is NUL) is the replacement character
+        c = value == 0 || value >= 0x110000 || (value >= 0xD800 && value <= 0xDFFF) ? HTML_REPLACEMENT
+                                                                                    : (uint32_t) value;
+        return true;
+    }
+
+    /**
+     * writes the character reference held back, decoded, or as it is if it isn't one.
+     * @param semicolon- true if it ended with a ';' (which was consumed).
+     * @param out- where the bytes go, HTML_ENTITY_MAX + 2 of them at most.
+     * @return- the number of bytes written.
+     */
+    size_t flushEntity(bool semicolon, unsigned char *out)
+    {
+        _state = TEXT;
+        uint32_t c = 0;
+        if (reference(semicolon, c))
+        {
+            return encode(c, out);
+        }
+        out[0] = '&';
+        std::memcpy(out + 1, _entity, _entityLength);
+        size_t written = _entityLength + 1;
+        if (semicolon)
+        {
+            out[written++] = ';';
+        }
+        return written;
+    }
+
+    /**
+     * ends a tag.
+     * @param out- where a space goes if the tag breaks the text.
+     * @return- the number of bytes written.
+     */
+    size_t endTag(unsigned char *out)
+    {
+        static const NameTable breaking(sizeof(HTML_BREAKING) / sizeof(*HTML_BREAKING), [](size_t k)
+        {
+            return HTML_BREAKING[k];
+        });
+        static const uint64_t script = nameKey("script", 6);
+        static const uint64_t style = nameKey("style", 5);
+        _state = TEXT;
+        uint64_t key = nameKey(_name, _nameLength);
+        if (!_closing && (key == script || key == style))
+        {
+            _rawEnd = key == script ? "</script" : "</style";
+            _rawMatched = 0;
+            _state = RAW;
+            return 0;
+        }
+        if (breaking.find(key) < 0)
+        {
+            return 0;
+        }
+        out[0] = ' ';
+        return 1;
+    }
+
+#ifdef HTMLSTRIPPER_X86
+
+    /**
+     * copies text 32 bytes at a time with AVX2 up to the next '<' or '&'.
+     * @param in- the text.
+     * @param i- the position to start from, moved to the '<' or '&' (or the tail).
+     * @param length- the length of the text.
+     * @param out- where the text goes, with 32 bytes to spare after the last one.
+     * @param o- the position to write to, moved along.
+     */
+    __attribute__((target("avx2")))
+    static void copyTextAvx2(const unsigned char *in, size_t &i, size_t length, unsigned char *out, size_t &o)
+    {
+        const __m256i open = _mm256_set1_epi8('<');
+        const __m256i ampersand = _mm256_set1_epi8('&');
+        for (; i + 32 <= length; i += 32, o += 32)
+        {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + o), bytes);
+            auto markup = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, open),
+                                                                          _mm256_cmpeq_epi8(bytes, ampersand)));
+            if (markup != 0)
+            {
+                size_t run = __builtin_ctz(markup);
+                i += run;
+                o += run;
+                return;
+            }
+        }
+    }
+
+#endif
+
+public:
+    /**
+     * constructor, for the start of a document.
+     */
+    HtmlStripper() : _state(TEXT), _closing(false), _name(), _nameLength(0), _quote(0), _dashes(0),
+            _commentStart(false), _bang(false), _rawEnd(nullptr), _rawMatched(0), _entity(), _entityLength(0)
+    {
+    }
+
+    /**
+     * the most bytes a piece of a document can turn into (with what was held back before it, and finish()), with
+     * the slack strip() needs.
+     * @param length- the length of the piece.
+     * @return- the size 'dst' has to have.
+     */
+    static size_t maxStripped(size_t length)
+    {
+        return length + HTML_ENTITY_MAX + HTML_SLACK;
+    }
+
+    /**
+     * converts the next piece of a document.
+     * @param text- the piece.
+     * @param length- the length of the piece.
+     * @param dst- where the text goes, maxStripped(length) bytes at most.
+     * @return- the number of bytes written.
+     */
+    size_t strip(const char *text, size_t length, char *dst)
+    {
+#ifdef HTMLSTRIPPER_X86
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+        const auto *in = reinterpret_cast<const unsigned char *>(text);
+        auto *out = reinterpret_cast<unsigned char *>(dst);
+        size_t i = 0;
+        size_t o = 0;
+        while (i < length)
+        {
+            unsigned char c = in[i];
+            switch (_state)
+            {
+                case TEXT:
+                {
+#ifdef HTMLSTRIPPER_X86
+                    if (avx2)
+                    {
+                        copyTextAvx2(in, i, length, out, o);
+                    }
+#endif
+                    for (; i < length && in[i] != '<' && in[i] != '&'; i++)
+                    {
+                        out[o++] = in[i];
+                    }
+                    if (i < length)
+                    {
+                        _state = in[i] == '<' ? TAG_OPEN : ENTITY;
+                        _entityLength = 0;
+                        i++;
+                    }
+                    break;
+                }
+                case TAG_OPEN:
+                {
+                    _closing = false;
+                    _nameLength = 0;
+                    if (c == '!')
+                    {
+                        _dashes = 0;
+                        _state = DECLARATION;
+                        i++;
+                        break;
+                    }
+                    if (c == '?')
+                    {
+                        _state = TAG;
+                        i++;
+                        break;
+                    }
+                    if (c == '/')
+                    {
+                        _closing = true;
+                        if (++i == length)
+                        {
+                            _state = TAG_NAME;
+                            break;
+                        }
+                    }
+                    else if (!alpha(c))
+                    {
+                        // "<" not followed by a tag is text, like in "a < b"
+                        out[o++] = '<';
+                        _state = TEXT;
+                        break;
+                    }
+                    _state = TAG_NAME;
+                }
+                // a whole tag goes through here at once, unless the piece ends inside it
+                [[fallthrough]];
+                case TAG_NAME:
+                {
+                    size_t nameLength = _nameLength;
+                    for (; i < length && alnum(in[i]); i++, nameLength++)
+                    {
+                        if (nameLength < HTML_NAME_MAX)
+                        {
+                            _name[nameLength] = (char) (in[i] | 0x20);
+                        }
+                    }
+                    _nameLength = std::min<size_t>(nameLength, HTML_NAME_MAX + 1);
+                    if (i == length)
+                    {
+                        break;
+                    }
+                    _state = TAG;
+                }
+                [[fallthrough]];
+                case TAG:
+                {
+                    // the attributes are skipped up to the end of the tag or the value of one
+                    for (; i < length && in[i] != '>' && in[i] != '='; i++)
+                    {
+                    }
+                    if (i == length)
+                    {
+                        break;
+                    }
+                    if (in[i] == '>')
+                    {
+                        o += endTag(out + o);
+                    }
+                    else
+                    {
+                        _state = VALUE;
+                    }
+                    i++;
+                    break;
+                }
+                case VALUE:
+                {
+                    // a value is quoted only if a quote is the first thing after the '=', like a browser has it
+                    if (std::isspace(c))
+                    {
+                        i++;
+                    }
+                    else if (c == '"' || c == '\'')
+                    {
+                        _quote = (char) c;
+                        _state = QUOTED;
+                        i++;
+                    }
+                    else
+                    {
+                        _state = c == '>' ? TAG : UNQUOTED;
+                    }
+                    break;
+                }
+                case UNQUOTED:
+                {
+                    // quotes in an unquoted value ("title=it's") are characters of it, a space or '>' ends it
+                    for (; i < length && in[i] != '>' && !std::isspace(in[i]); i++)
+                    {
+                    }
+                    if (i < length)
+                    {
+                        _state = TAG;
+                    }
+                    break;
+                }
+                case QUOTED:
+                {
+                    const auto *quote = static_cast<const unsigned char *>(std::memchr(in + i, _quote, length - i));
+                    i = quote == nullptr ? length : quote - in + 1;
+                    if (quote != nullptr)
+                    {
+                        _state = TAG;
+                    }
+                    break;
+                }
+                case DECLARATION:
+                {
+                    // "<!--" starts a comment, anything else ("<!DOCTYPE html>") is skipped like a tag
+                    if (c != '-')
+                    {
+                        _state = TAG;
+                        break;
+                    }
+                    if (++_dashes == 2)
+                    {
+                        _state = COMMENT;
+                        _dashes = 0;
+                        _commentStart = true;
+                        _bang = false;
+                    }
+                    i++;
+                    break;
+                }
+                case COMMENT:
+                {
+                    if (_commentStart)
+                    {
+                        // like a browser, "<!-->" and "<!--->" are empty comments
+                        if (c == '>')
+                        {
+                            _state = TEXT;
+                            i++;
+                            break;
+                        }
+                        _commentStart = c == '-' && _dashes == 0;
+                    }
+                    if (_dashes == 0)
+                    {
+                        const auto *dash = static_cast<const unsigned char *>(std::memchr(in + i, '-', length - i));
+                        i = dash == nullptr ? length : dash - in;
+                        if (dash == nullptr)
+                        {
+                            break;
+                        }
+                        c = '-';
+                    }
+                    if (c == '-')
+                    {
+                        // "--!-" is one dash towards the end, "--!-->" ends the comment too
+                        _dashes = _bang ? 1 : _dashes + 1;
+                        _bang = false;
+                    }
+                    else if (c == '!' && _dashes >= 2 && !_bang)
+                    {
+                        // "--!>" ends a comment as well
+                        _bang = true;
+                    }
+                    else
+                    {
+                        _state = c == '>' && _dashes >= 2 ? TEXT : COMMENT;
+                        _dashes = 0;
+                        _bang = false;
+                    }
+                    i++;
+                    break;
+                }
+                case RAW:
+                {
+                    if (_rawMatched == 0)
+                    {
+                        const auto *open = static_cast<const unsigned char *>(std::memchr(in + i, '<', length - i));
+                        i = open == nullptr ? length : open - in;
+                        if (open == nullptr)
+                        {
+                            break;
+                        }
+                        c = '<';
+                    }
+                    if (std::tolower(c) == _rawEnd[_rawMatched])
+                    {
+                        if (_rawEnd[++_rawMatched] == '\0')
+                        {
+                            // the closing tag is skipped like any other, it is nameless so it breaks nothing
+                            _closing = true;
+                            _nameLength = 0;
+                            _state = TAG;
+                        }
+                    }
+                    else
+                    {
+                        _rawMatched = c == '<' ? 1 : 0;
+                    }
+                    i++;
+                    break;
+                }
+                case ENTITY:
+                {
+                    size_t entityLength = _entityLength;
+                    if (entityLength == 0 && c == '#')
+                    {
+                        _entity[entityLength++] = '#';
+                        i++;
+                    }
+                    for (; i < length && alnum(in[i]) && entityLength < HTML_ENTITY_MAX; i++)
+                    {
+                        _entity[entityLength++] = (char) in[i];
+                    }
+                    _entityLength = entityLength;
+                    if (i == length)
+                    {
+                        break;
+                    }
+                    if (in[i] == ';')
+                    {
+                        o += flushEntity(true, out + o);
+                        i++;
+                    }
+                    else
+                    {
+                        o += flushEntity(false, out + o);
+                    }
+                    break;
+                }
+            }
+        }
+        return o;
+    }
+
+    /**
+     * ends the document, writing a character reference (or a '<') it ends with and starting over.
+     * @param dst- where the bytes go, HTML_ENTITY_MAX + 2 of them at most.
+     * @return- the number of bytes written.
+     */
+    size_t finish(char *dst)
+    {
+        auto *out = reinterpret_cast<unsigned char *>(dst);
+        size_t written = 0;
+        if (_state == ENTITY)
+        {
+            written = flushEntity(false, out);
+        }
+        else if (_state == TAG_OPEN)
+        {
+            out[written++] = '<';
+        }
+        *this = HtmlStripper();
+        return written;
+    }
+};
+
+/**
+ * converts a whole HTML document to text.
+ * @param src- the document.
+ * @param length- the length of the document.
+ * @param buffer- set to the text.
+ */
+inline void stripHtml(const char *src, size_t length, std::string &buffer)
+{
+    HtmlStripper stripper;
+    buffer.resize(HtmlStripper::maxStripped(length));
+    size_t written = stripper.strip(src, length, &buffer[0]);
+    written += stripper.finish(&buffer[written]);
+    buffer.resize(written);
+}
+
+#endif //SPAMDETECTOR_HTMLSTRIPPER_HPP
@@ -0,0 +1,255 @@
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREFILTER_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_LITERALPREFILTER_HPP
+#define SPAMDETECTOR_LITERALPREFILTER_HPP
+
+#define MAX_FINGERPRINT 3
+#define TEDDY_BUCKETS 8
+#define NIBBLES 16
+#define PAIR_BITS 65536
+
+/**
+ * a Teddy style literal prefilter, finds the positions of a text where some phrase might start by looking only at
+ * a short fingerprint (the first 1 to 3 bytes) of every phrase.
+ * the phrases are spread over 8 buckets, and for every fingerprint byte there are two 16 entry tables, one for its
+ * low nibble and one for its high nibble, holding a bit for every bucket that has a phrase with that nibble there.
+ * a position is a candidate if some bucket bit survives and-ing the tables of all the fingerprint bytes, which
+ * pshufb computes for 16 (SSSE3) or 32 (AVX2) positions at once. the scalar fallback checks the exact one or two
+ * byte prefixes against a bitmap instead.
+ * every real phrase start is a candidate, but not every candidate is a phrase start, so candidates still have to
+ * be verified (by the phrase automaton).
+ */
+class LiteralPrefilter
+{
+private:
+    enum Kernel
+    {
+        SCALAR, SSSE3, AVX2
+    };
+
+    size_t _width;
+    bool _empty;
+    Kernel _kernel;
+    alignas(16) uint8_t _lo[MAX_FINGERPRINT][NIBBLES];
+    alignas(16) uint8_t _hi[MAX_FINGERPRINT][NIBBLES];
+    std::vector<uint64_t> _prefixes;
+
+    /**
+     * states wether the prefix bitmap has the prefix at the given position.
+     * @param text- the text.
+     * @param i- the position, there are at least '_width' bytes from it.
+     * @return- true if some phrase starts with the bytes at the position.
+     */
+    bool hasPrefix(const unsigned char *text, size_t i) const
+    {
+        size_t bit = _width == 1 ? text[i] : (size_t(text[i]) << 8) | text[i + 1];
+        return (_prefixes[bit >> 6] >> (bit & 63)) & 1;
+    }
+
+    /**
+     * the scalar kernel.
+     * @param text- the text.
+     * @param last- the last position a phrase can start at, plus one.
+     * @param from- the position to start from.
+     * @return- the first candidate position from 'from', or 'last' if there is none.
+     */
+    size_t nextScalar(const unsigned char *text, size_t last, size_t from) const
+    {
+        for (size_t i = from; i < last; i++)
+        {
+            if (hasPrefix(text, i))
+            {
+                return i;
+            }
+        }
+        return last;
+    }
+
+#ifdef PREFILTER_X86
+
+    /**
+     * the SSSE3 kernel, 16 positions per iteration.
+     * @param text- the text.
+     * @param last- the last position a phrase can start at, plus one.
+     * @param from- the position to start from.
+     * @return- the first candidate position from 'from', or 'last' if there is none.
+     */
+    __attribute__((target("ssse3")))
+    size_t nextSsse3(const unsigned char *text, size_t last, size_t from) const
+    {
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        __m128i lo[MAX_FINGERPRINT];
+        __m128i hi[MAX_FINGERPRINT];
+        for (size_t k = 0; k < _width; k++)
+        {
+            lo[k] = _mm_load_si128(reinterpret_cast<const __m128i *>(_lo[k]));
+            hi[k] = _mm_load_si128(reinterpret_cast<const __m128i *>(_hi[k]));
+        }
+        size_t i = from;
+        for (; i + 16 <= last; i += 16)
+        {
+            __m128i match = _mm_set1_epi8(-1);
+            for (size_t k = 0; k < _width; k++)
+            {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i + k));
+                __m128i low = _mm_and_si128(bytes, nibble);
+                __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+                match = _mm_and_si128(match, _mm_and_si128(_mm_shuffle_epi8(lo[k], low),
+                                                           _mm_shuffle_epi8(hi[k], high)));
+            }
+            unsigned int hits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(match, _mm_setzero_si128())) & 0xFFFF;
+            if (hits != 0)
+            {
+                return i + __builtin_ctz(hits);
+            }
+        }
+        return nextScalar(text, last, i);
+    }
+
+    /**
+     * the AVX2 kernel, 32 positions per iteration.
+     * @param text- the text.
+     * @param last- the last position a phrase can start at, plus one.
+     * @param from- the position to start from.
+     * @return- the first candidate position from 'from', or 'last' if there is none.
+     */
+    __attribute__((target("avx2")))
+    size_t nextAvx2(const unsigned char *text, size_t last, size_t from) const
+    {
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        __m256i lo[MAX_FINGERPRINT];
+        __m256i hi[MAX_FINGERPRINT];
+        for (size_t k = 0; k < _width; k++)
+        {
+            // vpshufb looks up within each 128 bit lane, so both lanes get a copy of the table
+            lo[k] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(_lo[k])));
+            hi[k] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(_hi[k])));
+        }
+        size_t i = from;
+        for (; i + 32 <= last; i += 32)
+        {
+            __m256i match = _mm256_set1_epi8(-1);
+            for (size_t k = 0; k < _width; k++)
+            {
+                __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i + k));
+                __m256i low = _mm256_and_si256(bytes, nibble);
+                __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
+                match = _mm256_and_si256(match, _mm256_and_si256(_mm256_shuffle_epi8(lo[k], low),
+                                                                 _mm256_shuffle_epi8(hi[k], high)));
+            }
+            unsigned int hits = ~(unsigned int) _mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(match, _mm256_setzero_si256()));
+            if (hits != 0)
+            {
+                return i + __builtin_ctz(hits);
+            }
+        }
+        return nextSsse3(text, last, i);
+    }
+
+#endif
+
+public:
+    /**
+     * constructor, builds the bucket tables and the prefix bitmap out of the phrases.
+     * @param phrases- the phrases, none of them empty.
+     */
+    explicit LiteralPrefilter(const std::vector<std::string> &phrases) : _width(MAX_FINGERPRINT),
+            _empty(phrases.empty()), _kernel(SCALAR), _lo(), _hi()
+    {
+        for (const std::string &phrase : phrases)
+        {
+            _width = std::min(_width, phrase.size());
+        }
+        _width = std::max<size_t>(_width, 1);
+        for (const std::string &phrase : phrases)
+        {
+            // phrases with the same fingerprint share a bucket, so they don't light up more buckets than needed
+            uint32_t fingerprint = 0;
+            for (size_t k = 0; k < _width; k++)
+            {
+                fingerprint = fingerprint * 131 + (unsigned char) phrase[k];
+            }
+            uint8_t bucket = (uint8_t) (1U << (fingerprint % TEDDY_BUCKETS));
+            for (size_t k = 0; k < _width; k++)
+            {
+                unsigned char c = (unsigned char) phrase[k];
+                _lo[k][c & 0x0F] |= bucket;
+                _hi[k][c >> 4] |= bucket;
+            }
+        }
+
+        size_t prefixWidth = std::min<size_t>(_width, 2);
+        _prefixes.assign((prefixWidth == 1 ? 256 : PAIR_BITS) / 64, 0);
+        for (const std::string &phrase : phrases)
+        {
+            size_t bit = prefixWidth == 1 ? (unsigned char) phrase[0] :
+                         (size_t((unsigned char) phrase[0]) << 8) | (unsigned char) phrase[1];
+            _prefixes[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+
+#ifdef PREFILTER_X86
+        if (__builtin_cpu_supports("avx2"))
+        {
+            _kernel = AVX2;
+        }
+        else if (__builtin_cpu_supports("ssse3"))
+        {
+            _kernel = SSSE3;
+        }
+#endif
+    }
+
+    /**
+     * finds the first position, at or after 'from', where a phrase might start.
+     * @param text- the text.
+     * @param length- the length of the text.
+     * @param from- the position to start from.
+     * @return- the first candidate position, or 'length' if no phrase can start at or after 'from'.
+     */
+    size_t next(const char *text, size_t length, size_t from) const
+    {
+        if (_empty || length < _width || from > length - _width)
+        {
+            return length;
+        }
+        const auto *bytes = reinterpret_cast<const unsigned char *>(text);
+        size_t last = length - _width + 1;
+        size_t found;
+        switch (_kernel)
+        {
+#ifdef PREFILTER_X86
+            case AVX2:
+                found = nextAvx2(bytes, last, from);
+                break;
+            case SSSE3:
+                found = nextSsse3(bytes, last, from);
+                break;
+#endif
+            default:
+                found = nextScalar(bytes, last, from);
+                break;
+        }
+        return found == last ? length : found;
+    }
+
+    /**
+     * getter for the fingerprint width.
+     * @return- the number of leading bytes of every phrase the prefilter looks at.
+     */
+    size_t width() const
+    {
+        return _width;
+    }
+};
+
+#endif //SPAMDETECTOR_LITERALPREFILTER_HPP
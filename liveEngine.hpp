@@ -0,0 +1,699 @@
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "phraseDelta.hpp"
+#include "scoringEngine.hpp"
+
+#ifndef SPAMDETECTOR_LIVEENGINE_HPP
+#define SPAMDETECTOR_LIVEENGINE_HPP
+
+#define RELOAD_SETTLE_MILLIS 50
+#define RELOAD_DRAIN_MICROS 1000
+#define RELOAD_NICE 10
+#define RELOAD_EVENT_BUFFER 4096
+#define DELTA_SUFFIX ".delta"
+#define OVERLAY_MERGE_MAX 1024
+#define OVERLAY_MERGE_IDLE_MILLIS 60000
+
+/**
+ * a scoring engine that can be swapped for a freshly loaded one while messages are being scored.
+ * every message takes a snapshot (get()) of the current engine and is scored against it from start to end, so
+ * it never sees two versions, let alone a half loaded one. a reload builds the new phrase map and automaton
+ * aside, on the reloading thread, and then publishes it with a single atomic pointer swap. the old engine is
+ * drained, that is kept until the last message holding it is done, and is then freed on the reloading thread
+ * too, so tearing down a big map never stalls a scoring thread.
+ * a watcher thread (see watch) reloads on SIGHUP and whenever the database file is replaced or rewritten. it
+ * runs at a lower priority, so a reload mostly takes CPU time the scoring threads leave over.
+ * small changes don't need a reload: a delta (see phraseDelta.hpp) is applied in place and published as a new
+ * version in microseconds, with the automaton shared and the changes in an overlay. the watcher applies every delta
+ * that shows up in a directory, and merges the overlay into a rebuilt automaton once it grows past
+ * OVERLAY_MERGE_MAX changes or no delta came for OVERLAY_MERGE_IDLE_MILLIS. the versions a delta replaces aren't
+ * waited for, they are retired and freed by the watcher later, once no message holds them.
+ * a reloaded database file is authoritative over the deltas older than it: a reload applies again only the deltas
+ * whose files were modified after the database file was, and drops (and logs) the rest, so a deploy can override a
+ * re-score or bring back a removed phrase. a SIGHUP with the file unchanged keeps every delta, touching the file
+ * drops them all. a delta that is kept but no longer fits the reloaded database is dropped and logged too.
+ * the early exit counters of the drained engines are carried over, so earlyExits() and bytesSaved() cover every
+ * version.
+ */
+class LiveEngine
+{
+private:
+    /**
+     * a delta that was applied, kept to be applied again after a reload.
+     */
+    struct AppliedDelta
+    {
+        std::string path;
+        std::vector<DeltaOp> ops;
+        timespec modified;
+    };
+
+    std::string _path;
+    long long _threshold;
+    TextOptions _text;
+    std::shared_ptr<const ScoringEngine> _current;
+    std::atomic<uint64_t> _version;
+    std::atomic<uint64_t> _retiredExits;
+    std::atomic<uint64_t> _retiredBytes;
+    std::ostream *_log;
+    std::mutex _reloading;
+    mutable std::mutex _retiring;
+    std::vector<std::shared_ptr<const ScoringEngine>> _retired;
+    std::vector<AppliedDelta> _applied;
+    std::thread _watcher;
+    int _stop;
+
+    /**
+     * publishes a new version of the engine.
+     * @param fresh- the new version.
+     * @return- the version it replaces.
+     */
+    std::shared_ptr<const ScoringEngine> publish(const std::shared_ptr<const ScoringEngine> &fresh)
+    {
+        std::shared_ptr<const ScoringEngine> old = std::atomic_exchange(&_current, fresh);
+        _version.store(fresh->version(), std::memory_order_release);
+        return old;
+    }
+
+    /**
+     * carries the early exit counters of a version no one holds anymore over.
+     * @param old- the version.
+     */
+    void carryOver(const ScoringEngine &old)
+    {
+        _retiredExits.fetch_add(old.earlyExits(), std::memory_order_relaxed);
+        _retiredBytes.fetch_add(old.bytesSaved(), std::memory_order_relaxed);
+    }
+
+    /**
+     * frees the retired versions no message holds anymore, and retires one more.
+     * @param old- the version to retire, or nullptr.
+     */
+    void sweep(std::shared_ptr<const ScoringEngine> old)
+    {
+        std::vector<std::shared_ptr<const ScoringEngine>> done;
+        {
+            std::lock_guard<std::mutex> guard(_retiring);
+            if (old != nullptr)
+            {
+                _retired.push_back(std::move(old));
+            }
+            for (size_t i = 0; i < _retired.size();)
+            {
+                if (_retired[i].use_count() == 1)
+                {
+                    carryOver(*_retired[i]);
+                    done.push_back(std::move(_retired[i]));
+                    _retired[i] = std::move(_retired.back());
+                    _retired.pop_back();
+                }
+                else
+                {
+                    i++;
+                }
+            }
+        }
+        // freed here, out of the lock (the last version before a merge takes its whole automaton along)
+    }
+
+    /**
+     * merge() for a caller that holds the reloading lock.
+     */
+    void mergeLocked()
+    {
+        std::shared_ptr<const ScoringEngine> current = get();
+        if (current->overlay().empty())
+        {
+            current.reset();
+            sweep(nullptr);
+            return;
+        }
+        auto started = std::chrono::steady_clock::now();
+        std::shared_ptr<const ScoringEngine> fresh;
+        try
+        {
+            fresh = std::make_shared<const ScoringEngine>(*current, PhraseOverlay(), _version.load() + 1);
+        }
+        catch (const std::exception &ex)
+        {
+            if (_log != nullptr)
+            {
+                *_log << "merge of the deltas failed, keeping version " << _version.load() << ": " << ex.what()
+                      << std::endl;
+            }
+            return;
+        }
+        size_t merged = current->overlay().size();
+        current.reset();
+        sweep(publish(fresh));
+        if (_log != nullptr)
+        {
+            using ms = std::chrono::milliseconds;
+            *_log << "merged " << merged << " changes as version " << fresh->version() << " ("
+                  << fresh->phrases().size() << " phrases), built in "
+                  << std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - started).count() << "ms"
+                  << std::endl;
+        }
+    }
+
+    /**
+     * the time a file was last modified.
+     * @param path- the path of the file.
+     * @param modified- set to the time, unless the file can't be looked at.
+     * @return- false if the file can't be looked at.
+     */
+    static bool modifiedAt(const std::string &path, timespec &modified)
+    {
+        struct stat info = {};
+        if (stat(path.c_str(), &info) != 0)
+        {
+            return false;
+        }
+        modified = info.st_mtim;
+        return true;
+    }
+
+    /**
+     * states wether a time comes after another one.
+     * @param time- the time.
+     * @param other- the other time.
+     * @return- true if it does.
+     */
+    static bool after(const timespec &time, const timespec &other)
+    {
+        return time.tv_sec != other.tv_sec ? time.tv_sec > other.tv_sec : time.tv_nsec > other.tv_nsec;
+    }
+
+    /**
+     * the directory and the name of the database file, which is what inotify watches for (a deploy usually
+     * renames a new file over the old one, which a watch on the file itself would miss).
+     * @param directory- set to the directory.
+     * @param name- set to the file name.
+     */
+    void splitPath(std::string &directory, std::string &name) const
+    {
+        size_t slash = _path.rfind('/');
+        directory = slash == std::string::npos ? "." : slash == 0 ? "/" : _path.substr(0, slash);
+        name = slash == std::string::npos ? _path : _path.substr(slash + 1);
+    }
+
+    /**
+     * reads everything pending on a file descriptor, so poll doesn't report it again.
+     * @param fd- the file descriptor, non blocking.
+     * @return- the bytes read.
+     */
+    static std::string drain(int fd)
+    {
+        std::string pending;
+        char buffer[RELOAD_EVENT_BUFFER];
+        ssize_t got;
+        while ((got = read(fd, buffer, sizeof(buffer))) > 0 || (got < 0 && errno == EINTR))
+        {
+            pending.append(buffer, got > 0 ? got : 0);
+        }
+        return pending;
+    }
+
+    /**
+     * states wether some inotify event is about the database file.
+     * @param events- the events, as read from the inotify descriptor.
+     * @param name- the name of the database file.
+     * @return- true if the file was written or moved into place.
+     */
+    static bool touches(const std::string &events, const std::string &name)
+    {
+        for (size_t at = 0; at + sizeof(inotify_event) <= events.size();)
+        {
+            const auto *event = reinterpret_cast<const inotify_event *>(events.data() + at);
+            if (event->len != 0 && name == event->name)
+            {
+                return true;
+            }
+            at += sizeof(inotify_event) + event->len;
+        }
+        return false;
+    }
+
+    /**
+     * the names of the deltas in some inotify events, in order and without repeats.
+     * @param events- the events, as read from the inotify descriptor.
+     * @return- the file names ending with DELTA_SUFFIX.
+     */
+    static std::vector<std::string> deltasIn(const std::string &events)
+    {
+        std::vector<std::string> names;
+        const std::string suffix = DELTA_SUFFIX;
+        for (size_t at = 0; at + sizeof(inotify_event) <= events.size();)
+        {
+            const auto *event = reinterpret_cast<const inotify_event *>(events.data() + at);
+            std::string name = event->len != 0 ? event->name : "";
+            if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0 &&
+                std::find(names.begin(), names.end(), name) == names.end())
+            {
+                names.push_back(name);
+            }
+            at += sizeof(inotify_event) + event->len;
+        }
+        return names;
+    }
+
+    /**
+     * the watcher loop: waits for SIGHUP or a change to the database file and reloads, or for deltas and applies
+     * them, until told to stop.
+     * @param signals- a signalfd for SIGHUP, or -1.
+     * @param changes- an inotify descriptor watching the directory of the database, or -1.
+     * @param name- the name of the database file.
+     * @param deltas- an inotify descriptor watching the directory of the deltas, or -1.
+     * @param deltaDirectory- the directory of the deltas.
+     */
+    void watchLoop(int signals, int changes, const std::string &name, int deltas, const std::string &deltaDirectory)
+    {
+        setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), RELOAD_NICE);
+        pollfd fds[4] = {{_stop, POLLIN, 0}, {signals, POLLIN, 0}, {changes, POLLIN, 0}, {deltas, POLLIN, 0}};
+        while (true)
+        {
+            // an overlay left alone for a while is merged, and the versions it replaced are looked at again
+            bool idle = !get()->overlay().empty() || retired() != 0;
+            int ready = poll(fds, 4, idle ? OVERLAY_MERGE_IDLE_MILLIS : -1);
+            if (ready < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            if (ready == 0)
+            {
+                merge();
+                continue;
+            }
+            if (fds[0].revents != 0)
+            {
+                break;
+            }
+            if (fds[3].revents != 0)
+            {
+                // a delta is complete once it is closed or moved in, so there is nothing to settle
+                for (const std::string &delta : deltasIn(drain(deltas)))
+                {
+                    apply(deltaDirectory + "/" + delta);
+                }
+            }
+            bool wanted = false;
+            if (fds[2].revents != 0)
+            {
+                // a deploy is usually a burst of events, they settle into one reload
+                std::this_thread::sleep_for(std::chrono::milliseconds(RELOAD_SETTLE_MILLIS));
+                wanted = touches(drain(changes), name);
+            }
+            if (signals >= 0)
+            {
+                // read after the settling too, a SIGHUP that came in meanwhile is part of this round
+                wanted |= !drain(signals).empty();
+            }
+            if (wanted)
+            {
+                reload();
+            }
+        }
+        if (signals >= 0)
+        {
+            close(signals);
+        }
+        if (changes >= 0)
+        {
+            close(changes);
+        }
+        if (deltas >= 0)
+        {
+            close(deltas);
+        }
+    }
+
+public:
+    /**
+     * constructor, loads the first version of the engine.
+     * @param databasePath- the path of the phrase database, text or compiled, reloaded from the same path.
+     * @param threshold- the score from which a message is spam, the same for every version.
+     * @param log- where reloads are reported, or nullptr.
+     * @param text- how the text that is matched is made out of the messages (see ScoringEngine), the same for
+     * every version.
+     */
+    LiveEngine(const std::string &databasePath, long long threshold, std::ostream *log = nullptr,
+               TextOptions text = TextOptions()) : _path(databasePath), _threshold(threshold), _text(text),
+            _current(std::make_shared<const ScoringEngine>(databasePath, threshold, 1, text)), _version(1),
+            _retiredExits(0), _retiredBytes(0), _log(log), _stop(-1)
+    {
+    }
+
+    LiveEngine(const LiveEngine &) = delete;
+
+    LiveEngine &operator=(const LiveEngine &) = delete;
+
+    /**
+     * destructor, stops the watcher.
+     */
+    ~LiveEngine()
+    {
+        if (_watcher.joinable())
+        {
+            uint64_t one = 1;
+            ssize_t ignored = write(_stop, &one, sizeof(one));
+            (void) ignored;
+            _watcher.join();
+        }
+        if (_stop >= 0)
+        {
+            close(_stop);
+        }
+    }
+
+    /**
+     * starts the watcher thread. SIGHUP is blocked in the calling thread, so this has to be called before any
+     * other thread is started (they inherit the mask, and only the watcher's signalfd sees the signal).
+     * @param onSignal- true to reload on SIGHUP.
+     * @param onChange- true to reload when the database file is written or replaced.
+     * @param deltaDirectory- a directory to apply the deltas written or moved into, or "" for none.
+     */
+    void watch(bool onSignal, bool onChange, const std::string &deltaDirectory = "")
+    {
+        bool onDelta = !deltaDirectory.empty();
+        if (_watcher.joinable() || (!onSignal && !onChange && !onDelta))
+        {
+            return;
+        }
+        std::string directory, name;
+        splitPath(directory, name);
+        int signals = -1;
+        int changes = -1;
+        if (onSignal)
+        {
+            sigset_t hangup;
+            sigemptyset(&hangup);
+            sigaddset(&hangup, SIGHUP);
+            pthread_sigmask(SIG_BLOCK, &hangup, nullptr);
+            signals = signalfd(-1, &hangup, SFD_NONBLOCK | SFD_CLOEXEC);
+        }
+        if (onChange)
+        {
+            changes = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (changes >= 0 && inotify_add_watch(changes, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+            {
+                close(changes);
+                changes = -1;
+            }
+        }
+        int deltas = -1;
+        if (onDelta)
+        {
+            deltas = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (deltas >= 0 &&
+                inotify_add_watch(deltas, deltaDirectory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+            {
+                close(deltas);
+                deltas = -1;
+            }
+        }
+        _stop = eventfd(0, EFD_CLOEXEC);
+        if (_stop < 0 || (onSignal && signals < 0) || (onChange && changes < 0) || (onDelta && deltas < 0))
+        {
+            int saved = errno;
+            for (int fd : {signals, changes, deltas})
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+            throw std::runtime_error(std::string("can't watch the database: ") + std::strerror(saved));
+        }
+        // the watcher starts with every signal blocked, so signals meant for the others (say the server's SIGTERM)
+        // are never delivered to it
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &saved);
+        _watcher = std::thread([this, signals, changes, name, deltas, deltaDirectory]
+                               {
+                                   watchLoop(signals, changes, name, deltas, deltaDirectory);
+                               });
+        pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+    }
+
+    /**
+     * loads the database again, applies the deltas applied so far that are newer than its file on top of it and
+     * publishes it, then waits for the messages still being scored with the old version and frees it. if the
+     * database can't be loaded the current version stays.
+     * @return- true if the new version was published.
+     */
+    bool reload()
+    {
+        std::lock_guard<std::mutex> guard(_reloading);
+        auto started = std::chrono::steady_clock::now();
+        std::shared_ptr<const ScoringEngine> fresh;
+        // looked at before the load, a file replaced after that is reloaded again anyway
+        timespec loaded = {};
+        bool dated = modifiedAt(_path, loaded);
+        try
+        {
+            fresh = std::make_shared<const ScoringEngine>(_path, _threshold, _version.load() + 1, _text);
+        }
+        catch (const std::exception &ex)
+        {
+            if (_log != nullptr)
+            {
+                *_log << "reload of " << _path << " failed, keeping version " << _version.load() << ": "
+                      << ex.what() << std::endl;
+            }
+            return false;
+        }
+        std::vector<AppliedDelta> kept;
+        size_t older = 0;
+        size_t discarded = 0;
+        for (AppliedDelta &delta : _applied)
+        {
+            if (dated && !after(delta.modified, loaded))
+            {
+                older++;
+                discarded += delta.ops.size();
+                continue;
+            }
+            try
+            {
+                fresh = fresh->withDelta(delta.ops, delta.path, fresh->version() + 1);
+                kept.push_back(std::move(delta));
+            }
+            catch (const std::exception &ex)
+            {
+                if (_log != nullptr)
+                {
+                    *_log << "delta " << delta.path << " doesn't fit the reloaded " << _path << ", dropped it: "
+                          << ex.what() << std::endl;
+                }
+            }
+        }
+        _applied = std::move(kept);
+        std::shared_ptr<const ScoringEngine> old = publish(fresh);
+        auto published = std::chrono::steady_clock::now();
+
+        // no one can take a new snapshot of the old version, so once this is the last one it stays the last one
+        while (old.use_count() > 1)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(RELOAD_DRAIN_MICROS));
+        }
+        carryOver(*old);
+        old.reset();
+        sweep(nullptr);
+        if (_log != nullptr)
+        {
+            using ms = std::chrono::milliseconds;
+            *_log << "reloaded " << _path << " as version " << fresh->version() << " ("
+                  << fresh->phrases().size() << " phrases, " << _applied.size() << " deltas applied again, " << older
+                  << " older than the database dropped with their " << discarded << " changes), built in "
+                  << std::chrono::duration_cast<ms>(published - started).count() << "ms, drained in "
+                  << std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - published).count() << "ms"
+                  << std::endl;
+        }
+        if (fresh->overlay().size() > OVERLAY_MERGE_MAX)
+        {
+            fresh.reset();
+            mergeLocked();
+        }
+        return true;
+    }
+
+    /**
+     * applies a delta to the current version and publishes the result, without waiting for the messages being
+     * scored with the version it replaces. the overlay is merged right away if it grew past OVERLAY_MERGE_MAX. if
+     * the delta is malformed or doesn't fit the database, nothing of it is applied and the current version stays.
+     * @param deltaPath- the path of the delta.
+     * @return- true if the new version was published.
+     */
+    bool apply(const std::string &deltaPath)
+    {
+        std::lock_guard<std::mutex> guard(_reloading);
+        auto started = std::chrono::steady_clock::now();
+        std::shared_ptr<const ScoringEngine> current = get();
+        std::shared_ptr<const ScoringEngine> fresh;
+        std::vector<DeltaOp> ops;
+        try
+        {
+            ops = loadDelta(deltaPath);
+            fresh = current->withDelta(ops, deltaPath, _version.load() + 1);
+        }
+        catch (const std::exception &ex)
+        {
+            if (_log != nullptr)
+            {
+                *_log << "delta " << deltaPath << " failed, keeping version " << _version.load() << ": "
+                      << ex.what() << std::endl;
+            }
+            return false;
+        }
+        current.reset();
+        sweep(publish(fresh));
+        timespec modified = {};
+        if (!modifiedAt(deltaPath, modified))
+        {
+            // gone already, it is as new as the moment it was applied
+            clock_gettime(CLOCK_REALTIME, &modified);
+        }
+        _applied.push_back({deltaPath, ops, modified});
+        if (_log != nullptr)
+        {
+            using us = std::chrono::microseconds;
+            *_log << "applied " << deltaPath << " as version " << fresh->version() << " (" << ops.size()
+                  << " changes, " << fresh->overlay().size() << " in the overlay) in "
+                  << std::chrono::duration_cast<us>(std::chrono::steady_clock::now() - started).count() << "us"
+                  << std::endl;
+        }
+        if (fresh->overlay().size() > OVERLAY_MERGE_MAX)
+        {
+            fresh.reset();
+            mergeLocked();
+        }
+        return true;
+    }
+
+    /**
+     * merges the overlay of the current version into a rebuilt automaton and publishes it, like apply() without
+     * waiting for the versions it replaces. the versions retired since are freed too if no message holds them.
+     */
+    void merge()
+    {
+        std::lock_guard<std::mutex> guard(_reloading);
+        mergeLocked();
+    }
+
+    /**
+     * getter for the number of replaced versions some message still holds.
+     * @return- the number of retired versions not freed yet.
+     */
+    size_t retired() const
+    {
+        std::lock_guard<std::mutex> guard(_retiring);
+        return _retired.size();
+    }
+
+    /**
+     * takes a snapshot of the current engine, which stays valid (and current for whoever holds it) until it is
+     * let go of, however many reloads happen in between.
+     * @return- the current engine.
+     */
+    std::shared_ptr<const ScoringEngine> get() const
+    {
+        return std::atomic_load(&_current);
+    }
+
+    /**
+     * getter for the version of the current engine, counting up from 1 with every reload.
+     * @return- the current version.
+     */
+    uint64_t version() const
+    {
+        return _version.load(std::memory_order_acquire);
+    }
+
+    /**
+     * states wether a score makes its message spam.
+     * @param score- the score of a message.
+     * @return- true if the score reaches the threshold and false otherwise.
+     */
+    bool isSpam(long long score) const
+    {
+        return score >= _threshold;
+    }
+
+    /**
+     * the verdict on a score.
+     * @param score- the score of a message.
+     * @return- SPAM or NOT_SPAM.
+     */
+    const char *verdict(long long score) const
+    {
+        return isSpam(score) ? SPAM : NOT_SPAM;
+    }
+
+    /**
+     * getter for the threshold.
+     * @return- the score from which a message is spam.
+     */
+    long long threshold() const
+    {
+        return _threshold;
+    }
+
+    /**
+     * getter for the number of messages whose scoring stopped early, with every version.
+     * @return- the number of early exits so far.
+     */
+    uint64_t earlyExits() const
+    {
+        std::lock_guard<std::mutex> guard(_retiring);
+        uint64_t total = _retiredExits.load(std::memory_order_relaxed) + get()->earlyExits();
+        for (const auto &old : _retired)
+        {
+            total += old->earlyExits();
+        }
+        return total;
+    }
+
+    /**
+     * getter for the number of message bytes early exits skipped, with every version.
+     * @return- the number of bytes that were neither folded nor matched thanks to early exit.
+     */
+    uint64_t bytesSaved() const
+    {
+        std::lock_guard<std::mutex> guard(_retiring);
+        uint64_t total = _retiredBytes.load(std::memory_order_relaxed) + get()->bytesSaved();
+        for (const auto &old : _retired)
+        {
+            total += old->bytesSaved();
+        }
+        return total;
+    }
+};
+
+#endif //SPAMDETECTOR_LIVEENGINE_HPP
@@ -0,0 +1,559 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#ifndef SPAMDETECTOR_MESSAGEINGEST_HPP
+#define SPAMDETECTOR_MESSAGEINGEST_HPP
+
+#define INGEST_DEF_DEPTH 32
+#define INGEST_SLOT_SIZE (1UL << 20)
+#define INGEST_ALIGNMENT 4096
+#define NO_SLOT (-1)
+
+/**
+ * a bare io_uring instance driven through the raw system calls, just what reading files needs: submitting reads
+ * (into registered buffers when the kernel lets us register them) and reaping their completions.
+ */
+class IoUring
+{
+private:
+    int _fd;
+    void *_sqRing;
+    size_t _sqRingSize;
+    void *_cqRing;
+    size_t _cqRingSize;
+    io_uring_sqe *_sqes;
+    size_t _sqesSize;
+    unsigned *_sqTail;
+    unsigned *_sqMask;
+    unsigned *_sqArray;
+    unsigned *_cqHead;
+    unsigned *_cqTail;
+    unsigned *_cqMask;
+    io_uring_cqe *_cqes;
+    unsigned _pending;
+    bool _registered;
+
+    /**
+     * unmaps the rings and closes the instance.
+     */
+    void release()
+    {
+        if (_sqes != nullptr)
+        {
+            munmap(_sqes, _sqesSize);
+        }
+        if (_cqRing != nullptr && _cqRing != _sqRing)
+        {
+            munmap(_cqRing, _cqRingSize);
+        }
+        if (_sqRing != nullptr)
+        {
+            munmap(_sqRing, _sqRingSize);
+        }
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+        }
+        _fd = -1;
+        _sqRing = _cqRing = nullptr;
+        _sqes = nullptr;
+    }
+
+    /**
+     * maps a region of the instance.
+     * @param size- the size of the region.
+     * @param offset- which region, IORING_OFF_SQ_RING / IORING_OFF_CQ_RING / IORING_OFF_SQES.
+     * @return- the mapped region.
+     */
+    void *map(size_t size, off_t offset)
+    {
+        void *region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, offset);
+        if (region == MAP_FAILED)
+        {
+            throw std::runtime_error(std::string("can't map io_uring: ") + std::strerror(errno));
+        }
+        return region;
+    }
+
+public:
+    /**
+     * constructor, sets up an instance.
+     * throws std::runtime_error if the kernel has no io_uring (or doesn't let this process use it).
+     * @param entries- the number of submission queue entries.
+     */
+    explicit IoUring(unsigned entries) : _fd(-1), _sqRing(nullptr), _sqRingSize(0), _cqRing(nullptr),
+            _cqRingSize(0), _sqes(nullptr), _sqesSize(0), _pending(0), _registered(false)
+    {
+        io_uring_params params = {};
+        _fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+        if (_fd < 0)
+        {
+            throw std::runtime_error(std::string("can't set up io_uring: ") + std::strerror(errno));
+        }
+        try
+        {
+            _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+            {
+                _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+            }
+            _sqRing = map(_sqRingSize, IORING_OFF_SQ_RING);
+            _cqRing = params.features & IORING_FEAT_SINGLE_MMAP ? _sqRing : map(_cqRingSize, IORING_OFF_CQ_RING);
+            _sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+            _sqes = static_cast<io_uring_sqe *>(map(_sqesSize, IORING_OFF_SQES));
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+        auto *sq = static_cast<char *>(_sqRing);
+        auto *cq = static_cast<char *>(_cqRing);
+        _sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        _sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        _sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        _cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring &) = delete;
+
+    IoUring &operator=(const IoUring &) = delete;
+
+    /**
+     * destructor, tears the instance down.
+     */
+    ~IoUring()
+    {
+        release();
+    }
+
+    /**
+     * registers buffers with the instance, so reads into them skip pinning the pages on every request.
+     * @param buffers- the buffers.
+     * @return- true if they were registered, false if the kernel refused (locked memory limit for one), in which
+     * case reads have to go into them as ordinary buffers.
+     */
+    bool registerBuffers(const std::vector<iovec> &buffers)
+    {
+        _registered = syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, buffers.data(),
+                              (unsigned) buffers.size()) == 0;
+        return _registered;
+    }
+
+    /**
+     * queues a read, submitted with the next wait().
+     * @param fd- the file to read from.
+     * @param buffer- where to read to, inside registered buffer 'bufferIndex' if buffers were registered.
+     * @param length- the number of bytes to read.
+     * @param offset- the offset in the file.
+     * @param bufferIndex- the index of the registered buffer.
+     * @param tag- handed back with the completion.
+     */
+    void read(int fd, char *buffer, size_t length, size_t offset, unsigned bufferIndex, uint64_t tag)
+    {
+        unsigned tail = *_sqTail;
+        unsigned index = tail & *_sqMask;
+        io_uring_sqe &sqe = _sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = _registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = (unsigned) length;
+        sqe.off = offset;
+        sqe.buf_index = (uint16_t) bufferIndex;
+        sqe.user_data = tag;
+        _sqArray[index] = index;
+        __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+        _pending++;
+    }
+
+    /**
+     * submits the queued reads and waits until at least one read is complete, then reports every completed one.
+     * @param onComplete- called as onComplete(tag, result) for every completion, 'result' being the number of
+     * bytes read or minus the error number.
+     */
+    template<typename onCompleteT>
+    void wait(const onCompleteT &onComplete)
+    {
+        // the kernel may take fewer reads than were queued, the rest stay in the ring and are submitted again
+        for (;;)
+        {
+            long submitted = syscall(__NR_io_uring_enter, _fd, _pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (submitted < 0)
+            {
+                if (errno != EINTR)
+                {
+                    throw std::runtime_error(std::string("can't submit to io_uring: ") + std::strerror(errno));
+                }
+                continue;
+            }
+            _pending -= std::min<unsigned>((unsigned) submitted, _pending);
+            if (_pending == 0)
+            {
+                break;
+            }
+        }
+        unsigned head = *_cqHead;
+        unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            const io_uring_cqe &cqe = _cqes[head & *_cqMask];
+            onComplete(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+
+/**
+ * how the messages of a batch are read in.
+ */
+enum IngestBackend
+{
+    INGEST_MMAP, INGEST_PREAD, INGEST_URING
+};
+
+/**
+ * a message handed over by the ingest: its bytes, or why it couldn't be read, or a note that it is too big for
+ * the slots and has to be opened by whoever scores it.
+ */
+struct IngestedMessage
+{
+    size_t index;
+    std::string_view message;
+    int slot;
+    bool oversized;
+    std::string error;
+};
+
+/**
+ * reads the messages of a batch ahead of the scoring workers, into a fixed set of aligned slots.
+ * with io_uring it keeps up to 'depth' reads in flight at once (into registered buffers if it can), so a fast
+ * disk is kept busy instead of waiting on one blocking read per message. without io_uring (an old kernel, or a
+ * sandbox that forbids it) it falls back to reading the messages one by one with pread, which still overlaps the
+ * reading with the scoring. a message is handed over as soon as it is read, and its slot is reused once the
+ * scorer releases it, so the memory used stays at depth * slot size.
+ */
+class MessageIngest
+{
+private:
+    /**
+     * a read in flight.
+     */
+    struct Read
+    {
+        size_t index;
+        int fd;
+        size_t size;
+        size_t done;
+    };
+
+    IngestBackend _backend;
+    size_t _depth;
+    size_t _slotSize;
+    char *_memory;
+    std::unique_ptr<IoUring> _ring;
+    std::vector<Read> _reads;
+    std::vector<int> _free;
+    std::mutex _lock;
+    std::condition_variable _released;
+
+    /**
+     * takes a free slot, waiting for one to be released if there is none.
+     * @param wait- false to return NO_SLOT instead of waiting.
+     * @return- the slot.
+     */
+    int takeSlot(bool wait)
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        if (wait)
+        {
+            _released.wait(guard, [this]
+            { return !_free.empty(); });
+        }
+        if (_free.empty())
+        {
+            return NO_SLOT;
+        }
+        int slot = _free.back();
+        _free.pop_back();
+        return slot;
+    }
+
+    /**
+     * opens a message file and checks if it fits a slot.
+     * @param index- the index of the message.
+     * @param path- its path.
+     * @param fd- set to the open file, if it fits a slot.
+     * @param size- set to its size.
+     * @param deliver- called with the message if it is handed over right away (an error, an empty or an
+     * oversized message).
+     * @return- true if the message has to be read into a slot.
+     */
+    template<typename deliverT>
+    bool prepare(size_t index, const std::string &path, int &fd, size_t &size, const deliverT &deliver)
+    {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info = {};
+        if (fd < 0 || fstat(fd, &info) != 0)
+        {
+            std::string error = std::string("can't open ") + path + ": " + std::strerror(errno);
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            deliver(IngestedMessage{index, std::string_view(), NO_SLOT, false, error});
+            return false;
+        }
+        size = info.st_size;
+        if (!S_ISREG(info.st_mode) || size > _slotSize || size == 0)
+        {
+            ::close(fd);
+            deliver(IngestedMessage{index, std::string_view(), NO_SLOT, size != 0 || !S_ISREG(info.st_mode), ""});
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * the pread loop: reads the messages one by one into free slots.
+     * @param paths- the paths of the messages.
+     * @param deliver- called with every message.
+     */
+    template<typename deliverT>
+    void runPread(const std::vector<std::string> &paths, const deliverT &deliver)
+    {
+        for (size_t index = 0; index < paths.size(); index++)
+        {
+            int fd = -1;
+            size_t size = 0;
+            if (paths[index].empty() || !prepare(index, paths[index], fd, size, deliver))
+            {
+                continue;
+            }
+            int slot = takeSlot(true);
+            char *buffer = _memory + slot * _slotSize;
+            size_t done = 0;
+            std::string error;
+            while (done < size)
+            {
+                ssize_t got = pread(fd, buffer + done, size - done, done);
+                if (got < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (got < 0)
+                {
+                    error = std::string("can't read ") + paths[index] + ": " + std::strerror(errno);
+                }
+                if (got <= 0)
+                {
+                    break;
+                }
+                done += got;
+            }
+            ::close(fd);
+            if (!error.empty())
+            {
+                release(slot);
+                deliver(IngestedMessage{index, std::string_view(), NO_SLOT, false, error});
+                continue;
+            }
+            deliver(IngestedMessage{index, std::string_view(buffer, done), slot, false, ""});
+        }
+    }
+
+    /**
+     * the io_uring loop: keeps the ring topped up with reads while there are messages and free slots, and hands
+     * the messages over as their reads complete. a short read is resubmitted for the rest.
+     * @param paths- the paths of the messages.
+     * @param deliver- called with every message.
+     */
+    template<typename deliverT>
+    void runUring(const std::vector<std::string> &paths, const deliverT &deliver)
+    {
+        size_t next = 0;
+        size_t inFlight = 0;
+        while (next < paths.size() || inFlight > 0)
+        {
+            while (next < paths.size() && inFlight < _depth)
+            {
+                if (paths[next].empty())
+                {
+                    next++;
+                    continue;
+                }
+                // with nothing in flight there is nothing to reap, so it is fine to wait for a scorer
+                int slot = takeSlot(inFlight == 0);
+                if (slot == NO_SLOT)
+                {
+                    break;
+                }
+                int fd = -1;
+                size_t size = 0;
+                size_t index = next++;
+                if (!prepare(index, paths[index], fd, size, deliver))
+                {
+                    release(slot);
+                    continue;
+                }
+                _reads[slot] = {index, fd, size, 0};
+                _ring->read(fd, _memory + slot * _slotSize, size, 0, slot, slot);
+                inFlight++;
+            }
+            if (inFlight == 0)
+            {
+                continue;
+            }
+            _ring->wait([this, &paths, &inFlight, &deliver](uint64_t tag, int result)
+                        {
+                            int slot = (int) tag;
+                            Read &read = _reads[slot];
+                            char *buffer = _memory + slot * _slotSize;
+                            if (result > 0 && read.done + result < read.size)
+                            {
+                                read.done += result;
+                                _ring->read(read.fd, buffer + read.done, read.size - read.done, read.done,
+                                            slot, slot);
+                                return;
+                            }
+                            ::close(read.fd);
+                            inFlight--;
+                            if (result < 0)
+                            {
+                                release(slot);
+                                deliver(IngestedMessage{read.index, std::string_view(), NO_SLOT, false,
+                                                        "can't read " + paths[read.index] + ": " +
+                                                        std::strerror(-result)});
+                                return;
+                            }
+                            // a file that shrank since it was opened ends early, with a read of 0
+                            read.done += result;
+                            deliver(IngestedMessage{read.index, std::string_view(buffer, read.done), slot, false,
+                                                    ""});
+                        });
+        }
+    }
+
+public:
+    /**
+     * constructor, allocates the slots and sets up the backend. asking for io_uring where it isn't available
+     * gets pread instead.
+     * @param backend- INGEST_PREAD or INGEST_URING.
+     * @param depth- the number of slots, that is the number of messages read ahead (and of reads in flight).
+     * @param slotSize- the size of a slot, bigger messages are left to the scorer to open.
+     */
+    MessageIngest(IngestBackend backend, size_t depth, size_t slotSize = INGEST_SLOT_SIZE) : _backend(backend),
+            _depth(std::max<size_t>(depth, 1)), _slotSize(slotSize), _memory(nullptr)
+    {
+        void *memory = nullptr;
+        if (posix_memalign(&memory, INGEST_ALIGNMENT, _depth * _slotSize) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        _memory = static_cast<char *>(memory);
+        _reads.resize(_depth);
+        for (size_t slot = _depth; slot > 0; slot--)
+        {
+            _free.push_back((int) slot - 1);
+        }
+        if (_backend == INGEST_URING)
+        {
+            try
+            {
+                _ring.reset(new IoUring((unsigned) _depth));
+                std::vector<iovec> buffers(_depth);
+                for (size_t slot = 0; slot < _depth; slot++)
+                {
+                    buffers[slot] = {_memory + slot * _slotSize, _slotSize};
+                }
+                _ring->registerBuffers(buffers);
+            }
+            catch (const std::runtime_error &ex)
+            {
+                _backend = INGEST_PREAD;
+            }
+        }
+    }
+
+    MessageIngest(const MessageIngest &) = delete;
+
+    MessageIngest &operator=(const MessageIngest &) = delete;
+
+    /**
+     * destructor, frees the slots.
+     */
+    ~MessageIngest()
+    {
+        _ring.reset();
+        std::free(_memory);
+    }
+
+    /**
+     * reads every message, in order, handing each one over as it is ready.
+     * @param paths- the paths of the messages, an empty path is skipped (the message comes from elsewhere).
+     * @param deliver- called with an IngestedMessage for every message. a message that holds a slot stays valid
+     * until the slot is released.
+     */
+    template<typename deliverT>
+    void run(const std::vector<std::string> &paths, const deliverT &deliver)
+    {
+        if (_backend == INGEST_URING)
+        {
+            runUring(paths, deliver);
+        }
+        else
+        {
+            runPread(paths, deliver);
+        }
+    }
+
+    /**
+     * gives a slot back once its message is scored, may be called from any thread.
+     * @param slot- the slot, NO_SLOT is ignored.
+     */
+    void release(int slot)
+    {
+        if (slot == NO_SLOT)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _free.push_back(slot);
+        }
+        _released.notify_one();
+    }
+
+    /**
+     * getter for the backend in use.
+     * @return- the backend, pread if io_uring was asked for but isn't available.
+     */
+    IngestBackend backend() const
+    {
+        return _backend;
+    }
+};
+
+#endif //SPAMDETECTOR_MESSAGEINGEST_HPP
@@ -0,0 +1,228 @@
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef SPAMDETECTOR_MESSAGEINPUT_HPP
+#define SPAMDETECTOR_MESSAGEINPUT_HPP
+
+#define STDIN_PATH "-"
+#define INPUT_ALIGNMENT 64
+#define INPUT_DEF_BUFFER (64UL << 10)
+
+/**
+ * zero copy message input: regular files are mapped straight into memory, and everything else (pipes, stdin)
+ * is read into one aligned buffer that is kept and reused for the next message.
+ * either way the message is handed out as a std::string_view into that memory, which stays valid until the
+ * next open / read or until the input is closed, so the whole scoring pass runs without copying the message
+ * into std::strings.
+ */
+class MessageInput
+{
+private:
+    void *_mapped;
+    size_t _mappedSize;
+    char *_buffer;
+    size_t _bufferCapacity;
+    std::string_view _view;
+
+    /**
+     * makes sure the buffer can hold 'needed' bytes, keeping what is in it.
+     * @param needed- the number of bytes.
+     */
+    void reserve(size_t needed)
+    {
+        if (needed <= _bufferCapacity)
+        {
+            return;
+        }
+        size_t capacity = std::max<size_t>(_bufferCapacity * 2, INPUT_DEF_BUFFER);
+        while (capacity < needed)
+        {
+            capacity *= 2;
+        }
+        void *fresh = nullptr;
+        if (posix_memalign(&fresh, INPUT_ALIGNMENT, capacity) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        if (_buffer != nullptr)
+        {
+            std::memcpy(fresh, _buffer, _bufferCapacity);
+            std::free(_buffer);
+        }
+        _buffer = static_cast<char *>(fresh);
+        _bufferCapacity = capacity;
+    }
+
+    /**
+     * the error for a failed system call on a path.
+     * @param what- what was being done.
+     * @param path- the path.
+     * @return- the error to throw.
+     */
+    static std::runtime_error failure(const std::string &what, const std::string &path)
+    {
+        return std::runtime_error("can't " + what + " " + path + ": " + std::strerror(errno));
+    }
+
+public:
+    /**
+     * constructor for an input with nothing open and no buffer yet.
+     */
+    MessageInput() : _mapped(nullptr), _mappedSize(0), _buffer(nullptr), _bufferCapacity(0)
+    {
+    }
+
+    MessageInput(const MessageInput &) = delete;
+
+    MessageInput &operator=(const MessageInput &) = delete;
+
+    /**
+     * destructor, unmaps the current message and frees the buffer.
+     */
+    ~MessageInput()
+    {
+        close();
+        std::free(_buffer);
+    }
+
+    /**
+     * opens a message: maps it if it is a regular file, and reads it into the buffer otherwise ("-" is stdin).
+     * the previous message is closed first.
+     * @param path- the path of the message.
+     * @return- a view of the whole message.
+     */
+    std::string_view open(const std::string &path)
+    {
+        close();
+        if (path == STDIN_PATH)
+        {
+            return read(STDIN_FILENO, path);
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw failure("open", path);
+        }
+        struct stat info = {};
+        if (fstat(fd, &info) != 0)
+        {
+            int saved = errno;
+            ::close(fd);
+            errno = saved;
+            throw failure("stat", path);
+        }
+        if (!S_ISREG(info.st_mode))
+        {
+            try
+            {
+                read(fd, path);
+            }
+            catch (...)
+            {
+                ::close(fd);
+                throw;
+            }
+            ::close(fd);
+            return _view;
+        }
+        if (info.st_size == 0)
+        {
+            ::close(fd);
+            _view = std::string_view();
+            return _view;
+        }
+        void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        int saved = errno;
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            errno = saved;
+            throw failure("map", path);
+        }
+        madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+        _mapped = mapped;
+        _mappedSize = info.st_size;
+        _view = std::string_view(static_cast<const char *>(mapped), _mappedSize);
+        return _view;
+    }
+
+    /**
+     * reads everything from a file descriptor into the buffer, the previous message is closed first.
+     * @param fd- the file descriptor, left open.
+     * @param name- the name of the input, for errors.
+     * @return- a view of the whole message.
+     */
+    std::string_view read(int fd, const std::string &name)
+    {
+        close();
+        size_t length = 0;
+        while (true)
+        {
+            reserve(length + 1);
+            ssize_t got = ::read(fd, _buffer + length, _bufferCapacity - length);
+            if (got < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw failure("read", name);
+            }
+            if (got == 0)
+            {
+                break;
+            }
+            length += got;
+        }
+        _view = std::string_view(_buffer, length);
+        return _view;
+    }
+
+    /**
+     * closes the current message, unmapping it if it was mapped. the buffer is kept for the next one.
+     */
+    void close()
+    {
+        if (_mapped != nullptr)
+        {
+            munmap(_mapped, _mappedSize);
+            _mapped = nullptr;
+            _mappedSize = 0;
+        }
+        _view = std::string_view();
+    }
+
+    /**
+     * swaps the current messages (and buffers) of two inputs, so a message can outlive the input that opened it.
+     * @param other- the other input.
+     */
+    void swap(MessageInput &other)
+    {
+        std::swap(_mapped, other._mapped);
+        std::swap(_mappedSize, other._mappedSize);
+        std::swap(_buffer, other._buffer);
+        std::swap(_bufferCapacity, other._bufferCapacity);
+        std::swap(_view, other._view);
+    }
+
+    /**
+     * getter for the current message.
+     * @return- a view of the whole message.
+     */
+    std::string_view view() const
+    {
+        return _view;
+    }
+};
+
+#endif //SPAMDETECTOR_MESSAGEINPUT_HPP
@@ -0,0 +1,685 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include "htmlStripper.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIMEWALKER_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_MIMEWALKER_HPP
+#define SPAMDETECTOR_MIMEWALKER_HPP
+
+#define BASE64_INVALID 0xFF
+#define BASE64_PAD 0xFE
+#define BASE64_BLOCK 32
+#define BASE64_SLACK 8
+#define MIME_MAX_DEPTH 16
+#define MIME_MIN_READ 3
+
+/**
+ * a streaming base64 decoder: the text may come in any number of pieces, cut anywhere, and everything that isn't
+ * in the base64 alphabet (line breaks, mostly) is skipped.
+ * with AVX2, 32 characters at a time are checked and translated to their 6 bit values with byte shuffles and
+ * packed into 24 bytes with two multiply-adds (Muła and Lemire's lookup decoder), as long as the next 32 bytes
+ * are all base64 and the decoder is at a 4 character boundary. everything else, the rest of a line and its line
+ * break for one, goes a character at a time through a table.
+ */
+class Base64Decoder
+{
+private:
+    uint32_t _bits;
+    unsigned int _count;
+
+    /**
+     * the table of the 6 bit values of the base64 characters.
+     */
+    struct Table
+    {
+        uint8_t value[256];
+
+        Table() : value()
+        {
+            const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::memset(value, BASE64_INVALID, sizeof(value));
+            for (uint8_t v = 0; v < 64; v++)
+            {
+                value[(unsigned char) alphabet[v]] = v;
+            }
+            value[(unsigned char) '='] = BASE64_PAD;
+        }
+    };
+
+    /**
+     * writes what a partial group of characters holds, as if it were padded.
+     * @param out- where the bytes go.
+     * @return- the number of bytes written.
+     */
+    size_t flush(unsigned char *out)
+    {
+        size_t written = 0;
+        if (_count == 2)
+        {
+            out[written++] = (unsigned char) (_bits >> 4);
+        }
+        else if (_count == 3)
+        {
+            out[written++] = (unsigned char) (_bits >> 10);
+            out[written++] = (unsigned char) (_bits >> 2);
+        }
+        _bits = 0;
+        _count = 0;
+        return written;
+    }
+
+#ifdef MIMEWALKER_X86
+
+    /**
+     * decodes blocks of 32 base64 characters with AVX2 until one has something else in it.
+     * @param in- the text.
+     * @param i- the position to start from, moved past the blocks decoded.
+     * @param length- the length of the text.
+     * @param out- where the bytes go, with BASE64_SLACK bytes to spare after the last one.
+     * @param o- the position to write to, moved along.
+     */
+    __attribute__((target("avx2")))
+    static void decodeAvx2(const unsigned char *in, size_t &i, size_t length, unsigned char *out, size_t &o)
+    {
+        const __m256i lutLow = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13,
+                                                0x1A, 0x1B, 0x1B, 0x1B, 0x1A, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                                0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+        const __m256i lutHigh = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10,
+                                                 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+                                                 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16,
+                                                 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        const __m256i slash = _mm256_set1_epi8('/');
+        const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6,
+                                              5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+        for (; i + BASE64_BLOCK <= length; i += BASE64_BLOCK, o += 24)
+        {
+            __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+            __m256i high = _mm256_and_si256(_mm256_srli_epi32(chars, 4), nibble);
+            __m256i low = _mm256_and_si256(chars, nibble);
+            // a character is in the alphabet if the classes of its low and high nibbles don't overlap (every low
+            // nibble class overlaps the class of the high nibbles 8 to F, so non ASCII bytes never are)
+            __m256i lowClass = _mm256_shuffle_epi8(lutLow, low);
+            __m256i highClass = _mm256_shuffle_epi8(lutHigh, high);
+            if (!_mm256_testz_si256(lowClass, highClass))
+            {
+                return;
+            }
+            __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(chars, slash), high));
+            __m256i values = _mm256_add_epi8(chars, roll);
+            __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+            __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+            __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(words, pack), lanes);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + o), bytes);
+        }
+    }
+
+#endif
+
+public:
+    /**
+     * constructor, for the start of a text.
+     */
+    Base64Decoder() : _bits(0), _count(0)
+    {
+    }
+
+    /**
+     * the most bytes a piece of text can decode to, with the slack decode() needs.
+     * @param length- the length of the piece.
+     * @return- the size 'out' has to have.
+     */
+    static size_t maxDecoded(size_t length)
+    {
+        return length / 4 * 3 + 3 + BASE64_SLACK;
+    }
+
+    /**
+     * decodes the next piece of a text.
+     * @param text- the piece.
+     * @param length- the length of the piece.
+     * @param dst- where the bytes go, maxDecoded(length) of them at most.
+     * @return- the number of bytes written.
+     */
+    size_t decode(const char *text, size_t length, char *dst)
+    {
+        static const Table table;
+#ifdef MIMEWALKER_X86
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+        const auto *in = reinterpret_cast<const unsigned char *>(text);
+        auto *out = reinterpret_cast<unsigned char *>(dst);
+        size_t i = 0;
+        size_t o = 0;
+        while (i < length)
+        {
+#ifdef MIMEWALKER_X86
+            if (avx2 && _count == 0)
+            {
+                decodeAvx2(in, i, length, out, o);
+            }
+#endif
+            // a character at a time until a group ends past something that isn't base64, or a block went by
+            bool skipped = false;
+            for (size_t stop = i + BASE64_BLOCK; i < length; i++)
+            {
+                if (_count == 0 && (skipped || i >= stop))
+                {
+                    break;
+                }
+                uint8_t value = table.value[in[i]];
+                if (value < 64)
+                {
+                    _bits = (_bits << 6) | value;
+                    if (++_count == 4)
+                    {
+                        out[o++] = (unsigned char) (_bits >> 16);
+                        out[o++] = (unsigned char) (_bits >> 8);
+                        out[o++] = (unsigned char) _bits;
+                        _bits = 0;
+                        _count = 0;
+                    }
+                }
+                else
+                {
+                    if (value == BASE64_PAD)
+                    {
+                        o += flush(out + o);
+                    }
+                    skipped = true;
+                }
+            }
+        }
+        return o;
+    }
+
+    /**
+     * ends the text, writing what a last unpadded group holds.
+     * @param dst- where the bytes go, 2 of them at most.
+     * @return- the number of bytes written.
+     */
+    size_t finish(char *dst)
+    {
+        return flush(reinterpret_cast<unsigned char *>(dst));
+    }
+};
+
+/**
+ * the value of a hex digit.
+ * @param c- the character.
+ * @return- its value, or -1 if it isn't a hex digit.
+ */
+inline int hexValue(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/**
+ * decodes quoted-printable text: "=XY" is the byte with hex value XY, '=' at the end of a line is a soft line
+ * break and goes away with the line break, and everything else is itself. the runs between the '='s are copied
+ * whole (memchr finds the next '=' with SIMD).
+ * @param text- the text, which must not end inside an escape unless the quoted-printable text ends there too.
+ * @param length- the length of the text.
+ * @param dst- where the bytes go, 'length' of them at most.
+ * @return- the number of bytes written.
+ */
+inline size_t decodeQuotedPrintable(const char *text, size_t length, char *dst)
+{
+    size_t o = 0;
+    for (size_t i = 0; i < length;)
+    {
+        const auto *equals = static_cast<const char *>(std::memchr(text + i, '=', length - i));
+        size_t run = (equals == nullptr ? length : equals - text) - i;
+        std::memcpy(dst + o, text + i, run);
+        o += run;
+        i += run;
+        if (i == length)
+        {
+            break;
+        }
+        int high = i + 2 < length ? hexValue(text[i + 1]) : -1;
+        int low = i + 2 < length ? hexValue(text[i + 2]) : -1;
+        if (high >= 0 && low >= 0)
+        {
+            dst[o++] = (char) (high << 4 | low);
+            i += 3;
+        }
+        else if (i + 1 < length && text[i + 1] == '\n')
+        {
+            i += 2;
+        }
+        else if (i + 2 < length && text[i + 1] == '\r' && text[i + 2] == '\n')
+        {
+            i += 3;
+        }
+        else
+        {
+            dst[o++] = '=';
+            i++;
+        }
+    }
+    return o;
+}
+
+/**
+ * walks the MIME structure of a message and hands out its text a block at a time, with the base64 and
+ * quoted-printable bodies decoded on the way, so a decoded body never has to be held whole.
+ * the walk is lazy: the headers of a part are parsed when the walk gets to them, and a body ends at the next
+ * delimiter line of the innermost multipart, found when the body starts. everything but the encoded bodies
+ * (headers, delimiter lines, preambles, unencoded bodies) comes out as it is, so a message that isn't MIME comes
+ * out unchanged. a malformed message is never an error, the walk just reads the rest of it as it is.
+ * the text/html bodies can be converted to text on the way too (see HtmlStripper), after they are decoded.
+ */
+class MimeWalker
+{
+private:
+    enum Encoding
+    {
+        IDENTITY, BASE64, QUOTED_PRINTABLE
+    };
+
+    enum State
+    {
+        ENTITY, LEAF, TEXT, DELIMITER, DONE
+    };
+
+    std::string_view _message;
+    size_t _at;
+    State _state;
+    Encoding _leafEncoding;
+    std::vector<std::string> _delimiters;
+    size_t _segmentAt;
+    size_t _segmentEnd;
+    Encoding _encoding;
+    Base64Decoder _base64;
+    bool _html;
+    bool _leafHtml;
+    bool _stripping;
+    HtmlStripper _stripper;
+    std::string _scratch;
+
+    /**
+     * states wether a text starts with some prefix, case insensitive.
+     * @param text- the text.
+     * @param prefix- the prefix, lowercase.
+     * @return- true if it does.
+     */
+    static bool startsWith(std::string_view text, std::string_view prefix)
+    {
+        if (text.size() < prefix.size())
+        {
+            return false;
+        }
+        for (size_t k = 0; k < prefix.size(); k++)
+        {
+            if (std::tolower((unsigned char) text[k]) != prefix[k])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * trims the spaces and tabs off both ends of a text.
+     * @param text- the text.
+     * @return- the trimmed text.
+     */
+    static std::string_view trim(std::string_view text)
+    {
+        while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+        {
+            text.remove_prefix(1);
+        }
+        while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r'))
+        {
+            text.remove_suffix(1);
+        }
+        return text;
+    }
+
+    /**
+     * finds a header in a block of headers, unfolding its continuation lines.
+     * @param headers- the headers.
+     * @param name- the name of the header, lowercase, with its colon.
+     * @return- the value of the header, or "" if it isn't there.
+     */
+    static std::string header(std::string_view headers, std::string_view name)
+    {
+        std::string value;
+        bool inside = false;
+        for (size_t begin = 0; begin < headers.size();)
+        {
+            size_t end = std::min(headers.find('\n', begin), headers.size());
+            std::string_view line = headers.substr(begin, end - begin);
+            if (inside && !line.empty() && (line.front() == ' ' || line.front() == '\t'))
+            {
+                value += ' ';
+                value += trim(line);
+            }
+            else if (inside)
+            {
+                break;
+            }
+            else if (startsWith(line, name))
+            {
+                inside = true;
+                value = trim(line.substr(name.size()));
+            }
+            begin = end + 1;
+        }
+        return value;
+    }
+
+    /**
+     * the boundary parameter of a multipart content type.
+     * @param contentType- the value of the Content-Type header.
+     * @return- the boundary, or "" if it isn't a multipart type with one.
+     */
+    static std::string boundary(const std::string &contentType)
+    {
+        if (!startsWith(contentType, "multipart/"))
+        {
+            return "";
+        }
+        std::string lower = contentType;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c)
+        {
+            return (char) std::tolower(c);
+        });
+        size_t at = lower.find("boundary=");
+        if (at == std::string::npos)
+        {
+            return "";
+        }
+        at += std::strlen("boundary=");
+        if (at < contentType.size() && contentType[at] == '"')
+        {
+            size_t quote = contentType.find('"', at + 1);
+            return quote == std::string::npos ? "" : contentType.substr(at + 1, quote - at - 1);
+        }
+        size_t end = contentType.find_first_of("; \t", at);
+        return contentType.substr(at, end == std::string::npos ? std::string::npos : end - at);
+    }
+
+    /**
+     * the end of a block of headers, past the empty line after them.
+     * @param from- the start of the headers.
+     * @return- the start of the body, or the end of the message if there is no empty line.
+     */
+    size_t headersEnd(size_t from) const
+    {
+        for (size_t line = from; line < _message.size();)
+        {
+            if (_message[line] == '\n')
+            {
+                return line + 1;
+            }
+            if (_message[line] == '\r' && line + 1 < _message.size() && _message[line + 1] == '\n')
+            {
+                return line + 2;
+            }
+            size_t newline = _message.find('\n', line);
+            if (newline == std::string_view::npos)
+            {
+                break;
+            }
+            line = newline + 1;
+        }
+        return _message.size();
+    }
+
+    /**
+     * finds the next delimiter line of the innermost multipart.
+     * @param from- where to look from.
+     * @return- the position of its "--", or the end of the message if there is none.
+     */
+    size_t nextDelimiter(size_t from) const
+    {
+        const std::string &delimiter = _delimiters.back();
+        for (size_t at = from;; at++)
+        {
+            at = _message.find(delimiter, at);
+            if (at == std::string_view::npos)
+            {
+                return _message.size();
+            }
+            if (at == 0 || _message[at - 1] == '\n')
+            {
+                return at;
+            }
+        }
+    }
+
+    /**
+     * moves on to the next segment of the message, parsing what it has to on the way.
+     * @return- false if the walk is over.
+     */
+    bool nextSegment()
+    {
+        _encoding = IDENTITY;
+        _stripping = false;
+        _segmentAt = _at;
+        switch (_state)
+        {
+            case ENTITY:
+            {
+                size_t end = headersEnd(_at);
+                std::string_view headers = _message.substr(_at, end - _at);
+                std::string contentType = header(headers, "content-type:");
+                std::string parts = boundary(contentType);
+                std::string encoding = header(headers, "content-transfer-encoding:");
+                _leafHtml = _html && startsWith(contentType, "text/html");
+                _leafEncoding = startsWith(encoding, "base64") ? BASE64 :
+                                startsWith(encoding, "quoted-printable") ? QUOTED_PRINTABLE : IDENTITY;
+                if (!parts.empty() && _delimiters.size() < MIME_MAX_DEPTH)
+                {
+                    _delimiters.push_back("--" + parts);
+                    _state = TEXT;
+                }
+                else
+                {
+                    _state = LEAF;
+                }
+                _at = end;
+                break;
+            }
+            case LEAF:
+            case TEXT:
+            {
+                if (_state == LEAF)
+                {
+                    _encoding = _leafEncoding;
+                    _stripping = _leafHtml;
+                }
+                size_t delimiter = _delimiters.empty() ? _message.size() : nextDelimiter(_at);
+                // the line break before a delimiter belongs to the delimiter
+                size_t end = delimiter;
+                if (end > _at && _message[end - 1] == '\n')
+                {
+                    end--;
+                }
+                if (end > _at && _message[end - 1] == '\r')
+                {
+                    end--;
+                }
+                _at = end;
+                _state = delimiter == _message.size() ? DONE : DELIMITER;
+                break;
+            }
+            case DELIMITER:
+            {
+                size_t delimiter = _at;
+                while (_message[delimiter] == '\r' || _message[delimiter] == '\n')
+                {
+                    delimiter++;
+                }
+                size_t after = delimiter + _delimiters.back().size();
+                bool closing = _message.substr(after, 2) == "--";
+                size_t newline = _message.find('\n', after);
+                _at = newline == std::string_view::npos ? _message.size() : newline + 1;
+                if (closing)
+                {
+                    _delimiters.pop_back();
+                    _state = TEXT;
+                }
+                else
+                {
+                    _state = ENTITY;
+                }
+                break;
+            }
+            case DONE:
+                return false;
+        }
+        _segmentEnd = _at;
+        return true;
+    }
+
+    /**
+     * converts what was decoded into the scratch buffer from HTML to text.
+     * @param out- the text is appended to it.
+     * @param last- true if the body ends there.
+     */
+    void strip(std::string &out, bool last)
+    {
+        size_t old = out.size();
+        out.resize(old + HtmlStripper::maxStripped(_scratch.size()));
+        size_t written = _stripper.strip(_scratch.data(), _scratch.size(), &out[old]);
+        if (last)
+        {
+            written += _stripper.finish(&out[old + written]);
+        }
+        out.resize(old + written);
+        _scratch.clear();
+    }
+
+public:
+    /**
+     * constructor.
+     * @param message- the message, which has to outlive the walker.
+     * @param html- true to convert the text/html bodies to text.
+     */
+    explicit MimeWalker(std::string_view message, bool html = false) : _message(message), _at(0), _state(ENTITY),
+            _leafEncoding(IDENTITY), _segmentAt(0), _segmentEnd(0), _encoding(IDENTITY), _html(html),
+            _leafHtml(false), _stripping(false)
+    {
+    }
+
+    /**
+     * hands out the next block of the text of the message.
+     * @param out- the block is appended to it.
+     * @param max- about how many bytes to append, a little more (a decoded group) or less (an escape left for
+     * the next block) may be.
+     * @return- the number of bytes appended, 0 once the walk is over.
+     */
+    size_t read(std::string &out, size_t max)
+    {
+        size_t start = out.size();
+        while (out.size() - start < max)
+        {
+            std::string &decoded = _stripping ? _scratch : out;
+            if (_segmentAt == _segmentEnd)
+            {
+                if (_encoding == BASE64)
+                {
+                    char rest[2];
+                    decoded.append(rest, _base64.finish(rest));
+                }
+                if (_stripping)
+                {
+                    strip(out, true);
+                }
+                if (!nextSegment())
+                {
+                    break;
+                }
+                continue;
+            }
+            size_t wanted = std::max<size_t>(max - (out.size() - start), MIME_MIN_READ);
+            size_t left = _segmentEnd - _segmentAt;
+            const char *from = _message.data() + _segmentAt;
+            size_t old = decoded.size();
+            if (_encoding == IDENTITY)
+            {
+                size_t length = std::min(wanted, left);
+                decoded.append(from, length);
+                _segmentAt += length;
+            }
+            else if (_encoding == BASE64)
+            {
+                size_t length = std::min(wanted / 3 * 4 + 4, left);
+                decoded.resize(old + Base64Decoder::maxDecoded(length));
+                decoded.resize(old + _base64.decode(from, length, &decoded[old]));
+                _segmentAt += length;
+            }
+            else
+            {
+                size_t length = std::min(wanted, left);
+                // an escape isn't cut in two, unless the body ends there
+                if (length < left && from[length - 1] == '=')
+                {
+                    length--;
+                }
+                else if (length < left && from[length - 2] == '=')
+                {
+                    length -= 2;
+                }
+                decoded.resize(old + length);
+                decoded.resize(old + decodeQuotedPrintable(from, length, &decoded[old]));
+                _segmentAt += length;
+            }
+            if (_stripping)
+            {
+                strip(out, false);
+            }
+        }
+        return out.size() - start;
+    }
+
+    /**
+     * hands out the rest of the text of the message at once.
+     * @param out- the text is appended to it.
+     */
+    void readAll(std::string &out)
+    {
+        out.reserve(out.size() + _message.size());
+        while (read(out, _message.size()) != 0)
+        {
+        }
+    }
+
+    /**
+     * getter for how far into the message the walk got.
+     * @return- the number of message bytes handed out (decoded or not) so far.
+     */
+    size_t position() const
+    {
+        return _segmentAt;
+    }
+};
+
+#endif //SPAMDETECTOR_MIMEWALKER_HPP
@@ -0,0 +1,19 @@
+#include <cstdint>
+
+#ifndef SPAMDETECTOR_MULTIPLYFOLD_HPP
+#define SPAMDETECTOR_MULTIPLYFOLD_HPP
+
+/**
+ * the 64 bit multiply-fold the fingerprints, the word hashes and the shingle hashes are made of: the two halves
+ * of the 128 bit product, xored.
+ * @param a- a factor.
+ * @param b- the other factor.
+ * @return- the fold.
+ */
+inline uint64_t foldMultiply(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+#endif //SPAMDETECTOR_MULTIPLYFOLD_HPP
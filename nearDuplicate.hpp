@@ -0,0 +1,414 @@
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include "hashMap.hpp"
+#include "verdictCache.hpp"
+#include "wordSplitter.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NEARDUPLICATE_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_NEARDUPLICATE_HPP
+#define SPAMDETECTOR_NEARDUPLICATE_HPP
+
+#define MINHASH_FUNCTIONS 64
+#define LSH_BANDS 16
+#define LSH_ROWS (MINHASH_FUNCTIONS / LSH_BANDS)
+#define SHINGLE_WORDS 3
+#define SHINGLE_MIN 16
+#define SIGNED_BYTES_MAX (64UL << 10)
+#define NEAR_DUPLICATE_MIN_EQUAL 52
+#define NEAR_DUPLICATE_MAX_CANDIDATES 64
+#define NEAR_DUPLICATE_ENTRY_BYTES 2560
+#define NO_ENTRY UINT32_MAX
+
+/**
+ * the MinHash signature of a message: for each of MINHASH_FUNCTIONS hash functions, the smallest hash of any
+ * shingle (SHINGLE_WORDS words in a row) of the message. the share of functions two signatures agree on
+ * estimates the Jaccard similarity of the shingle sets of the two messages.
+ */
+struct MinHashSignature
+{
+    alignas(32) uint32_t value[MINHASH_FUNCTIONS];
+    bool valid;
+};
+
+/**
+ * folds the shingle hashes into the minimums of every function, one scalar function at a time. the functions are
+ * made out of the two halves of the 64 bit shingle hash by double hashing, h_k = h1 + k * h2 (mod 2^32) with
+ * an odd h2, which estimates the similarity as well as independent functions and costs an add per function.
+ * @param shingles- the shingle hashes.
+ * @param count- their number.
+ * @param minimum- the minimums, updated.
+ */
+inline void minHashScalar(const uint64_t *shingles, size_t count, uint32_t *minimum)
+{
+    for (size_t s = 0; s < count; s++)
+    {
+        auto h = (uint32_t) shingles[s];
+        auto step = (uint32_t) (shingles[s] >> 32) | 1;
+        for (size_t k = 0; k < MINHASH_FUNCTIONS; k++, h += step)
+        {
+            minimum[k] = std::min(minimum[k], h);
+        }
+    }
+}
+
+#ifdef NEARDUPLICATE_X86
+
+/**
+ * folds the shingle hashes into the minimums of every function with AVX2, 8 functions to a vector: the first
+ * vector of a shingle is h1 + (0..7) * h2, every next one is the one before plus 8 * h2, so a shingle goes
+ * through all MINHASH_FUNCTIONS functions with a multiply and MINHASH_FUNCTIONS / 8 add-min rounds.
+ * @param shingles- the shingle hashes.
+ * @param count- their number.
+ * @param minimum- the minimums, updated.
+ */
+__attribute__((target("avx2")))
+inline void minHashAvx2(const uint64_t *shingles, size_t count, uint32_t *minimum)
+{
+    const size_t vectors = MINHASH_FUNCTIONS / 8;
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i low[vectors];
+#pragma GCC unroll 8
+    for (size_t v = 0; v < vectors; v++)
+    {
+        low[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(minimum + 8 * v));
+    }
+    for (size_t s = 0; s < count; s++)
+    {
+        __m256i step = _mm256_set1_epi32((int) ((uint32_t) (shingles[s] >> 32) | 1));
+        __m256i h = _mm256_add_epi32(_mm256_set1_epi32((int) (uint32_t) shingles[s]), _mm256_mullo_epi32(step, lanes));
+        step = _mm256_slli_epi32(step, 3);
+#pragma GCC unroll 8
+        for (size_t v = 0; v < vectors; v++)
+        {
+            low[v] = _mm256_min_epu32(low[v], h);
+            h = _mm256_add_epi32(h, step);
+        }
+    }
+#pragma GCC unroll 8
+    for (size_t v = 0; v < vectors; v++)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(minimum + 8 * v), low[v]);
+    }
+}
+
+#endif
+
+/**
+ * computes the MinHash signature of a message, over its first SIGNED_BYTES_MAX bytes (a campaign is told apart
+ * by how it starts, and it keeps signing a huge message cheap). the words are hashed once, the hashes of every
+ * SHINGLE_WORDS of them in a row are combined into a 64 bit shingle hash, and the shingles go through the hash
+ * functions in one batch.
+ * @param message- the message.
+ * @param signature- set to the signature, valid only if the message has at least SHINGLE_MIN shingles (fewer
+ * say too little about it).
+ */
+inline void minHash(std::string_view message, MinHashSignature &signature)
+{
+#ifdef NEARDUPLICATE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    thread_local std::vector<uint64_t> shingles;
+    shingles.clear();
+    uint64_t words[SHINGLE_WORDS] = {};
+    size_t count = 0;
+    splitWords(message, SIGNED_BYTES_MAX, [&words, &count](uint64_t word)
+    {
+        for (size_t w = 1; w < SHINGLE_WORDS; w++)
+        {
+            words[w - 1] = words[w];
+        }
+        words[SHINGLE_WORDS - 1] = word;
+        if (++count >= SHINGLE_WORDS)
+        {
+            uint64_t shingle = words[0];
+            for (size_t w = 1; w < SHINGLE_WORDS; w++)
+            {
+                shingle = foldMultiply(shingle ^ words[w], 0x8EBC6AF09C88C6E3ULL);
+            }
+            shingles.push_back(shingle);
+        }
+    });
+    std::fill(signature.value, signature.value + MINHASH_FUNCTIONS, UINT32_MAX);
+    signature.valid = shingles.size() >= SHINGLE_MIN;
+#ifdef NEARDUPLICATE_X86
+    if (avx2)
+    {
+        minHashAvx2(shingles.data(), shingles.size(), signature.value);
+        return;
+    }
+#endif
+    minHashScalar(shingles.data(), shingles.size(), signature.value);
+}
+
+/**
+ * counts the functions two signatures agree on.
+ * @param first- a signature.
+ * @param second- the other signature.
+ * @return- the number of equal minimums.
+ */
+inline size_t agreement(const MinHashSignature &first, const MinHashSignature &second)
+{
+    size_t equal = 0;
+    for (size_t k = 0; k < MINHASH_FUNCTIONS; k++)
+    {
+        equal += first.value[k] == second.value[k];
+    }
+    return equal;
+}
+
+/**
+ * the keys a message is looked up by before it is scored: its fingerprint in the verdict cache and its signature
+ * in the near duplicate index (each set only if there is one).
+ */
+struct MessageKey
+{
+    Fingerprint fingerprint;
+    MinHashSignature signature;
+};
+
+/**
+ * an index of the signatures of recent spam, to classify a near copy of a message already found to be spam
+ * (a campaign variant that differs only by a name or a tracking token) without scanning it.
+ * a signature is cut into LSH_BANDS bands of LSH_ROWS minimums, and every band is hashed into a HashMap from
+ * band hash to the signatures that have that band. a message is a candidate near copy of a signature if they
+ * share a band (with 16 bands of 4 rows, a pair with a similarity of 0.8 shares one 99.9% of the time and a
+ * pair with 0.3 about 12% of the time), and a candidate is taken if the signatures agree on at least
+ * NEAR_DUPLICATE_MIN_EQUAL of their MINHASH_FUNCTIONS minimums (about 0.8).
+ * the signatures are kept in a ring, the oldest one making room for a new one once the memory budget is used up.
+ * like the verdict cache, every signature is tagged with the engine version whose verdict it carries, and a newer
+ * version empties the index.
+ */
+class NearDuplicateIndex
+{
+private:
+    /**
+     * a signature of a spam message, and its verdict.
+     */
+    struct Entry
+    {
+        MinHashSignature signature;
+        uint64_t bands[LSH_BANDS];
+        uint32_t next[LSH_BANDS];
+        uint32_t previous[LSH_BANDS];
+        long long score;
+        bool stopped;
+    };
+
+    std::mutex _lock;
+    HashMap<uint64_t, uint32_t> _bands;
+    std::vector<Entry> _entries;
+    size_t _capacity;
+    size_t _next;
+    uint64_t _version;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _lookups;
+
+    /**
+     * hashes the bands of a signature.
+     * @param signature- the signature.
+     * @param bands- set to the hashes of its bands, each with its band number in it.
+     */
+    static void bandHashes(const MinHashSignature &signature, uint64_t *bands)
+    {
+        for (size_t band = 0; band < LSH_BANDS; band++)
+        {
+            uint64_t h = 0x9E3779B97F4A7C15ULL * (band + 1);
+            for (size_t row = 0; row < LSH_ROWS; row += 2)
+            {
+                const uint32_t *rows = signature.value + band * LSH_ROWS + row;
+                h = foldMultiply(h ^ rows[0], 0xA0761D6478BD642FULL ^ rows[1]);
+            }
+            bands[band] = h;
+        }
+    }
+
+    /**
+     * takes a signature out of the lists of its bands.
+     * @param id- the index of its entry.
+     */
+    void unlink(uint32_t id)
+    {
+        Entry &entry = _entries[id];
+        for (size_t band = 0; band < LSH_BANDS; band++)
+        {
+            uint32_t next = entry.next[band];
+            uint32_t previous = entry.previous[band];
+            if (next != NO_ENTRY)
+            {
+                _entries[next].previous[band] = previous;
+            }
+            if (previous != NO_ENTRY)
+            {
+                _entries[previous].next[band] = next;
+            }
+            else if (next != NO_ENTRY)
+            {
+                *_bands.find(entry.bands[band]) = next;
+            }
+            else
+            {
+                _bands.erase(entry.bands[band]);
+            }
+        }
+    }
+
+    /**
+     * puts a signature at the head of the lists of its bands.
+     * @param id- the index of its entry.
+     */
+    void link(uint32_t id)
+    {
+        Entry &entry = _entries[id];
+        for (size_t band = 0; band < LSH_BANDS; band++)
+        {
+            entry.previous[band] = NO_ENTRY;
+            uint32_t *head = _bands.find(entry.bands[band]);
+            if (head == nullptr)
+            {
+                entry.next[band] = NO_ENTRY;
+                _bands.insert(entry.bands[band], id);
+                continue;
+            }
+            entry.next[band] = *head;
+            _entries[*head].previous[band] = id;
+            *head = id;
+        }
+    }
+
+    /**
+     * brings the index up to a version, emptying it if the version is newer than the signatures in it.
+     * @param version- the version of the engine at hand.
+     * @return- false if the version is older than the signatures in the index.
+     */
+    bool catchUp(uint64_t version)
+    {
+        if (version > _version)
+        {
+            _bands.clear();
+            _entries.clear();
+            _next = 0;
+            _version = version;
+        }
+        return version == _version;
+    }
+
+public:
+    /**
+     * constructor.
+     * @param budget- about how many bytes the index may take.
+     */
+    explicit NearDuplicateIndex(size_t budget) : _capacity(std::max<size_t>(budget / NEAR_DUPLICATE_ENTRY_BYTES, 1)),
+            _next(0), _version(0), _hits(0), _lookups(0)
+    {
+    }
+
+    /**
+     * looks for a near copy of a message among the spam signatures.
+     * @param signature- the signature of the message, which must be valid.
+     * @param version- the version of the engine the message is scored with.
+     * @param score- set to the score of the spam it is a near copy of, if there is one.
+     * @param stopped- set to wether that score stopped early.
+     * @return- true if there is one.
+     */
+    bool find(const MinHashSignature &signature, uint64_t version, long long &score, bool &stopped)
+    {
+        uint64_t bands[LSH_BANDS];
+        bandHashes(signature, bands);
+        _lookups.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(_lock);
+        if (!catchUp(version))
+        {
+            return false;
+        }
+        size_t candidates = 0;
+        for (size_t band = 0; band < LSH_BANDS && candidates < NEAR_DUPLICATE_MAX_CANDIDATES; band++)
+        {
+            const uint32_t *head = _bands.find(bands[band]);
+            for (uint32_t id = head != nullptr ? *head : NO_ENTRY;
+                 id != NO_ENTRY && candidates < NEAR_DUPLICATE_MAX_CANDIDATES; id = _entries[id].next[band])
+            {
+                const Entry &entry = _entries[id];
+                candidates++;
+                if (agreement(entry.signature, signature) >= NEAR_DUPLICATE_MIN_EQUAL)
+                {
+                    score = entry.score;
+                    stopped = entry.stopped;
+                    _hits.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * adds the signature of a spam message, replacing the oldest one if the index is full.
+     * @param signature- the signature of the message, which must be valid.
+     * @param version- the version of the engine the message was scored with.
+     * @param score- its score.
+     * @param stopped- true if the score stopped early.
+     */
+    void insert(const MinHashSignature &signature, uint64_t version, long long score, bool stopped)
+    {
+        uint64_t bands[LSH_BANDS];
+        bandHashes(signature, bands);
+        std::lock_guard<std::mutex> guard(_lock);
+        if (!catchUp(version))
+        {
+            return;
+        }
+        auto id = (uint32_t) _next;
+        if (_entries.size() < _capacity)
+        {
+            _entries.emplace_back();
+        }
+        else
+        {
+            unlink(id);
+        }
+        _next = (_next + 1) % _capacity;
+        Entry &entry = _entries[id];
+        entry.signature = signature;
+        std::copy(bands, bands + LSH_BANDS, entry.bands);
+        entry.score = score;
+        entry.stopped = stopped;
+        link(id);
+    }
+
+    /**
+     * getter for the number of messages classified as near copies.
+     * @return- the number of hits.
+     */
+    uint64_t hits() const
+    {
+        return _hits.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the number of messages looked up.
+     * @return- the number of lookups.
+     */
+    uint64_t lookups() const
+    {
+        return _lookups.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the most signatures the index holds.
+     * @return- the capacity.
+     */
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+};
+
+#endif //SPAMDETECTOR_NEARDUPLICATE_HPP
@@ -0,0 +1,401 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <initializer_list>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OBFUSCATIONFOLD_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_OBFUSCATIONFOLD_HPP
+#define SPAMDETECTOR_OBFUSCATIONFOLD_HPP
+
+#define OBF_KEEP 0
+#define OBF_STRIP 0xFF
+#define OBF_TABLE_SIZE 0x10000
+#define OBF_MATH_FIRST 0x1D400
+#define OBF_MATH_LETTERS_LAST 0x1D6A3
+#define OBF_MATH_DIGITS_FIRST 0x1D7CE
+#define OBF_MATH_DIGITS_LAST 0x1D7FF
+
+/**
+ * the table that undoes the usual ways of disguising a phrase from a plain text match, indexed by code point for
+ * every code point UTF-8 encodes in up to three bytes: leet substitutions ("v1agra"), homoglyphs from Latin-1,
+ * Greek, Cyrillic, Armenian, the fullwidth forms, roman numerals and circled letters ("ⅴiagra", "viаgra" with a
+ * Cyrillic a), and invisible code points (zero width spaces and joiners, bidi controls, soft hyphens, variation
+ * selectors and combining marks, "v​iagra").
+ * an entry is OBF_KEEP for a code point that stays as it is, OBF_STRIP for one that is dropped, and otherwise the
+ * lowercase ASCII byte it stands for, so folding never makes a text longer and can always be done in place.
+ * the table expects case folded text (see caseFold.hpp), only code points case folding leaves alone have entries
+ * for their uppercase forms. the ASCII substitutions are all in the '0' to '?' row and at '@' and '$', which is
+ * what the vector kernel relies on.
+ */
+class ObfuscationTable
+{
+private:
+    uint8_t _canonical[OBF_TABLE_SIZE];
+
+    /**
+     * maps a range of code points to consecutive letters.
+     * @param first- the first code point.
+     * @param last- the last code point.
+     * @param letter- the letter of the first one.
+     */
+    void letters(uint32_t first, uint32_t last, char letter)
+    {
+        for (uint32_t c = first; c <= last; c++)
+        {
+            _canonical[c] = (uint8_t) (letter + (c - first));
+        }
+    }
+
+    /**
+     * maps every code point of a list to the same letter.
+     * @param letter- the letter.
+     * @param codePoints- the code points.
+     */
+    void same(char letter, std::initializer_list<uint32_t> codePoints)
+    {
+        for (uint32_t c : codePoints)
+        {
+            _canonical[c] = (uint8_t) letter;
+        }
+    }
+
+    /**
+     * drops a range of code points.
+     * @param first- the first code point.
+     * @param last- the last code point.
+     */
+    void strip(uint32_t first, uint32_t last)
+    {
+        for (uint32_t c = first; c <= last; c++)
+        {
+            _canonical[c] = OBF_STRIP;
+        }
+    }
+
+public:
+    /**
+     * constructor, fills the table.
+     */
+    ObfuscationTable() : _canonical()
+    {
+        // leet
+        same('o', {'0'});
+        same('i', {'1'});
+        same('e', {'3'});
+        same('a', {'4', '@'});
+        same('s', {'5', '$'});
+        same('t', {'7'});
+
+        // invisible code points
+        strip(0x00AD, 0x00AD);
+        strip(0x0300, 0x036F);
+        strip(0x115F, 0x1160);
+        strip(0x180E, 0x180E);
+        strip(0x200B, 0x200F);
+        strip(0x202A, 0x202E);
+        strip(0x2060, 0x2064);
+        strip(0x2066, 0x2069);
+        strip(0x3164, 0x3164);
+        strip(0xFE00, 0xFE0F);
+        strip(0xFEFF, 0xFEFF);
+
+        // Latin-1 and Latin Extended-A
+        same('a', {0xE0, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5});
+        same('c', {0xE7});
+        same('e', {0xE8, 0xE9, 0xEA, 0xEB});
+        same('i', {0xEC, 0xED, 0xEE, 0xEF, 0x0131});
+        same('n', {0xF1});
+        same('o', {0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF8});
+        same('u', {0xF9, 0xFA, 0xFB, 0xFC});
+        same('y', {0xFD, 0xFF});
+        same('l', {0x0142});
+
+        // Greek
+        same('a', {0x03B1, 0x03AC});
+        same('e', {0x03B5, 0x03AD});
+        same('i', {0x03B9, 0x03AF});
+        same('k', {0x03BA});
+        same('v', {0x03BD});
+        same('o', {0x03BF, 0x03CC});
+        same('p', {0x03C1});
+        same('t', {0x03C4});
+        same('u', {0x03C5, 0x03CD});
+        same('x', {0x03C7});
+        same('c', {0x03F2});
+
+        // Cyrillic (the lowercase forms of the uppercase look alikes too, case folding got there first)
+        same('a', {0x0430});
+        same('b', {0x0432});
+        same('e', {0x0435, 0x0451});
+        same('k', {0x043A});
+        same('m', {0x043C});
+        same('h', {0x043D, 0x04BB});
+        same('o', {0x043E});
+        same('p', {0x0440});
+        same('c', {0x0441});
+        same('t', {0x0442});
+        same('y', {0x0443});
+        same('x', {0x0445});
+        same('s', {0x0455});
+        same('i', {0x0456, 0x0457});
+        same('j', {0x0458});
+        same('v', {0x0475});
+        same('d', {0x0501});
+        same('q', {0x051B});
+        same('w', {0x051D});
+
+        // Armenian
+        same('u', {0x057D});
+        same('o', {0x0585});
+
+        // letterlike symbols, roman numerals and circled letters
+        same('l', {0x2113, 0x216C, 0x217C});
+        same('i', {0x2160, 0x2170});
+        same('v', {0x2164, 0x2174});
+        same('x', {0x2169, 0x2179});
+        same('c', {0x216D, 0x217D});
+        same('d', {0x216E, 0x217E});
+        same('m', {0x216F, 0x217F});
+        letters(0x24B6, 0x24CF, 'a');
+        letters(0x24D0, 0x24E9, 'a');
+
+        // fullwidth ASCII, lowercased and with the leet substitutions of ASCII itself
+        for (uint32_t c = 0xFF01; c <= 0xFF5E; c++)
+        {
+            uint8_t ascii = (uint8_t) (c - 0xFF01 + '!');
+            if (ascii >= 'A' && ascii <= 'Z')
+            {
+                ascii += 'a' - 'A';
+            }
+            _canonical[c] = _canonical[ascii] != OBF_KEEP ? _canonical[ascii] : ascii;
+        }
+    }
+
+    /**
+     * the canonical form of a code point.
+     * @param c- the code point, up to U+10FFFF.
+     * @return- OBF_KEEP, OBF_STRIP or the ASCII byte the code point stands for.
+     */
+    uint8_t canonical(uint32_t c) const
+    {
+        if (c < OBF_TABLE_SIZE)
+        {
+            return _canonical[c];
+        }
+        // the mathematical alphanumeric symbols, bold, italic, script and so on, 52 letters per style
+        if (c >= OBF_MATH_FIRST && c <= OBF_MATH_LETTERS_LAST)
+        {
+            return (uint8_t) ('a' + (c - OBF_MATH_FIRST) % 52 % 26);
+        }
+        if (c >= OBF_MATH_DIGITS_FIRST && c <= OBF_MATH_DIGITS_LAST)
+        {
+            uint8_t digit = (uint8_t) ('0' + (c - OBF_MATH_DIGITS_FIRST) % 10);
+            return _canonical[digit] != OBF_KEEP ? _canonical[digit] : digit;
+        }
+        return OBF_KEEP;
+    }
+
+    /**
+     * the shared table.
+     * @return- the table, built on first use.
+     */
+    static const ObfuscationTable &get()
+    {
+        static const ObfuscationTable table;
+        return table;
+    }
+};
+
+/**
+ * the length of the UTF-8 sequence at some position, and its code point.
+ * @param src- the bytes.
+ * @param i- the position of the lead byte, not ASCII.
+ * @param length- the number of bytes.
+ * @param c- set to the code point.
+ * @return- the length of the sequence, 0 if it isn't a valid one.
+ */
+inline size_t decodeSequence(const unsigned char *src, size_t i, size_t length, uint32_t &c)
+{
+    unsigned char lead = src[i];
+    size_t size = lead >= 0xC2 && lead <= 0xDF ? 2 : lead >= 0xE0 && lead <= 0xEF ? 3 :
+                  lead >= 0xF0 && lead <= 0xF4 ? 4 : 0;
+    if (size == 0 || i + size > length)
+    {
+        return 0;
+    }
+    c = lead & (0x7F >> size);
+    for (size_t k = 1; k < size; k++)
+    {
+        if ((src[i + k] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+        c = (c << 6) | (src[i + k] & 0x3F);
+    }
+    return c < 0x800 && size > 2 ? 0 : size;
+}
+
+/**
+ * folds code points one at a time through the table up to some position (a code point that starts before it is
+ * folded whole).
+ * @param src- the bytes.
+ * @param dst- where the folded bytes go, at or before 'src'.
+ * @param i- the position to read from, moved to 'stop' (or just past it).
+ * @param o- the position to write to, moved along.
+ * @param stop- the position to stop at.
+ * @param length- the number of bytes.
+ * @param offsets- if not null, where the position in 'src' of every byte written goes.
+ */
+inline void foldObfuscationScalar(const unsigned char *src, unsigned char *dst, size_t &i, size_t &o, size_t stop,
+                                  size_t length, uint32_t *offsets)
+{
+    const ObfuscationTable &table = ObfuscationTable::get();
+    while (i < stop)
+    {
+        uint32_t c = src[i];
+        size_t size = c < 0x80 ? 1 : decodeSequence(src, i, length, c);
+        uint8_t canonical = size == 0 ? OBF_KEEP : table.canonical(c);
+        size = std::max<size_t>(size, 1);
+        if (canonical == OBF_KEEP)
+        {
+            for (size_t k = 0; k < size; k++, o++)
+            {
+                dst[o] = src[i + k];
+                if (offsets != nullptr)
+                {
+                    offsets[o] = (uint32_t) (i + k);
+                }
+            }
+        }
+        else if (canonical != OBF_STRIP)
+        {
+            dst[o] = canonical;
+            if (offsets != nullptr)
+            {
+                offsets[o] = (uint32_t) i;
+            }
+            o++;
+        }
+        i += size;
+    }
+}
+
+#ifdef OBFUSCATIONFOLD_X86
+
+/**
+ * folds blocks of 32 bytes with AVX2 while they are all ASCII: the '0' to '?' row goes through a byte shuffle
+ * with the table's row, '@' and '$' through compares.
+ * @param src- the bytes.
+ * @param dst- where the folded bytes go, at or before 'src'.
+ * @param i- the position to read from, moved to the first block that isn't all ASCII (or the tail).
+ * @param o- the position to write to, moved along.
+ * @param length- the number of bytes.
+ * @param offsets- if not null, where the position in 'src' of every byte written goes.
+ */
+__attribute__((target("avx2")))
+inline void foldObfuscationAvx2(const unsigned char *src, unsigned char *dst, size_t &i, size_t &o,
+                                size_t length, uint32_t *offsets)
+{
+    const ObfuscationTable &table = ObfuscationTable::get();
+    alignas(16) uint8_t digitRow[16];
+    for (int k = 0; k < 16; k++)
+    {
+        uint8_t canonical = table.canonical('0' + k);
+        digitRow[k] = canonical != OBF_KEEP ? canonical : (uint8_t) ('0' + k);
+    }
+    const __m256i row = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(digitRow)));
+    const __m256i rowHigh = _mm256_set1_epi8(0x30);
+    const __m256i highNibble = _mm256_set1_epi8((char) 0xF0);
+    const __m256i at = _mm256_set1_epi8('@');
+    const __m256i atCanonical = _mm256_set1_epi8((char) table.canonical('@'));
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i dollarCanonical = _mm256_set1_epi8((char) table.canonical('$'));
+    const __m256i step = _mm256_set1_epi32(8);
+    for (; i + 32 <= length; i += 32, o += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        if (_mm256_movemask_epi8(bytes) != 0)
+        {
+            return;
+        }
+        __m256i inRow = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, highNibble), rowHigh);
+        bytes = _mm256_blendv_epi8(bytes, _mm256_shuffle_epi8(row, bytes), inRow);
+        bytes = _mm256_blendv_epi8(bytes, atCanonical, _mm256_cmpeq_epi8(bytes, at));
+        bytes = _mm256_blendv_epi8(bytes, dollarCanonical, _mm256_cmpeq_epi8(bytes, dollar));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + o), bytes);
+        if (offsets != nullptr)
+        {
+            __m256i position = _mm256_add_epi32(_mm256_set1_epi32((int) i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6,
+                                                                                               7));
+            for (int k = 0; k < 4; k++)
+            {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(offsets + o + 8 * k), position);
+                position = _mm256_add_epi32(position, step);
+            }
+        }
+    }
+}
+
+#endif
+
+/**
+ * folds the obfuscations out of a case folded text: every code point is replaced with its canonical form from
+ * the table, ASCII 32 bytes at a time with AVX2. anything that isn't valid UTF-8 is copied as is.
+ * the folded text is never longer than the original one.
+ * @param src- the text.
+ * @param length- the length of the text.
+ * @param dst- where the folded text goes, up to 'length' bytes, may be 'src' itself to fold in place.
+ * @param offsets- if not null, where the position in 'src' of every byte of the folded text goes (up to
+ * 'length' of them), to map positions in the folded text back to the original one.
+ * @return- the length of the folded text.
+ */
+inline size_t foldObfuscation(const char *src, size_t length, char *dst, uint32_t *offsets = nullptr)
+{
+    const auto *in = reinterpret_cast<const unsigned char *>(src);
+    auto *out = reinterpret_cast<unsigned char *>(dst);
+#ifdef OBFUSCATIONFOLD_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    size_t i = 0;
+    size_t o = 0;
+    while (i < length)
+    {
+#ifdef OBFUSCATIONFOLD_X86
+        if (avx2)
+        {
+            foldObfuscationAvx2(in, out, i, o, length, offsets);
+        }
+#endif
+        // the block the vector loop stopped at (or the tail) goes one code point at a time up to the next block
+        foldObfuscationScalar(in, out, i, o, std::min(length, i + 32), length, offsets);
+    }
+    return o;
+}
+
+/**
+ * folds the obfuscations out of a case folded string in place.
+ * @param str- the string, shrunk to the folded text.
+ */
+inline void foldObfuscation(std::string &str)
+{
+    str.resize(foldObfuscation(str.data(), str.size(), &str[0]));
+}
+
+/**
+ * folds the obfuscations out of a case folded string in place, keeping where every byte came from.
+ * @param str- the string, shrunk to the folded text.
+ * @param offsets- a reusable buffer, set to the position in the original string of every byte of the folded one.
+ */
+inline void foldObfuscation(std::string &str, std::vector<uint32_t> &offsets)
+{
+    offsets.resize(str.size());
+    str.resize(foldObfuscation(str.data(), str.size(), &str[0], offsets.data()));
+    offsets.resize(str.size());
+}
+
+#endif //SPAMDETECTOR_OBFUSCATIONFOLD_HPP
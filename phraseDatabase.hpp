@@ -0,0 +1,146 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <climits>
+#include <stdexcept>
+#include "hashMap.hpp"
+#include "caseFold.hpp"
+#include "compiledDatabase.hpp"
+#include "csvScanner.hpp"
+#include "messageInput.hpp"
+
+#ifndef SPAMDETECTOR_PHRASEDATABASE_HPP
+#define SPAMDETECTOR_PHRASEDATABASE_HPP
+
+#define DB_DELIMITER ','
+
+/**
+ * parses a score the way std::stoi does in the "C" locale (leading white space, an optional sign and decimal
+ * digits), but without locales, exceptions or a copy of the text.
+ * @param text- the score.
+ * @param length- the length of the score.
+ * @param score- set to the score if it is valid.
+ * @param errorAt- set to the position of the first byte that makes the score invalid.
+ * @return- true if the whole text is a score that fits in an int, false otherwise.
+ */
+inline bool parseScore(const char *text, size_t length, int &score, size_t &errorAt)
+{
+    size_t i = 0;
+    while (i < length && (text[i] == ' ' || (text[i] >= '\t' && text[i] <= '\r')))
+    {
+        i++;
+    }
+    bool negative = i < length && text[i] == '-';
+    if (i < length && (text[i] == '-' || text[i] == '+'))
+    {
+        i++;
+    }
+    size_t digits = i;
+    long long value = 0;
+    for (; i < length && (unsigned int) (text[i] - '0') < 10; i++)
+    {
+        value = value * 10 + (text[i] - '0');
+        if (value > (long long) INT_MAX + 1)
+        {
+            errorAt = digits;
+            return false;
+        }
+    }
+    if (i == digits || i != length || (!negative && value > INT_MAX))
+    {
+        errorAt = i == length && i != digits ? digits : i;
+        return false;
+    }
+    score = (int) (negative ? -value : value);
+    return true;
+}
+
+/**
+ * the error for a malformed row of a phrase database.
+ * @param path- the path of the database.
+ * @param line- the 1 based line of the row.
+ * @param column- the 1 based column (byte) of the problem.
+ * @param what- what is wrong.
+ * @return- the error to throw.
+ */
+inline std::runtime_error databaseError(const std::string &path, size_t line, size_t column, const std::string &what)
+{
+    return std::runtime_error(path + ":" + std::to_string(line) + ":" + std::to_string(column) + ": " + what);
+}
+
+/**
+ * reads a phrase database, a text file with a "phrase,score" line for every phrase (the score is whatever
+ * follows the last comma, so phrases may have commas in them), into a map from case folded phrase to score.
+ * a phrase that shows up more than once keeps its last score.
+ * the file is mapped and case folded as a whole (folding never touches commas, digits or newlines), split into
+ * rows by the SIMD CsvScanner, and the phrases go into the map's bulk insert as views into the folded text, so a
+ * phrase is only copied once, into the map. a malformed row is reported with its line and column.
+ * a compiled database (see compileDatabase) is recognized by its magic and copied straight from its mapping,
+ * without any parsing.
+ * @param path- the path of the database file.
+ * @param phrases- the map to fill.
+ * @param rows- if not null, set to the number of phrase lines read (duplicates included).
+ * @return- the filled map.
+ */
+inline HashMap<std::string, int> &loadDatabase(const std::string &path, HashMap<std::string, int> &phrases,
+                                               size_t *rows = nullptr)
+{
+    if (CompiledDatabase::isCompiled(path))
+    {
+        CompiledDatabase compiled(path);
+        compiled.copyTo(phrases);
+        if (rows != nullptr)
+        {
+            *rows = compiled.size();
+        }
+        return phrases;
+    }
+    MessageInput input;
+    std::string_view raw = input.open(path);
+    std::string text;
+    foldCase(raw.data(), raw.size(), text);
+    input.close();
+
+    std::vector<std::string_view> keys;
+    std::vector<int> values;
+    CsvScanner(DB_DELIMITER).scan(text.data(), text.size(), [&path, &text, &keys, &values](size_t line,
+            size_t begin, size_t comma, size_t end)
+    {
+        if (end > begin && text[end - 1] == '\r')
+        {
+            end--;
+        }
+        if (end == begin)
+        {
+            return;
+        }
+        if (comma == CSV_NO_DELIMITER)
+        {
+            throw databaseError(path, line, end - begin + 1, "expected phrase,score but found no comma");
+        }
+        if (comma == begin)
+        {
+            throw databaseError(path, line, 1, "empty phrase");
+        }
+        if (comma + 1 == end)
+        {
+            throw databaseError(path, line, comma - begin + 2, "missing score");
+        }
+        int score = 0;
+        size_t errorAt = 0;
+        if (!parseScore(text.data() + comma + 1, end - comma - 1, score, errorAt))
+        {
+            throw databaseError(path, line, comma + 1 - begin + errorAt + 1, "bad score");
+        }
+        keys.emplace_back(text.data() + begin, comma - begin);
+        values.push_back(score);
+    });
+    phrases.insertAll(keys, values);
+    if (rows != nullptr)
+    {
+        *rows = keys.size();
+    }
+    return phrases;
+}
+
+#endif //SPAMDETECTOR_PHRASEDATABASE_HPP
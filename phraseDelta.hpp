@@ -0,0 +1,291 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include "hashMap.hpp"
+#include "caseFold.hpp"
+#include "csvScanner.hpp"
+#include "messageInput.hpp"
+#include "phraseDatabase.hpp"
+#include "phraseMatcher.hpp"
+
+#ifndef SPAMDETECTOR_PHRASEDELTA_HPP
+#define SPAMDETECTOR_PHRASEDELTA_HPP
+
+#define DELTA_ADD '+'
+#define DELTA_REMOVE '-'
+#define DELTA_REWEIGHT '='
+
+/**
+ * one change of a delta: a phrase to add with its score, to remove, or to give a new score.
+ */
+struct DeltaOp
+{
+    char kind;
+    std::string phrase;
+    int score;
+    size_t line;
+};
+
+/**
+ * reads a delta, a text file with a change on every line: "+phrase,score" adds a phrase, "-phrase" removes one
+ * and "=phrase,score" gives one a new score (like the database, the score is whatever follows the last comma).
+ * the phrases are case folded, and a malformed line is reported with its line and column.
+ * @param path- the path of the delta.
+ * @return- the changes, in order.
+ */
+inline std::vector<DeltaOp> loadDelta(const std::string &path)
+{
+    MessageInput input;
+    std::string_view raw = input.open(path);
+    std::string text;
+    foldCase(raw.data(), raw.size(), text);
+    std::vector<DeltaOp> ops;
+    CsvScanner(DB_DELIMITER).scan(text.data(), text.size(), [&path, &text, &ops](size_t line, size_t begin,
+            size_t comma, size_t end)
+    {
+        if (end > begin && text[end - 1] == '\r')
+        {
+            end--;
+        }
+        if (end == begin)
+        {
+            return;
+        }
+        char kind = text[begin];
+        if (kind != DELTA_ADD && kind != DELTA_REMOVE && kind != DELTA_REWEIGHT)
+        {
+            throw databaseError(path, line, 1, "a change starts with +, - or =");
+        }
+        begin++;
+        if (kind == DELTA_REMOVE)
+        {
+            if (end == begin)
+            {
+                throw databaseError(path, line, 2, "empty phrase");
+            }
+            ops.push_back({kind, text.substr(begin, end - begin), 0, line});
+            return;
+        }
+        if (comma == CSV_NO_DELIMITER || comma < begin)
+        {
+            throw databaseError(path, line, end - begin + 2, "expected phrase,score but found no comma");
+        }
+        if (comma == begin)
+        {
+            throw databaseError(path, line, 2, "empty phrase");
+        }
+        int score = 0;
+        size_t errorAt = 0;
+        if (comma + 1 == end || !parseScore(text.data() + comma + 1, end - comma - 1, score, errorAt))
+        {
+            throw databaseError(path, line, comma + 1 - begin + errorAt + 2, "bad score");
+        }
+        ops.push_back({kind, text.substr(begin, comma - begin), score, line});
+    });
+    return ops;
+}
+
+/**
+ * applies a delta to a phrase database in place. the whole delta is checked first (an added phrase must not be
+ * in the database yet, a removed or re-scored one must be, going through the delta in order), so it is applied
+ * either entirely or, if it throws, not at all.
+ * @param phrases- the phrase database.
+ * @param ops- the changes.
+ * @param path- the path of the delta, for errors.
+ */
+inline void applyDelta(HashMap<std::string, int> &phrases, const std::vector<DeltaOp> &ops,
+                       const std::string &path)
+{
+    HashMap<std::string, bool> present;
+    for (const DeltaOp &op : ops)
+    {
+        bool *seen = present.find(op.phrase);
+        bool there = seen != nullptr ? *seen : phrases.containsKey(op.phrase);
+        if (op.kind == DELTA_ADD && there)
+        {
+            throw databaseError(path, op.line, 2, "\"" + op.phrase + "\" is already in the database");
+        }
+        if (op.kind != DELTA_ADD && !there)
+        {
+            throw databaseError(path, op.line, 2, "\"" + op.phrase + "\" isn't in the database");
+        }
+        if (seen != nullptr)
+        {
+            *seen = op.kind != DELTA_REMOVE;
+        }
+        else
+        {
+            present.insert(op.phrase, op.kind != DELTA_REMOVE);
+        }
+    }
+    for (const DeltaOp &op : ops)
+    {
+        switch (op.kind)
+        {
+            case DELTA_ADD:
+                phrases.insert(op.phrase, op.score);
+                break;
+            case DELTA_REMOVE:
+                phrases.erase(op.phrase);
+                break;
+            default:
+                *phrases.find(op.phrase) = op.score;
+                break;
+        }
+    }
+}
+
+/**
+ * the changes made to a phrase database since its automaton was built, so they can be scored right away
+ * without rebuilding the automaton: new scores (0 for removed phrases) of phrases the automaton has, by their
+ * ids, and a small automaton of its own over the phrases the big one doesn't have.
+ * an overlay is immutable once built, changing it means building a new one out of a copy. it is meant to stay
+ * small, and to be merged into a rebuilt automaton every now and then.
+ */
+class PhraseOverlay
+{
+private:
+    HashMap<int32_t, int> _weights;
+    HashMap<std::string, int> _added;
+    std::shared_ptr<const PhraseMatcher> _addedMatcher;
+    int _minWeight;
+
+    /**
+     * sets the value of a key, adding the key if it isn't in the map yet.
+     * @param map- the map.
+     * @param key- the key.
+     * @param value- the value.
+     */
+    template<typename keyT>
+    static void put(HashMap<keyT, int> &map, const keyT &key, int value)
+    {
+        int *there = map.find(key);
+        if (there != nullptr)
+        {
+            *there = value;
+        }
+        else
+        {
+            map.insert(key, value);
+        }
+    }
+
+public:
+    /**
+     * constructor for an overlay with no changes.
+     */
+    PhraseOverlay() : _minWeight(0)
+    {
+    }
+
+    /**
+     * records a change.
+     * @param base- the automaton the overlay is on.
+     * @param phrase- the changed phrase.
+     * @param weight- its new score.
+     * @param removed- true if the phrase was removed.
+     */
+    void set(const PhraseMatcher &base, const std::string &phrase, int weight, bool removed)
+    {
+        int32_t id = base.find(phrase);
+        if (id != NO_PHRASE)
+        {
+            put(_weights, id, removed ? 0 : weight);
+        }
+        else if (removed)
+        {
+            _added.erase(phrase);
+        }
+        else
+        {
+            put(_added, phrase, weight);
+        }
+        if (!removed)
+        {
+            _minWeight = std::min(_minWeight, weight);
+        }
+    }
+
+    /**
+     * builds the automaton of the added phrases, once all the changes are recorded.
+     */
+    void build()
+    {
+        _addedMatcher = _added.size() == 0 ? nullptr : std::make_shared<const PhraseMatcher>(_added);
+    }
+
+    /**
+     * the score of a phrase of the automaton the overlay is on.
+     * @param id- the id of the phrase.
+     * @param weight- its score in the automaton.
+     * @return- its score now.
+     */
+    int weight(int32_t id, int weight) const
+    {
+        if (_weights.size() == 0)
+        {
+            return weight;
+        }
+        const int *changed = _weights.find(id);
+        return changed == nullptr ? weight : *changed;
+    }
+
+    /**
+     * the score a phrase has now, with the changes.
+     * @param base- the automaton the overlay is on.
+     * @param phrase- the phrase.
+     * @return- its score, 0 if it is in neither the automaton nor the overlay.
+     */
+    int current(const PhraseMatcher &base, const std::string &phrase) const
+    {
+        int32_t id = base.find(phrase);
+        if (id != NO_PHRASE)
+        {
+            return weight(id, base.weight(id));
+        }
+        const int *added = _added.find(phrase);
+        return added == nullptr ? 0 : *added;
+    }
+
+    /**
+     * getter for the automaton of the added phrases.
+     * @return- the automaton, or nullptr if no phrase was added.
+     */
+    const PhraseMatcher *added() const
+    {
+        return _addedMatcher.get();
+    }
+
+    /**
+     * getter for the lowest score the overlay gives any phrase.
+     * @return- the lowest score, or 0 if none is lower.
+     */
+    int minWeight() const
+    {
+        return _minWeight;
+    }
+
+    /**
+     * getter for the number of changes in the overlay.
+     * @return- the number of re-scored (or removed) phrases plus the number of added ones.
+     */
+    size_t size() const
+    {
+        return _weights.size() + _added.size();
+    }
+
+    /**
+     * states wether the overlay changes anything.
+     * @return- true if there are no changes.
+     */
+    bool empty() const
+    {
+        return size() == 0;
+    }
+};
+
+#endif //SPAMDETECTOR_PHRASEDELTA_HPP
@@ -0,0 +1,355 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "hashMap.hpp"
+#include "literalPrefilter.hpp"
+
+#ifndef SPAMDETECTOR_PHRASEMATCHER_HPP
+#define SPAMDETECTOR_PHRASEMATCHER_HPP
+
+#define ROOT_STATE 0
+#define NO_PHRASE (-1)
+#define BYTE_VALUES 256
+
+/**
+ * an Aho-Corasick automaton over all the phrases of a phrase database, finds every occurrence of every phrase
+ * in a single linear pass over a message, no matter how many phrases there are.
+ * the automaton is a dense transition table: every byte is first mapped to its byte class (each byte that
+ * appears in some phrase gets a class of its own, all the other bytes share class 0), and every state has a row
+ * of next states indexed by class, with the failure links already folded in, so scanning a byte is two lookups.
+ * every state is one distinct phrase prefix, so at most one phrase ends at it, the rest of the phrases that end
+ * there (its suffixes) are found through the dictionary link chain.
+ * while the automaton is in its root state no phrase is partially matched, so it skips straight to the next
+ * position the literal prefilter flags as a possible phrase start, clean text is mostly skipped at SIMD speed.
+ */
+class PhraseMatcher
+{
+private:
+    uint8_t _classOf[BYTE_VALUES];
+    size_t _classes;
+    std::vector<int32_t> _next;
+    std::vector<int32_t> _phraseAt;
+    std::vector<int32_t> _dictLink;
+    std::vector<std::string> _phrases;
+    std::vector<int> _weights;
+    int _minWeight;
+    size_t _maxLength;
+    LiteralPrefilter _prefilter;
+
+    /**
+     * adds a new state with no transitions (all of them lead nowhere, -1, until the automaton is completed).
+     * @return- the index of the new state.
+     */
+    int32_t newState()
+    {
+        _next.insert(_next.end(), _classes, -1);
+        _phraseAt.push_back(NO_PHRASE);
+        _dictLink.push_back(NO_PHRASE);
+        return (int32_t) _phraseAt.size() - 1;
+    }
+
+    /**
+     * builds the automaton out of '_phrases': the byte classes, the trie of the phrases and then, in a breadth
+     * first pass, the failure and dictionary links, turning the trie into a complete transition table.
+     */
+    void build()
+    {
+        bool used[BYTE_VALUES] = {};
+        for (const std::string &phrase : _phrases)
+        {
+            for (unsigned char c : phrase)
+            {
+                used[c] = true;
+            }
+        }
+        _classes = 1;
+        for (int c = 0; c < BYTE_VALUES; c++)
+        {
+            _classOf[c] = used[c] ? (uint8_t) _classes++ : 0;
+        }
+
+        newState();
+        for (size_t id = 0; id < _phrases.size(); id++)
+        {
+            int32_t state = ROOT_STATE;
+            for (unsigned char c : _phrases[id])
+            {
+                int32_t &next = _next[state * _classes + _classOf[c]];
+                if (next == -1)
+                {
+                    int32_t fresh = newState();
+                    // newState may have moved the table, so 'next' can't be used past this point
+                    _next[state * _classes + _classOf[c]] = fresh;
+                    state = fresh;
+                }
+                else
+                {
+                    state = next;
+                }
+            }
+            _phraseAt[state] = (int32_t) id;
+        }
+
+        std::vector<int32_t> fail(_phraseAt.size(), ROOT_STATE);
+        std::vector<int32_t> queue;
+        queue.reserve(_phraseAt.size());
+        for (size_t k = 0; k < _classes; k++)
+        {
+            int32_t &child = _next[ROOT_STATE * _classes + k];
+            if (child == -1)
+            {
+                child = ROOT_STATE;
+            }
+            else
+            {
+                queue.push_back(child);
+            }
+        }
+        for (size_t head = 0; head < queue.size(); head++)
+        {
+            int32_t state = queue[head];
+            int32_t link = fail[state];
+            _dictLink[state] = _phraseAt[link] != NO_PHRASE ? link : _dictLink[link];
+            for (size_t k = 0; k < _classes; k++)
+            {
+                int32_t &child = _next[state * _classes + k];
+                int32_t viaFailure = _next[link * _classes + k];
+                if (child == -1)
+                {
+                    child = viaFailure;
+                }
+                else
+                {
+                    fail[child] = viaFailure;
+                    queue.push_back(child);
+                }
+            }
+        }
+    }
+
+    /**
+     * the phrases of a phrase database that can be matched, that is all of its keys but the empty one.
+     * @param phrases- the phrase database.
+     * @return- the non empty phrases.
+     */
+    static std::vector<std::string> nonEmptyKeys(const HashMap<std::string, int> &phrases)
+    {
+        std::vector<std::string> keys;
+        for (auto i = phrases.begin(); i != phrases.end(); i++)
+        {
+            if (!(*i).first.empty())
+            {
+                keys.push_back((*i).first);
+            }
+        }
+        return keys;
+    }
+
+public:
+    /**
+     * constructor, builds the automaton out of all the phrases (keys) and weights (values) of a phrase database.
+     * empty phrases can't be matched and are left out.
+     * @param phrases- the phrase database.
+     */
+    explicit PhraseMatcher(const HashMap<std::string, int> &phrases) : _classOf(), _classes(1), _minWeight(0),
+            _maxLength(0), _prefilter(nonEmptyKeys(phrases))
+    {
+        for (auto i = phrases.begin(); i != phrases.end(); i++)
+        {
+            if (!(*i).first.empty())
+            {
+                _phrases.push_back((*i).first);
+                _weights.push_back((*i).second);
+                _minWeight = std::min(_minWeight, (*i).second);
+                _maxLength = std::max(_maxLength, (*i).first.size());
+            }
+        }
+        build();
+    }
+
+    /**
+     * runs the automaton over a block of a text, going on from the state a previous block left it in, and
+     * reports the phrase occurrences until told to stop.
+     * @param text- the block.
+     * @param length- the length of the block.
+     * @param state- the state to start from (ROOT_STATE for the first block), set to the state it stopped in.
+     * @param last- true if the text ends with this block. if it doesn't, the last bytes are run through the
+     * automaton even with nothing partially matched, since a phrase may start there and go on in the next block.
+     * @param onMatch- called as onMatch(phraseId, end) for every occurrence, 'end' being the index one past the
+     * last byte of the occurrence in the block, returns false to stop the scan.
+     * @return- the number of bytes scanned, less than 'length' only if the scan was stopped.
+     */
+    template<typename onMatchT>
+    size_t resume(const char *text, size_t length, int32_t &state, bool last, const onMatchT &onMatch) const
+    {
+        const int32_t *next = _next.data();
+        size_t candidate = 0;
+        size_t tail = length - std::min(length, _prefilter.width() - 1);
+        for (size_t i = 0; i < length; i++)
+        {
+            if (state == ROOT_STATE)
+            {
+                // nothing is partially matched, so no phrase can start before the next candidate
+                if (candidate < i)
+                {
+                    candidate = _prefilter.next(text, length, i);
+                }
+                if (candidate < length)
+                {
+                    i = candidate;
+                }
+                else if (last)
+                {
+                    break;
+                }
+                else
+                {
+                    i = std::max(i, tail);
+                }
+            }
+            state = next[state * _classes + _classOf[(unsigned char) text[i]]];
+            for (int32_t s = _phraseAt[state] != NO_PHRASE ? state : _dictLink[state];
+                 s != NO_PHRASE; s = _dictLink[s])
+            {
+                if (!onMatch(_phraseAt[s], i + 1))
+                {
+                    return i + 1;
+                }
+            }
+        }
+        return length;
+    }
+
+    /**
+     * runs the automaton over a text and reports every occurrence of every phrase, overlapping ones included.
+     * @param text- the text to scan.
+     * @param length- the length of the text.
+     * @param onMatch- called as onMatch(phraseId, end) for every occurrence, 'end' being the index one past the
+     * last byte of the occurrence.
+     */
+    template<typename onMatchT>
+    void scan(const char *text, size_t length, const onMatchT &onMatch) const
+    {
+        int32_t state = ROOT_STATE;
+        resume(text, length, state, true, [&onMatch](int32_t id, size_t end)
+        {
+            onMatch(id, end);
+            return true;
+        });
+    }
+
+    /**
+     * sums the weights of all the phrase occurrences in a text.
+     * @param text- the text to score.
+     * @param length- the length of the text.
+     * @return- the sum of the weights of every occurrence of every phrase.
+     */
+    long long score(const char *text, size_t length) const
+    {
+        long long total = 0;
+        scan(text, length, [this, &total](int32_t id, size_t)
+        {
+            total += _weights[id];
+        });
+        return total;
+    }
+
+    /**
+     * sums the weights of the phrase occurrences in a text that start before a given position. a long text split
+     * into chunks that overlap by maxLength() - 1 bytes is scored exactly by scoring every chunk this way, with
+     * 'startsBefore' at the start of the overlap: every occurrence is counted by the one chunk it starts in.
+     * @param text- the text to score.
+     * @param length- the length of the text.
+     * @param startsBefore- occurrences starting at or after this position are left out.
+     * @return- the sum of the weights of every occurrence of every phrase starting before 'startsBefore'.
+     */
+    long long score(const char *text, size_t length, size_t startsBefore) const
+    {
+        long long total = 0;
+        scan(text, length, [this, &total, startsBefore](int32_t id, size_t end)
+        {
+            if (end - _phrases[id].size() < startsBefore)
+            {
+                total += _weights[id];
+            }
+        });
+        return total;
+    }
+
+    /**
+     * finds the id of a phrase by walking it through the automaton: since every phrase is a path from the root,
+     * the walk ends in the state of the phrase itself if it is one.
+     * @param phrase- the phrase, case folded.
+     * @return- the id of the phrase, or NO_PHRASE if it isn't in the automaton.
+     */
+    int32_t find(std::string_view phrase) const
+    {
+        int32_t state = ROOT_STATE;
+        for (unsigned char c : phrase)
+        {
+            state = _next[state * _classes + _classOf[c]];
+        }
+        int32_t id = _phraseAt[state];
+        return !phrase.empty() && id != NO_PHRASE && _phrases[id] == phrase ? id : NO_PHRASE;
+    }
+
+    /**
+     * getter for the number of phrases in the automaton.
+     * @return- the number of phrases.
+     */
+    size_t phraseCount() const
+    {
+        return _phrases.size();
+    }
+
+    /**
+     * getter for the number of states in the automaton.
+     * @return- the number of states.
+     */
+    size_t stateCount() const
+    {
+        return _phraseAt.size();
+    }
+
+    /**
+     * getter for a phrase.
+     * @param id- the id of the phrase, as reported by scan.
+     * @return- the phrase.
+     */
+    const std::string &phrase(int32_t id) const
+    {
+        return _phrases[id];
+    }
+
+    /**
+     * getter for the weight of a phrase.
+     * @param id- the id of the phrase, as reported by scan.
+     * @return- the weight of the phrase.
+     */
+    int weight(int32_t id) const
+    {
+        return _weights[id];
+    }
+
+    /**
+     * getter for the lowest weight, a running score can only go down if it is negative.
+     * @return- the lowest weight of any phrase, or 0 if none is lower.
+     */
+    int minWeight() const
+    {
+        return _minWeight;
+    }
+
+    /**
+     * getter for the length of the longest phrase.
+     * @return- the length of the longest phrase.
+     */
+    size_t maxLength() const
+    {
+        return _maxLength;
+    }
+};
+
+#endif //SPAMDETECTOR_PHRASEMATCHER_HPP
@@ -0,0 +1,677 @@
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include "hashMap.hpp"
+#include "phraseDatabase.hpp"
+#include "phraseDelta.hpp"
+#include "phraseMatcher.hpp"
+#include "caseFold.hpp"
+#include "obfuscationFold.hpp"
+#include "mimeWalker.hpp"
+#include "htmlStripper.hpp"
+
+#ifndef SPAMDETECTOR_SCORINGENGINE_HPP
+#define SPAMDETECTOR_SCORINGENGINE_HPP
+
+#define SPAM "SPAM"
+#define NOT_SPAM "NOT_SPAM"
+#define EARLY_EXIT_BLOCK (16UL << 10)
+
+/**
+ * how the text that is matched is made out of the bytes of a message.
+ */
+struct TextOptions
+{
+    bool mime = false;
+    bool html = false;
+    bool deobfuscate = false;
+};
+
+/**
+ * where a scan of a text stopped, in the automaton and in the overlay's automaton.
+ */
+struct ScanState
+{
+    int32_t base = ROOT_STATE;
+    int32_t added = ROOT_STATE;
+};
+
+/**
+ * everything needed to score messages: the phrase database, the automaton built out of it, the overlay of the
+ * deltas applied since, and the threshold.
+ * an engine is immutable once built (but for its early exit counters, which are atomic), so any number of threads
+ * can score with the same one. a delta makes a new engine that shares the database and the automaton with the
+ * old one and has an overlay of its own.
+ */
+class ScoringEngine
+{
+private:
+    TextOptions _text;
+    std::shared_ptr<HashMap<std::string, int>> _phrases;
+    std::shared_ptr<const PhraseMatcher> _matcher;
+    PhraseOverlay _overlay;
+    long long _threshold;
+    uint64_t _version;
+    mutable std::atomic<uint64_t> _earlyExits;
+    mutable std::atomic<uint64_t> _bytesSaved;
+
+    /**
+     * loads a phrase database into a fresh map.
+     * @param databasePath- the path of the phrase database.
+     * @return- the map.
+     */
+    static std::shared_ptr<HashMap<std::string, int>> load(const std::string &databasePath)
+    {
+        auto phrases = std::make_shared<HashMap<std::string, int>>();
+        loadDatabase(databasePath, *phrases);
+        return phrases;
+    }
+
+    /**
+     * builds the automaton out of a phrase database. deobfuscating, the automaton has the canonical forms of the
+     * phrases instead, and phrases that end up the same are one phrase with the sum of their scores (an occurrence
+     * of either would have been an occurrence of both).
+     * @param phrases- the phrase database.
+     * @param deobfuscate- true to fold the obfuscations out of the phrases.
+     * @return- the automaton.
+     */
+    static std::shared_ptr<const PhraseMatcher> build(const HashMap<std::string, int> &phrases, bool deobfuscate)
+    {
+        if (!deobfuscate)
+        {
+            return std::make_shared<const PhraseMatcher>(phrases);
+        }
+        HashMap<std::string, int> canonical;
+        for (auto i = phrases.begin(); i != phrases.end(); i++)
+        {
+            std::string phrase = (*i).first;
+            foldObfuscation(phrase);
+            int *sum = canonical.find(phrase);
+            if (sum != nullptr)
+            {
+                *sum += (*i).second;
+            }
+            else
+            {
+                canonical.insert(phrase, (*i).second);
+            }
+        }
+        return std::make_shared<const PhraseMatcher>(canonical);
+    }
+
+    /**
+     * runs one automaton over a block for resume(), with the scores the overlay gives its phrases.
+     * @param matcher- the automaton.
+     * @param overlaid- true for the big automaton, whose scores the overlay may change.
+     */
+    template<typename onMatchT>
+    size_t resumeOne(const PhraseMatcher &matcher, bool overlaid, const char *text, size_t length, int32_t &state,
+                     bool last, const onMatchT &onMatch) const
+    {
+        return matcher.resume(text, length, state, last, [this, &matcher, overlaid, &onMatch](int32_t id,
+                size_t end)
+        {
+            int weight = overlaid ? _overlay.weight(id, matcher.weight(id)) : matcher.weight(id);
+            return onMatch(weight, end, matcher.phrase(id).size());
+        });
+    }
+
+public:
+    /**
+     * constructor, loads the phrase database and builds the automaton.
+     * @param databasePath- the path of the phrase database.
+     * @param threshold- the score from which a message is spam.
+     * @param version- the version of the database it was loaded from, counting the reloads (see LiveEngine).
+     * @param text- how messages are turned into text: with 'mime' the encoded MIME bodies are decoded (see
+     * mimeWalker.hpp), and with 'deobfuscate' leet, homoglyphs and invisible code points are folded out of the
+     * phrases and the messages (see obfuscationFold.hpp).
+     */
+    ScoringEngine(const std::string &databasePath, long long threshold, uint64_t version = 1,
+                  TextOptions text = TextOptions()) : _text(text), _phrases(load(databasePath)),
+            _matcher(build(*_phrases, text.deobfuscate)), _threshold(threshold), _version(version), _earlyExits(0),
+            _bytesSaved(0)
+    {
+    }
+
+    /**
+     * constructor for a later version of an engine: the same database and automaton with another overlay, or, with
+     * an empty overlay, a fresh automaton built out of the database (the overlay merged into it).
+     * @param previous- the engine.
+     * @param overlay- the overlay, empty to merge.
+     * @param version- the version.
+     */
+    ScoringEngine(const ScoringEngine &previous, PhraseOverlay overlay, uint64_t version) :
+            _text(previous._text), _phrases(previous._phrases),
+            _matcher(overlay.empty() && !previous._overlay.empty() ? build(*_phrases, _text.deobfuscate) :
+                     previous._matcher),
+            _overlay(std::move(overlay)), _threshold(previous._threshold), _version(version), _earlyExits(0),
+            _bytesSaved(0)
+    {
+    }
+
+    /**
+     * applies a delta: the database is changed in place (it is shared with this engine, but scoring never looks
+     * at it, only at the automaton, so messages in flight don't notice) and the changes are recorded in a copy of
+     * the overlay, a few map updates and a rebuild of the tiny automaton of the added phrases. the database is
+     * only changed once the new engine is built, so if anything throws the database and this engine are untouched.
+     * the overlay is keyed by the phrases as the automaton has them, so deobfuscating a change moves the summed
+     * score of its canonical form by the difference it makes.
+     * only one thread may apply deltas to the engines sharing a database, and it must be the newest engine.
+     * @param ops- the changes.
+     * @param path- the path of the delta, for errors.
+     * @param version- the version of the new engine.
+     * @return- the new engine, scoring with the changes.
+     */
+    std::shared_ptr<const ScoringEngine> withDelta(const std::vector<DeltaOp> &ops, const std::string &path,
+                                                   uint64_t version) const
+    {
+        // the scores the phrases had before their changes, every change seeing the ones before it in the delta
+        std::vector<int> before;
+        HashMap<std::string, int> staged;
+        for (const DeltaOp &op : ops)
+        {
+            int after = op.kind == DELTA_REMOVE ? 0 : op.score;
+            int *earlier = staged.find(op.phrase);
+            const int *stored = _phrases->find(op.phrase);
+            before.push_back(earlier != nullptr ? *earlier : stored != nullptr && op.kind != DELTA_ADD ? *stored : 0);
+            if (earlier != nullptr)
+            {
+                *earlier = after;
+            }
+            else
+            {
+                staged.insert(op.phrase, after);
+            }
+        }
+        PhraseOverlay overlay = _overlay;
+        for (size_t k = 0; k < ops.size(); k++)
+        {
+            std::string phrase = ops[k].phrase;
+            if (_text.deobfuscate)
+            {
+                foldObfuscation(phrase);
+            }
+            int weight = overlay.current(*_matcher, phrase) + (ops[k].kind == DELTA_REMOVE ? 0 : ops[k].score) -
+                         before[k];
+            // a score of 0 adds nothing wherever it occurs, so it may as well be gone
+            overlay.set(*_matcher, phrase, weight, weight == 0);
+        }
+        overlay.build();
+        auto engine = std::make_shared<const ScoringEngine>(*this, std::move(overlay), version);
+        // the database is changed last (checking the whole delta first), so a delta that throws leaves it as it was
+        applyDelta(*_phrases, ops, path);
+        return engine;
+    }
+
+    /**
+     * the start of the code point a position is in.
+     * @param message- the message.
+     * @param at- the position.
+     * @return- 'at', moved back over up to three UTF-8 continuation bytes.
+     */
+    static size_t codePointStart(std::string_view message, size_t at)
+    {
+        for (int k = 0; k < 3 && at > 0 && at < message.size() && ((unsigned char) message[at] & 0xC0) == 0x80; k++)
+        {
+            at--;
+        }
+        return at;
+    }
+
+    /**
+     * the length of the UTF-8 sequence a byte leads.
+     * @param lead- the byte.
+     * @return- the length of the sequence, 1 for anything that isn't a lead byte.
+     */
+    static size_t sequenceLength(unsigned char lead)
+    {
+        return lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    }
+
+    /**
+     * normalizes a text for matching: case folds it, and deobfuscating, folds the obfuscations out of it.
+     * @param text- the text.
+     * @param length- the length of the text.
+     * @param buffer- a reusable buffer, set to the normalized text.
+     */
+    void normalize(const char *text, size_t length, std::string &buffer) const
+    {
+        foldCase(text, length, buffer);
+        if (_text.deobfuscate)
+        {
+            foldObfuscation(buffer);
+        }
+    }
+
+    /**
+     * runs the automaton, and the overlay's if there is one, over a block of a normalized text, going on from
+     * where the previous block left them, and reports the phrase occurrences with their current scores until told
+     * to stop.
+     * @param text- the block.
+     * @param length- the length of the block.
+     * @param state- where the scan of the previous block stopped (default constructed for the first block).
+     * @param last- true if the text ends with this block.
+     * @param onMatch- called as onMatch(weight, end, length) for every occurrence, 'end' being the index one past
+     * its last byte and 'length' the length of the phrase, returns false to stop the scan.
+     * @return- the number of bytes scanned by the automaton that was stopped, 'length' if none was.
+     */
+    template<typename onMatchT>
+    size_t resume(const char *text, size_t length, ScanState &state, bool last, const onMatchT &onMatch) const
+    {
+        size_t scanned = resumeOne(*_matcher, true, text, length, state.base, last, onMatch);
+        if (scanned < length || _overlay.added() == nullptr)
+        {
+            return scanned;
+        }
+        return resumeOne(*_overlay.added(), false, text, length, state.added, last, onMatch);
+    }
+
+    /**
+     * normalizes the text of a message a block at a time, for a scan that goes on from block to block. blocks
+     * never split a UTF-8 sequence, so all of its bytes are folded together. with MIME decoding the blocks are
+     * decoded from the message as they are needed (so a message isn't decoded past where the scan stops), and a
+     * sequence cut by the end of a block is carried over to the next one. converting HTML (the text/html bodies
+     * with MIME decoding, the whole message without) goes on from block to block the same way.
+     * @param message- the message.
+     * @param buffer- a reusable buffer, set to every normalized block in turn.
+     * @param onBlock- called as onBlock(last, begin, end) for every block, [begin, end) being the bytes of the
+     * message it came from, returns false to stop.
+     */
+    template<typename onBlockT>
+    void walk(std::string_view message, std::string &buffer, const onBlockT &onBlock) const
+    {
+        if (!_text.mime)
+        {
+            thread_local std::string stripped;
+            HtmlStripper stripper;
+            for (size_t begin = 0; begin < message.size();)
+            {
+                size_t end = std::min(message.size(), begin + EARLY_EXIT_BLOCK);
+                while (end < message.size() && end > begin + 1 && ((unsigned char) message[end] & 0xC0) == 0x80)
+                {
+                    end--;
+                }
+                if (!_text.html)
+                {
+                    normalize(message.data() + begin, end - begin, buffer);
+                }
+                else
+                {
+                    stripped.resize(HtmlStripper::maxStripped(end - begin));
+                    size_t length = stripper.strip(message.data() + begin, end - begin, &stripped[0]);
+                    if (end == message.size())
+                    {
+                        length += stripper.finish(&stripped[length]);
+                    }
+                    normalize(stripped.data(), length, buffer);
+                }
+                if (!onBlock(end == message.size(), begin, end))
+                {
+                    return;
+                }
+                begin = end;
+            }
+            return;
+        }
+        thread_local std::string decoded;
+        decoded.clear();
+        MimeWalker walker(message, _text.html);
+        for (size_t begin = 0;;)
+        {
+            bool last = walker.read(decoded, EARLY_EXIT_BLOCK) == 0;
+            size_t cut = last ? decoded.size() : codePointStart(decoded, decoded.size() - 1);
+            if (cut < decoded.size() && sequenceLength((unsigned char) decoded[cut]) <= decoded.size() - cut)
+            {
+                cut = decoded.size();
+            }
+            normalize(decoded.data(), cut, buffer);
+            if (!onBlock(last, begin, walker.position()) || last)
+            {
+                return;
+            }
+            decoded.erase(0, cut);
+            begin = walker.position();
+        }
+    }
+
+    /**
+     * scores a message, the sum of the weights of every phrase occurrence in it, case insensitive.
+     * @param message- the message.
+     * @param buffer- a reusable buffer for the normalized message.
+     * @return- the score of the message.
+     */
+    long long score(std::string_view message, std::string &buffer) const
+    {
+        if (decodes())
+        {
+            long long total = 0;
+            ScanState state;
+            walk(message, buffer, [this, &buffer, &state, &total](bool last, size_t, size_t)
+            {
+                resume(buffer.data(), buffer.size(), state, last, [&total](int weight, size_t, size_t)
+                {
+                    total += weight;
+                    return true;
+                });
+                return true;
+            });
+            return total;
+        }
+        normalize(message.data(), message.size(), buffer);
+        if (_overlay.empty())
+        {
+            return _matcher->score(buffer.data(), buffer.size());
+        }
+        long long total = 0;
+        ScanState state;
+        resume(buffer.data(), buffer.size(), state, true, [&total](int weight, size_t, size_t)
+        {
+            total += weight;
+            return true;
+        });
+        return total;
+    }
+
+    /**
+     * scores one chunk of a message: the occurrences that start in [begin, end). the chunk is scanned up to
+     * maxLength() - 1 bytes past 'end' so the occurrences that start in it and run over are found too, which
+     * makes the scores of the chunks of a message add up to the score of the whole message.
+     * deobfuscating, the overlap is maxLength() - 1 bytes of the normalized text (an obfuscated phrase can be any
+     * number of bytes longer than its canonical form), and the occurrences are placed in the chunk through the
+     * offsets of the normalized text. the chunk is moved back to whole code points, the same way at both ends, so
+     * the chunks of a message still cover it exactly once. an engine that decodes messages can't score chunks
+     * (see canSplit).
+     * @param message- the message.
+     * @param begin- the start of the chunk.
+     * @param end- the end of the chunk, at most the length of the message.
+     * @param buffer- a reusable buffer for the normalized chunk.
+     * @return- the score of the chunk.
+     */
+    long long scoreChunk(std::string_view message, size_t begin, size_t end, std::string &buffer) const
+    {
+        size_t overlap = maxLength() == 0 ? 0 : maxLength() - 1;
+        size_t startsBefore = end - begin;
+        if (!_text.deobfuscate)
+        {
+            size_t stop = std::min(message.size(), end + overlap);
+            foldCase(message.data() + begin, stop - begin, buffer);
+        }
+        else
+        {
+            thread_local std::vector<uint32_t> offsets;
+            begin = codePointStart(message, begin);
+            end = codePointStart(message, end);
+            for (size_t reach = std::max<size_t>(overlap, 1);; reach *= 2)
+            {
+                size_t stop = std::min(message.size(), end + reach);
+                foldCase(message.data() + begin, stop - begin, buffer);
+                foldObfuscation(buffer, offsets);
+                startsBefore = std::lower_bound(offsets.begin(), offsets.end(), end - begin) - offsets.begin();
+                if (stop == message.size() || buffer.size() - startsBefore >= overlap)
+                {
+                    break;
+                }
+            }
+        }
+        if (_overlay.empty())
+        {
+            return _matcher->score(buffer.data(), buffer.size(), startsBefore);
+        }
+        long long total = 0;
+        ScanState state;
+        resume(buffer.data(), buffer.size(), state, true, [&total, startsBefore](int weight, size_t at,
+                size_t length)
+        {
+            if (at - length < startsBefore)
+            {
+                total += weight;
+            }
+            return true;
+        });
+        return total;
+    }
+
+    /**
+     * scores a message, the sum of the weights of every phrase occurrence in it, case insensitive.
+     * folds the message into a buffer that every thread keeps for itself.
+     * @param message- the message.
+     * @return- the score of the message.
+     */
+    long long score(std::string_view message) const
+    {
+        thread_local std::string buffer;
+        return score(message, buffer);
+    }
+
+    /**
+     * states wether scoring can stop as soon as a message reaches the threshold: only if no phrase has a negative
+     * weight, otherwise the rest of the message could still bring the score back down.
+     * @return- true if early exit is possible.
+     */
+    bool canExitEarly() const
+    {
+        return _matcher->minWeight() >= 0 && _overlay.minWeight() >= 0;
+    }
+
+    /**
+     * scores a message only as far as its verdict needs: the message is folded and matched a block at a time, and
+     * as soon as the score reaches the threshold the rest of it is left alone (the bytes left are counted in
+     * bytesSaved()). without early exit (see canExitEarly) this is the same as score().
+     * @param message- the message.
+     * @param buffer- a reusable buffer for the normalized blocks.
+     * @param stopped- if not null, set to true if the scoring stopped early, making the score a lower bound.
+     * @param margin- how far past the threshold the score has to get for the scoring to stop, for a score that
+     * something else (the Bayes classifier) may still take up to 'margin' off.
+     * @return- the full score, or the score so far (at least the threshold plus the margin) if the scoring stopped
+     * early.
+     */
+    long long scoreForVerdict(std::string_view message, std::string &buffer, bool *stopped = nullptr,
+                              long long margin = 0) const
+    {
+        if (stopped != nullptr)
+        {
+            *stopped = false;
+        }
+        if (!canExitEarly())
+        {
+            return score(message, buffer);
+        }
+        long long total = 0;
+        ScanState state;
+        // a decoded or deobfuscated block isn't byte for byte the message it came from, its rest isn't counted
+        bool exact = !decodes() && !_text.deobfuscate;
+        long long target = _threshold + margin;
+        walk(message, buffer, [this, &message, &buffer, &state, &total, stopped, exact, target](bool last,
+                size_t begin, size_t end)
+        {
+            size_t scanned = resume(buffer.data(), buffer.size(), state, last, [&total, target](int weight, size_t,
+                    size_t)
+            {
+                total += weight;
+                return total < target;
+            });
+            if (total < target)
+            {
+                return true;
+            }
+            countEarlyExit(message.size() - (exact ? begin + scanned : end));
+            if (stopped != nullptr)
+            {
+                *stopped = true;
+            }
+            return false;
+        });
+        return total;
+    }
+
+    /**
+     * scores a message only as far as its verdict needs, see the other overload.
+     * folds the message into a buffer that every thread keeps for itself.
+     * @param message- the message.
+     * @return- the full score, or the score so far (at least the threshold) if the scoring stopped early.
+     */
+    long long scoreForVerdict(std::string_view message) const
+    {
+        thread_local std::string buffer;
+        return scoreForVerdict(message, buffer);
+    }
+
+    /**
+     * counts an early exit taken outside of scoreForVerdict (by a pipeline that matches on its own).
+     * @param bytesSaved- the number of bytes the early exit skipped.
+     */
+    void countEarlyExit(uint64_t bytesSaved) const
+    {
+        _earlyExits.fetch_add(1, std::memory_order_relaxed);
+        _bytesSaved.fetch_add(bytesSaved, std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the number of messages whose scoring stopped early.
+     * @return- the number of early exits so far.
+     */
+    uint64_t earlyExits() const
+    {
+        return _earlyExits.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the number of message bytes early exits skipped.
+     * @return- the number of bytes that were neither folded nor matched thanks to early exit.
+     */
+    uint64_t bytesSaved() const
+    {
+        return _bytesSaved.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * states wether a score makes its message spam.
+     * @param score- the score of a message.
+     * @return- true if the score reaches the threshold and false otherwise.
+     */
+    bool isSpam(long long score) const
+    {
+        return score >= _threshold;
+    }
+
+    /**
+     * the verdict on a score.
+     * @param score- the score of a message.
+     * @return- SPAM or NOT_SPAM.
+     */
+    const char *verdict(long long score) const
+    {
+        return isSpam(score) ? SPAM : NOT_SPAM;
+    }
+
+    /**
+     * getter for the phrase database, which deltas change in place (see withDelta).
+     * @return- the map from phrase to score.
+     */
+    const HashMap<std::string, int> &phrases() const
+    {
+        return *_phrases;
+    }
+
+    /**
+     * getter for the automaton.
+     * @return- the phrase matcher, without the overlay's changes.
+     */
+    const PhraseMatcher &matcher() const
+    {
+        return *_matcher;
+    }
+
+    /**
+     * getter for how messages are turned into text.
+     * @return- the text options.
+     */
+    const TextOptions &text() const
+    {
+        return _text;
+    }
+
+    /**
+     * states wether a message can be scored as chunks (see scoreChunk), which takes random access to its text:
+     * not if messages are decoded, the text a byte turns into depends on everything before it.
+     * @return- true if it can.
+     */
+    bool canSplit() const
+    {
+        return !decodes();
+    }
+
+    /**
+     * states wether the text that is matched is decoded out of the messages (MIME, HTML) before it is normalized.
+     * @return- true if it is.
+     */
+    bool decodes() const
+    {
+        return _text.mime || _text.html;
+    }
+
+    /**
+     * decodes the whole text of a message, the way it is decoded a block at a time for scoring.
+     * @param message- the message.
+     * @param text- set to the text, to be normalized.
+     */
+    void decode(std::string_view message, std::string &text) const
+    {
+        text.clear();
+        if (_text.mime)
+        {
+            MimeWalker(message, _text.html).readAll(text);
+        }
+        else if (_text.html)
+        {
+            stripHtml(message.data(), message.size(), text);
+        }
+        else
+        {
+            text = message;
+        }
+    }
+
+    /**
+     * getter for the overlay.
+     * @return- the changes since the automaton was built.
+     */
+    const PhraseOverlay &overlay() const
+    {
+        return _overlay;
+    }
+
+    /**
+     * getter for the length of the longest phrase, in the automaton or the overlay.
+     * @return- the length of the longest phrase.
+     */
+    size_t maxLength() const
+    {
+        const PhraseMatcher *added = _overlay.added();
+        return std::max(_matcher->maxLength(), added == nullptr ? 0 : added->maxLength());
+    }
+
+    /**
+     * getter for the threshold.
+     * @return- the score from which a message is spam.
+     */
+    long long threshold() const
+    {
+        return _threshold;
+    }
+
+    /**
+     * getter for the version.
+     * @return- the version of the database the engine was loaded from.
+     */
+    uint64_t version() const
+    {
+        return _version;
+    }
+};
+
+#endif //SPAMDETECTOR_SCORINGENGINE_HPP
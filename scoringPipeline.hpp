@@ -0,0 +1,272 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <ostream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstdint>
+#include "scoringEngine.hpp"
+#include "liveEngine.hpp"
+#include "messageInput.hpp"
+#include "stagePipeline.hpp"
+#include "verdictCache.hpp"
+#include "nearDuplicate.hpp"
+#include "bayesClassifier.hpp"
+
+#ifndef SPAMDETECTOR_SCORINGPIPELINE_HPP
+#define SPAMDETECTOR_SCORINGPIPELINE_HPP
+
+#define PIPELINE_STAGES 5
+
+/**
+ * the names of the scoring stages, in order.
+ */
+static const char *const STAGE_NAMES[PIPELINE_STAGES] = {"read", "decode", "normalize", "match", "score"};
+
+/**
+ * how a scoring pipeline is laid out: the number of threads of every stage (in the order of STAGE_NAMES), the
+ * capacity of the rings between them, wether the threads are pinned to CPUs, where the per stage statistics
+ * are written once the pipeline is done (if anywhere), the verdict cache and near duplicate index the
+ * messages are looked up in (if any), and the Bayes classifier whose points are added to the phrase scores (if
+ * any).
+ */
+struct PipelineConfig
+{
+    unsigned int threads[PIPELINE_STAGES] = {1, 1, 1, 1, 1};
+    size_t ringCapacity = RING_DEF_CAPACITY;
+    bool pin = false;
+    bool earlyExit = false;
+    std::ostream *report = nullptr;
+    VerdictCache *cache = nullptr;
+    NearDuplicateIndex *nearDuplicates = nullptr;
+    BayesClassifier *bayes = nullptr;
+};
+
+/**
+ * a message going through the scoring pipeline, and everything the stages make out of it.
+ */
+struct ScoringItem
+{
+    uint64_t id = 0;
+    std::shared_ptr<const ScoringEngine> engine;
+    std::string path;
+    std::string payload;
+    std::string_view message;
+    std::string_view decoded;
+    std::string decodedText;
+    MessageInput input;
+    std::string text;
+    std::vector<int> hits;
+    long long score = 0;
+    MessageKey key = {};
+    bool cached = false;
+    bool nearDuplicate = false;
+    bool failed = false;
+    bool stopped = false;
+    std::string error;
+};
+
+/**
+ * scoring as a pipeline of explicit stages, each with its own threads, so the one that holds things up can be
+ * given more of them:
+ * read- takes a snapshot of the engine, which the message is scored against all the way through, and opens the
+ * message if it is a file (a message may also come as a payload, or as a view into memory). with a verdict
+ * cache, a message whose verdict is cached is done here, and so is a near copy of spam with a near duplicate
+ * index.
+ * decode- if the engine decodes messages, decodes the text of the message (base64 and quoted-printable bodies,
+ * HTML), otherwise the message passes through as is.
+ * normalize- case folds the message, and folds obfuscations out of it if the engine deobfuscates.
+ * match- runs the phrase automaton (and the overlay of the deltas) over it, collecting the weights of the phrases
+ * that occur (with early exit, only until they reach the threshold).
+ * score- sums their weights, caches the verdict (and adds the signature of spam to the near duplicate index),
+ * closes the message and lets go of the engine snapshot.
+ * an item that fails in some stage (or whose verdict was found in the read stage) skips the stages after it.
+ */
+class ScoringPipeline
+{
+private:
+    const LiveEngine &_engine;
+    StagePipeline<ScoringItem> _pipeline;
+    std::ostream *_report;
+    VerdictCache *_cache;
+    NearDuplicateIndex *_nearDuplicates;
+    BayesClassifier *_bayes;
+    std::atomic<uint64_t> _normalizedIn;
+    std::atomic<uint64_t> _normalizedOut;
+
+    /**
+     * wraps a stage so a failure is recorded on the item, and a failed (or cached) item is left alone.
+     * @param work- the stage.
+     * @return- the wrapped stage.
+     */
+    template<typename workT>
+    static StagePipeline<ScoringItem>::workT guarded(const workT &work)
+    {
+        return [work](ScoringItem &item)
+        {
+            if (item.failed || item.cached)
+            {
+                return;
+            }
+            try
+            {
+                work(item);
+            }
+            catch (const std::exception &ex)
+            {
+                item.failed = true;
+                item.error = ex.what();
+            }
+        };
+    }
+
+public:
+    /**
+     * constructor, sets up the stages.
+     * @param engine- the engine to score with.
+     * @param config- the layout of the pipeline.
+     */
+    ScoringPipeline(const LiveEngine &engine, const PipelineConfig &config) : _engine(engine),
+            _pipeline(config.ringCapacity, config.pin), _report(config.report), _cache(config.cache),
+            _nearDuplicates(config.nearDuplicates), _bayes(config.bayes), _normalizedIn(0), _normalizedOut(0)
+    {
+        _pipeline.addStage(STAGE_NAMES[0], config.threads[0], guarded([this](ScoringItem &item)
+        {
+            item.engine = _engine.get();
+            if (!item.path.empty())
+            {
+                item.message = item.input.open(item.path);
+            }
+            else if (!item.payload.empty())
+            {
+                item.message = item.payload;
+            }
+            if (_cache != nullptr)
+            {
+                item.key.fingerprint = fingerprint(item.message);
+                item.cached = _cache->find(item.key.fingerprint, item.engine->version(), item.score, item.stopped);
+            }
+            if (_nearDuplicates != nullptr && !item.cached)
+            {
+                minHash(item.message, item.key.signature);
+                item.nearDuplicate = item.key.signature.valid &&
+                                     _nearDuplicates->find(item.key.signature, item.engine->version(), item.score,
+                                                           item.stopped);
+                item.cached = item.nearDuplicate;
+            }
+        }));
+        _pipeline.addStage(STAGE_NAMES[1], config.threads[1], guarded([](ScoringItem &item)
+        {
+            if (!item.engine->decodes())
+            {
+                item.decoded = item.message;
+                return;
+            }
+            item.engine->decode(item.message, item.decodedText);
+            item.decoded = item.decodedText;
+        }));
+        _pipeline.addStage(STAGE_NAMES[2], config.threads[2], guarded([this](ScoringItem &item)
+        {
+            item.engine->normalize(item.decoded.data(), item.decoded.size(), item.text);
+            _normalizedIn.fetch_add(item.decoded.size(), std::memory_order_relaxed);
+            _normalizedOut.fetch_add(item.text.size(), std::memory_order_relaxed);
+        }));
+        bool wantEarlyExit = config.earlyExit;
+        long long margin = config.bayes != nullptr ? config.bayes->weight() : 0;
+        _pipeline.addStage(STAGE_NAMES[3], config.threads[3], guarded([wantEarlyExit, margin](ScoringItem &item)
+        {
+            const ScoringEngine &engine = *item.engine;
+            bool earlyExit = wantEarlyExit && engine.canExitEarly();
+            long long target = engine.threshold() + margin;
+            long long total = 0;
+            ScanState state;
+            size_t scanned = engine.resume(item.text.data(), item.text.size(), state, true,
+                                           [&item, &total, earlyExit, target](int weight, size_t, size_t)
+                                           {
+                                               item.hits.push_back(weight);
+                                               total += weight;
+                                               return !earlyExit || total < target;
+                                           });
+            if (earlyExit && total >= target)
+            {
+                item.stopped = true;
+                engine.countEarlyExit(item.text.size() - scanned);
+            }
+        }));
+        _pipeline.addStage(STAGE_NAMES[4], config.threads[4], [this](ScoringItem &item)
+        {
+            for (int weight : item.hits)
+            {
+                item.score += weight;
+            }
+            if (_cache != nullptr && !item.failed && !item.cached)
+            {
+                _cache->insert(item.key.fingerprint, item.engine->version(), item.score, item.stopped);
+            }
+            if (_nearDuplicates != nullptr && !item.failed && !item.cached && item.key.signature.valid &&
+                item.score >= item.engine->threshold())
+            {
+                _nearDuplicates->insert(item.key.signature, item.engine->version(), item.score, item.stopped);
+            }
+            if (_bayes != nullptr && !item.failed)
+            {
+                item.score += _bayes->points(item.message);
+            }
+            item.input.close();
+            item.engine.reset();
+        });
+    }
+
+    /**
+     * starts the stage threads.
+     * @param sink- called with every scored (or failed) item, from the threads of the score stage. the item is
+     * the sink's to delete.
+     */
+    void start(const StagePipeline<ScoringItem>::sinkT &sink)
+    {
+        _pipeline.start(sink);
+    }
+
+    /**
+     * feeds a message into the pipeline, waiting while it is backed up. only one thread may feed it.
+     * @param item- the message, allocated with new.
+     */
+    void submit(ScoringItem *item)
+    {
+        _pipeline.submit(item);
+    }
+
+    /**
+     * waits until every message fed in went through, stops the stage threads and writes the statistics.
+     */
+    void finish()
+    {
+        _pipeline.finish();
+        if (_report != nullptr)
+        {
+            report(*_report);
+        }
+    }
+
+    /**
+     * writes the per stage statistics, and how fast the normalize stage went through the messages (per thread, by
+     * the time its threads were busy, so it is the speed of normalization itself).
+     * @param out- the stream to write to.
+     */
+    void report(std::ostream &out) const
+    {
+        _pipeline.report(out);
+        uint64_t in = _normalizedIn.load(std::memory_order_relaxed);
+        double busy = std::max<double>((double) _pipeline.busyNanos(2), 1);
+        std::ios state(nullptr);
+        state.copyfmt(out);
+        out << std::fixed << std::setprecision(2) << STAGE_NAMES[2] << ": " << in << " bytes in, "
+            << _normalizedOut.load(std::memory_order_relaxed) << " bytes out, " << in / busy << " GB/s" << '\n';
+        out.copyfmt(state);
+    }
+};
+
+#endif //SPAMDETECTOR_SCORINGPIPELINE_HPP
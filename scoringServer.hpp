@@ -0,0 +1,866 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <arpa/inet.h>
+#include "hashMap.hpp"
+#include "scoringEngine.hpp"
+#include "liveEngine.hpp"
+#include "scoringPipeline.hpp"
+#include "verdictCache.hpp"
+#include "nearDuplicate.hpp"
+#include "bayesClassifier.hpp"
+
+#ifndef SPAMDETECTOR_SCORINGSERVER_HPP
+#define SPAMDETECTOR_SCORINGSERVER_HPP
+
+#define FRAME_HEADER 4
+#define SERVER_MAX_FRAME (64UL << 20)
+#define SERVER_BACKLOG 128
+#define SERVER_EVENTS 64
+#define SERVER_READ_SIZE (64UL << 10)
+#define LISTEN_ID 0
+#define WAKE_ID 1
+#define SIGNAL_ID 2
+#define FIRST_CONNECTION_ID 3
+#define TRAIN_SPAM_COMMAND "train spam"
+#define TRAIN_HAM_COMMAND "train ham"
+
+/**
+ * the wire format shared by the server and the client: every frame is its length as a 4 byte big endian number
+ * followed by that many bytes. a request frame holds a whole message, a response frame holds "score\tverdict"
+ * (the score followed by a '+' if the server stopped scoring early, once the verdict was clear).
+ * a request frame that starts with a '\0' is a command instead: "\0train spam\n" or "\0train ham\n" followed by
+ * a message trains the Bayes classifier on it, and is answered with "trained" (or "ERROR " and why not).
+ */
+namespace framing
+{
+    /**
+     * frames a payload.
+     * @param payload- the payload.
+     * @param out- the frame is appended to it.
+     */
+    inline void append(std::string_view payload, std::string &out)
+    {
+        uint32_t length = htonl((uint32_t) payload.size());
+        out.append(reinterpret_cast<const char *>(&length), FRAME_HEADER);
+        out.append(payload.data(), payload.size());
+    }
+
+    /**
+     * reads the length of the frame at the start of some bytes.
+     * @param bytes- the bytes, at least FRAME_HEADER of them.
+     * @return- the length of the payload.
+     */
+    inline size_t length(const char *bytes)
+    {
+        uint32_t length = 0;
+        std::memcpy(&length, bytes, FRAME_HEADER);
+        return ntohl(length);
+    }
+
+    /**
+     * the error for a failed system call.
+     * @param what- what was being done.
+     * @return- the error to throw.
+     */
+    inline std::runtime_error failure(const std::string &what)
+    {
+        return std::runtime_error("can't " + what + ": " + std::strerror(errno));
+    }
+
+    /**
+     * builds a Unix domain socket address.
+     * @param path- the path of the socket.
+     * @return- the address.
+     */
+    inline sockaddr_un address(const std::string &path)
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            throw std::runtime_error("socket path too long: " + path);
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        return addr;
+    }
+}
+
+/**
+ * a scoring daemon: the phrase database is loaded once (and reloaded in the background if the LiveEngine watches
+ * it), and messages sent over a Unix domain socket are scored for as long as it runs, so a mail server can ask for
+ * thousands of verdicts a second without starting a process for each one.
+ * one thread runs an epoll loop that accepts connections, reads request frames and writes response frames, all
+ * non blocking. complete requests are handed to a pool of workers over a queue, and the workers hand the
+ * responses back over another queue, waking the loop up with an eventfd. a connection has at most one request
+ * with the workers at a time, so its responses go out in the order of its requests, and any number of
+ * connections are scored in parallel. SIGINT and SIGTERM (through a signalfd) stop the server cleanly.
+ */
+class ScoringServer
+{
+private:
+    /**
+     * a client connection.
+     */
+    struct Connection
+    {
+        int fd;
+        std::string in;
+        size_t inPos = 0;
+        std::string out;
+        size_t outPos = 0;
+        bool busy = false;
+        bool closing = false;
+        uint32_t events = EPOLLIN | EPOLLRDHUP;
+    };
+
+    /**
+     * a request for the workers, or a response for the loop.
+     */
+    struct Job
+    {
+        uint64_t id;
+        std::string payload;
+    };
+
+    const LiveEngine &_engine;
+    std::string _path;
+    unsigned int _threads;
+    int _listen;
+    int _epoll;
+    int _wake;
+    int _signals;
+    uint64_t _nextId;
+    HashMap<uint64_t, std::shared_ptr<Connection>> _connections;
+    std::mutex _lock;
+    std::condition_variable _ready;
+    std::deque<Job> _requests;
+    std::deque<Job> _responses;
+    bool _stopping;
+    const PipelineConfig *_pipelineConfig;
+    bool _earlyExit;
+    VerdictCache *_cache;
+    NearDuplicateIndex *_nearDuplicates;
+    BayesClassifier *_bayes;
+    std::unique_ptr<ScoringPipeline> _pipeline;
+
+    /**
+     * registers a file descriptor with the epoll loop.
+     * @param fd- the file descriptor.
+     * @param id- the id its events come with.
+     * @param events- the events to wait for.
+     * @param op- EPOLL_CTL_ADD or EPOLL_CTL_MOD.
+     */
+    void watch(int fd, uint64_t id, uint32_t events, int op = EPOLL_CTL_ADD)
+    {
+        epoll_event event = {};
+        event.events = events;
+        event.data.u64 = id;
+        if (epoll_ctl(_epoll, op, fd, &event) != 0)
+        {
+            throw framing::failure("watch a file descriptor");
+        }
+    }
+
+    /**
+     * queues a response for the loop and wakes it up.
+     * @param id- the id of the connection.
+     * @param response- the response.
+     */
+    void post(uint64_t id, std::string response)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _responses.push_back({id, std::move(response)});
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(_wake, &one, sizeof(one));
+        (void) ignored;
+    }
+
+    /**
+     * queues the response with the score of a request.
+     * @param id- the id of the connection.
+     * @param score- the score of its request.
+     * @param stopped- true if the scoring stopped early, the score then goes out with a '+' after it.
+     * @param nearDuplicate- true if the request is a near copy of spam and wasn't scored, the score (the one of
+     * that spam) then goes out with a '~' after it.
+     */
+    void reply(uint64_t id, long long score, bool stopped, bool nearDuplicate = false)
+    {
+        post(id, std::to_string(score) + (stopped ? "+" : "") + (nearDuplicate ? "~" : "") + '\t' +
+                 _engine.verdict(score));
+    }
+
+    /**
+     * scores a request, looking it up in the cache and the near duplicate index first if there are, and queues
+     * the response.
+     * @param job- the request.
+     * @param buffer- the worker's fold buffer.
+     */
+    void scoreJob(const Job &job, std::string &buffer)
+    {
+        bool stopped = false;
+        bool nearDuplicate = false;
+        long long score = 0;
+        std::shared_ptr<const ScoringEngine> engine = _engine.get();
+        MessageKey key = {};
+        bool known = false;
+        if (_cache != nullptr)
+        {
+            key.fingerprint = fingerprint(job.payload);
+            known = _cache->find(key.fingerprint, engine->version(), score, stopped);
+        }
+        if (_nearDuplicates != nullptr && !known)
+        {
+            minHash(job.payload, key.signature);
+            known = nearDuplicate = key.signature.valid &&
+                                    _nearDuplicates->find(key.signature, engine->version(), score, stopped);
+        }
+        if (!known)
+        {
+            long long margin = _bayes != nullptr ? _bayes->weight() : 0;
+            score = _earlyExit ? engine->scoreForVerdict(job.payload, buffer, &stopped, margin) :
+                    engine->score(job.payload, buffer);
+            if (_cache != nullptr)
+            {
+                _cache->insert(key.fingerprint, engine->version(), score, stopped);
+            }
+            if (_nearDuplicates != nullptr && key.signature.valid && score >= engine->threshold())
+            {
+                _nearDuplicates->insert(key.signature, engine->version(), score, stopped);
+            }
+        }
+        if (_bayes != nullptr)
+        {
+            score += _bayes->points(job.payload);
+        }
+        reply(job.id, score, stopped, nearDuplicate);
+    }
+
+    /**
+     * the worker loop: takes requests off the queue, scores them and queues the responses for the loop. a request
+     * that fails (say a huge one that runs out of memory) is answered with an error, the worker goes on.
+     */
+    void work()
+    {
+        std::string buffer;
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> guard(_lock);
+                _ready.wait(guard, [this]
+                { return _stopping || !_requests.empty(); });
+                if (_requests.empty())
+                {
+                    return;
+                }
+                job = std::move(_requests.front());
+                _requests.pop_front();
+            }
+            try
+            {
+                scoreJob(job, buffer);
+            }
+            catch (const std::exception &ex)
+            {
+                post(job.id, std::string("ERROR ") + ex.what());
+            }
+        }
+    }
+
+    /**
+     * accepts every pending connection.
+     */
+    void accept()
+    {
+        while (true)
+        {
+            int fd = accept4(_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return;
+            }
+            auto connection = std::make_shared<Connection>();
+            connection->fd = fd;
+            uint64_t id = _nextId++;
+            _connections[id] = connection;
+            watch(fd, id, EPOLLIN | EPOLLRDHUP);
+        }
+    }
+
+    /**
+     * closes a connection and forgets it. a response still with the workers is dropped when it comes back.
+     * @param id- the id of the connection.
+     */
+    void drop(uint64_t id)
+    {
+        std::shared_ptr<Connection> &connection = _connections[id];
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, connection->fd, nullptr);
+        ::close(connection->fd);
+        _connections.erase(id);
+    }
+
+    /**
+     * runs a command frame (see framing), on the loop thread: training is quick, a message is split only as far
+     * as BAYES_BYTES_MAX.
+     * @param payload- the frame, '\0' and all.
+     * @return- the response.
+     */
+    std::string command(std::string_view payload)
+    {
+        size_t newline = payload.find('\n');
+        std::string_view name = payload.substr(1, newline == std::string_view::npos ? newline : newline - 1);
+        if (name != TRAIN_SPAM_COMMAND && name != TRAIN_HAM_COMMAND)
+        {
+            return "ERROR unknown command";
+        }
+        if (_bayes == nullptr)
+        {
+            return "ERROR no Bayes classifier";
+        }
+        std::string_view message = newline == std::string_view::npos ? std::string_view() :
+                                   payload.substr(newline + 1);
+        _bayes->train(message, name == TRAIN_SPAM_COMMAND);
+        return "trained";
+    }
+
+    /**
+     * hands the next complete request of a connection to the workers, if it has one and none is with them yet.
+     * the commands before it are run straight away.
+     * @param id- the id of the connection.
+     * @param connection- the connection.
+     * @return- false if the connection sent a frame that is too big and has to be dropped.
+     */
+    bool dispatch(uint64_t id, Connection &connection)
+    {
+        std::string payload;
+        while (true)
+        {
+            size_t available = connection.in.size() - connection.inPos;
+            if (connection.busy || available < FRAME_HEADER)
+            {
+                return true;
+            }
+            size_t length = framing::length(connection.in.data() + connection.inPos);
+            if (length > SERVER_MAX_FRAME)
+            {
+                return false;
+            }
+            if (available < FRAME_HEADER + length)
+            {
+                return true;
+            }
+            payload = connection.in.substr(connection.inPos + FRAME_HEADER, length);
+            connection.inPos += FRAME_HEADER + length;
+            if (connection.inPos * 2 >= connection.in.size())
+            {
+                // keeps a client that pipelines requests from growing the buffer forever
+                connection.in.erase(0, connection.inPos);
+                connection.inPos = 0;
+            }
+            if (payload.empty() || payload[0] != '\0')
+            {
+                break;
+            }
+            framing::append(command(payload), connection.out);
+        }
+        connection.busy = true;
+        if (_pipeline)
+        {
+            auto *item = new ScoringItem();
+            item->id = id;
+            item->payload = std::move(payload);
+            _pipeline->submit(item);
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _requests.push_back({id, std::move(payload)});
+        }
+        _ready.notify_one();
+        return true;
+    }
+
+    /**
+     * states wether a connection has as much buffered as the biggest frame can take, while its request is with
+     * the workers. it isn't read from until that request is done, so a client that pipelines requests can't
+     * grow the buffer without bound.
+     * @param connection- the connection.
+     * @return- true if it has.
+     */
+    static bool full(const Connection &connection)
+    {
+        return connection.in.size() - connection.inPos >= FRAME_HEADER + SERVER_MAX_FRAME;
+    }
+
+    /**
+     * writes as much of a connection's pending responses as the socket takes, and waits for it to be writable
+     * if some are left.
+     * @param id- the id of the connection.
+     * @param connection- the connection.
+     * @return- false if the connection is done with (failed, or closed by the client with nothing left to do).
+     */
+    bool flush(uint64_t id, Connection &connection)
+    {
+        while (connection.outPos < connection.out.size())
+        {
+            ssize_t sent = send(connection.fd, connection.out.data() + connection.outPos,
+                                connection.out.size() - connection.outPos, MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    return false;
+                }
+                break;
+            }
+            connection.outPos += sent;
+        }
+        if (connection.outPos == connection.out.size())
+        {
+            connection.out.clear();
+            connection.outPos = 0;
+        }
+        bool pending = !connection.out.empty();
+        // once the client is done sending, only writability matters (the hangup would be reported over and over),
+        // and a full buffer isn't read into until the request at its head is done
+        bool reading = !connection.closing && !full(connection);
+        uint32_t events = (reading ? (uint32_t) (EPOLLIN | EPOLLRDHUP) : 0u) |
+                          (pending ? (uint32_t) EPOLLOUT : 0u);
+        if (events != connection.events)
+        {
+            connection.events = events;
+            watch(connection.fd, id, events, EPOLL_CTL_MOD);
+        }
+        return !(connection.closing && !connection.busy && !pending);
+    }
+
+    /**
+     * reads what a connection has sent so far (up to a full buffer) and dispatches its next request.
+     * @param id- the id of the connection.
+     * @param connection- the connection.
+     * @return- false if the connection is done with.
+     */
+    bool receive(uint64_t id, Connection &connection)
+    {
+        while (!connection.closing && !full(connection))
+        {
+            size_t old = connection.in.size();
+            connection.in.resize(old + SERVER_READ_SIZE);
+            ssize_t got = recv(connection.fd, &connection.in[old], SERVER_READ_SIZE, 0);
+            connection.in.resize(old + std::max<ssize_t>(got, 0));
+            if (got > 0)
+            {
+                continue;
+            }
+            if (got == 0)
+            {
+                connection.closing = true;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return false;
+            }
+            break;
+        }
+        return dispatch(id, connection) && flush(id, connection);
+    }
+
+    /**
+     * writes out the responses the workers are done with, and dispatches the next request of their connections.
+     */
+    void respond()
+    {
+        uint64_t count = 0;
+        ssize_t ignored = read(_wake, &count, sizeof(count));
+        (void) ignored;
+        std::deque<Job> done;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            done.swap(_responses);
+        }
+        for (Job &job : done)
+        {
+            if (!_connections.containsKey(job.id))
+            {
+                continue;
+            }
+            std::shared_ptr<Connection> connection = _connections[job.id];
+            connection->busy = false;
+            framing::append(job.payload, connection->out);
+            if (!dispatch(job.id, *connection) || !flush(job.id, *connection))
+            {
+                drop(job.id);
+            }
+        }
+    }
+
+    /**
+     * the event loop, runs until a stop signal comes.
+     */
+    void loop()
+    {
+        epoll_event events[SERVER_EVENTS];
+        while (true)
+        {
+            int count = epoll_wait(_epoll, events, SERVER_EVENTS, -1);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw framing::failure("wait for events");
+            }
+            for (int e = 0; e < count; e++)
+            {
+                uint64_t id = events[e].data.u64;
+                if (id == SIGNAL_ID)
+                {
+                    return;
+                }
+                if (id == LISTEN_ID)
+                {
+                    accept();
+                }
+                else if (id == WAKE_ID)
+                {
+                    respond();
+                }
+                else if (_connections.containsKey(id))
+                {
+                    std::shared_ptr<Connection> connection = _connections[id];
+                    // a full hangup means the client can't read responses anymore either
+                    bool alive = (events[e].events & (EPOLLERR | EPOLLHUP)) == 0;
+                    if (alive && (events[e].events & EPOLLOUT))
+                    {
+                        alive = flush(id, *connection);
+                    }
+                    if (alive && (events[e].events & (EPOLLIN | EPOLLRDHUP)))
+                    {
+                        alive = receive(id, *connection);
+                    }
+                    if (!alive)
+                    {
+                        drop(id);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * stops the workers, dropping the requests none of them has started on.
+     * @param workers- the worker threads, joined.
+     */
+    void stop(std::vector<std::thread> &workers)
+    {
+        if (_pipeline)
+        {
+            _pipeline->finish();
+            _pipeline.reset();
+        }
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stopping = true;
+            _requests.clear();
+        }
+        _ready.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    /**
+     * closes every file descriptor the server opened and removes the socket file.
+     */
+    void release()
+    {
+        for (auto i = _connections.begin(); i != _connections.end(); i++)
+        {
+            ::close((*i).second->fd);
+        }
+        _connections.clear();
+        for (int fd : {_listen, _epoll, _wake, _signals})
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+        if (_listen >= 0)
+        {
+            unlink(_path.c_str());
+        }
+        _listen = _epoll = _wake = _signals = -1;
+    }
+
+public:
+    /**
+     * constructor, binds the socket (replacing a stale socket file) and sets up the event loop.
+     * @param engine- the engine to score with, shared by all the workers.
+     * @param path- the path of the Unix domain socket.
+     * @param threads- the number of worker threads.
+     * @param pipeline- if not null, requests are scored on a pipeline of stages laid out like this instead of by
+     * the workers (and 'threads' is ignored).
+     * @param earlyExit- true to score requests only as far as their verdicts need (for the workers, a pipeline
+     * has a setting of its own).
+     * @param cache- if not null, the verdicts of requests are looked up in it before they are scored, and cached
+     * after (for the workers, a pipeline has a setting of its own).
+     * @param nearDuplicates- if not null, a request that is a near copy of spam in it is answered without scoring
+     * it, and the signatures of the spam requests scored are added to it (for the workers, a pipeline has a
+     * setting of its own).
+     * @param bayes- if not null, the points it gives a request are added to its phrase score (for the workers, a
+     * pipeline has a setting of its own), and the train commands train it.
+     */
+    ScoringServer(const LiveEngine &engine, const std::string &path, unsigned int threads,
+                  const PipelineConfig *pipeline = nullptr, bool earlyExit = false, VerdictCache *cache = nullptr,
+                  NearDuplicateIndex *nearDuplicates = nullptr, BayesClassifier *bayes = nullptr) :
+            _engine(engine), _path(path), _threads(std::max(threads, 1U)), _listen(-1), _epoll(-1), _wake(-1),
+            _signals(-1), _nextId(FIRST_CONNECTION_ID), _connections(), _stopping(false), _pipelineConfig(pipeline),
+            _earlyExit(earlyExit), _cache(cache), _nearDuplicates(nearDuplicates), _bayes(bayes)
+    {
+        try
+        {
+            sockaddr_un addr = framing::address(path);
+            _listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (_listen < 0)
+            {
+                throw framing::failure("create a socket");
+            }
+            unlink(path.c_str());
+            if (bind(_listen, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+                listen(_listen, SERVER_BACKLOG) != 0)
+            {
+                throw framing::failure("listen on " + path);
+            }
+            _epoll = epoll_create1(EPOLL_CLOEXEC);
+            _wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            sigset_t stop;
+            sigemptyset(&stop);
+            sigaddset(&stop, SIGINT);
+            sigaddset(&stop, SIGTERM);
+            // blocked before any worker starts, so the workers inherit the mask and only the signalfd sees them
+            pthread_sigmask(SIG_BLOCK, &stop, nullptr);
+            _signals = signalfd(-1, &stop, SFD_NONBLOCK | SFD_CLOEXEC);
+            if (_epoll < 0 || _wake < 0 || _signals < 0)
+            {
+                throw framing::failure("set up the event loop");
+            }
+            watch(_listen, LISTEN_ID, EPOLLIN);
+            watch(_wake, WAKE_ID, EPOLLIN);
+            watch(_signals, SIGNAL_ID, EPOLLIN);
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+    }
+
+    ScoringServer(const ScoringServer &) = delete;
+
+    ScoringServer &operator=(const ScoringServer &) = delete;
+
+    /**
+     * destructor, closes everything.
+     */
+    ~ScoringServer()
+    {
+        release();
+    }
+
+    /**
+     * serves requests until SIGINT or SIGTERM, then lets the workers finish and closes everything.
+     */
+    void run()
+    {
+        std::vector<std::thread> workers;
+        if (_pipelineConfig != nullptr)
+        {
+            _pipeline.reset(new ScoringPipeline(_engine, *_pipelineConfig));
+            _pipeline->start([this](ScoringItem *item)
+                             {
+                                 if (item->failed)
+                                 {
+                                     post(item->id, std::string("ERROR ") + item->error);
+                                 }
+                                 else
+                                 {
+                                     reply(item->id, item->score, item->stopped, item->nearDuplicate);
+                                 }
+                                 delete item;
+                             });
+        }
+        for (unsigned int t = 0; t < _threads && !_pipeline; t++)
+        {
+            workers.emplace_back([this]
+                                 { work(); });
+        }
+        try
+        {
+            loop();
+        }
+        catch (...)
+        {
+            stop(workers);
+            throw;
+        }
+        stop(workers);
+        release();
+    }
+};
+
+/**
+ * a blocking client for the scoring daemon, for testing it and for scripts.
+ */
+class ScoringClient
+{
+private:
+    int _fd;
+
+    /**
+     * sends or receives exactly 'length' bytes.
+     * @param data- the bytes.
+     * @param length- the number of bytes.
+     * @param sending- true to send and false to receive.
+     */
+    void transfer(char *data, size_t length, bool sending) const
+    {
+        while (length > 0)
+        {
+            ssize_t done = sending ? send(_fd, data, length, MSG_NOSIGNAL) : recv(_fd, data, length, 0);
+            if (done < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (done <= 0)
+            {
+                if (done == 0)
+                {
+                    errno = ECONNRESET;
+                }
+                throw framing::failure(sending ? "send a request" : "receive a response");
+            }
+            data += done;
+            length -= done;
+        }
+    }
+
+    /**
+     * sends a request frame and waits for its response.
+     * @param frame- the frame.
+     * @return- the payload of the response.
+     */
+    std::string request(std::string &frame) const
+    {
+        transfer(&frame[0], frame.size(), true);
+        char header[FRAME_HEADER];
+        transfer(header, FRAME_HEADER, false);
+        std::string response(framing::length(header), '\0');
+        transfer(&response[0], response.size(), false);
+        return response;
+    }
+
+public:
+    /**
+     * constructor, connects to the daemon.
+     * @param path- the path of its socket.
+     */
+    explicit ScoringClient(const std::string &path) : _fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+    {
+        if (_fd < 0)
+        {
+            throw framing::failure("create a socket");
+        }
+        sockaddr_un addr = framing::address(path);
+        if (connect(_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            int saved = errno;
+            ::close(_fd);
+            errno = saved;
+            throw framing::failure("connect to " + path);
+        }
+    }
+
+    ScoringClient(const ScoringClient &) = delete;
+
+    ScoringClient &operator=(const ScoringClient &) = delete;
+
+    /**
+     * destructor, disconnects.
+     */
+    ~ScoringClient()
+    {
+        ::close(_fd);
+    }
+
+    /**
+     * has a message scored.
+     * @param message- the message.
+     * @return- the response, "score\tverdict".
+     */
+    std::string score(std::string_view message) const
+    {
+        if (message.size() > SERVER_MAX_FRAME)
+        {
+            throw std::runtime_error("message too big for the daemon");
+        }
+        std::string frame;
+        framing::append(message, frame);
+        return request(frame);
+    }
+
+    /**
+     * has the Bayes classifier of the daemon trained on a message.
+     * @param message- the message.
+     * @param spam- true if it is spam, false if it is ham.
+     * @return- the response, "trained" or "ERROR " and why not.
+     */
+    std::string train(std::string_view message, bool spam) const
+    {
+        std::string payload = std::string(1, '\0') + (spam ? TRAIN_SPAM_COMMAND : TRAIN_HAM_COMMAND) + '\n';
+        if (payload.size() + message.size() > SERVER_MAX_FRAME)
+        {
+            throw std::runtime_error("message too big for the daemon");
+        }
+        payload.append(message.data(), message.size());
+        std::string frame;
+        framing::append(payload, frame);
+        return request(frame);
+    }
+};
+
+#endif //SPAMDETECTOR_SCORINGSERVER_HPP
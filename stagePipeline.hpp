@@ -0,0 +1,573 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+
+#ifndef SPAMDETECTOR_STAGEPIPELINE_HPP
+#define SPAMDETECTOR_STAGEPIPELINE_HPP
+
+#define RING_DEF_CAPACITY 256
+#define RING_SAMPLE_EVERY 64
+#define STAGE_SPINS 64
+#define STAGE_IDLE_MICROS 20
+
+/**
+ * a bounded lock free ring for exactly one producer thread and one consumer thread.
+ * the head and the tail live on cache lines of their own, and each side keeps a copy of the other side's index
+ * that it only refreshes when the ring looks full (or empty), so a push or a pop usually touches no shared line.
+ * @tparam T- the type of the elements.
+ */
+template<typename T>
+class SpscRing
+{
+private:
+    std::vector<T> _slots;
+    size_t _mask;
+    alignas(64) std::atomic<size_t> _head;
+    size_t _cachedTail;
+    alignas(64) std::atomic<size_t> _tail;
+    size_t _cachedHead;
+    std::atomic<size_t> _highWater;
+
+public:
+    /**
+     * constructor.
+     * @param capacity- the capacity, rounded up to a power of 2.
+     */
+    explicit SpscRing(size_t capacity) : _head(0), _cachedTail(0), _tail(0), _cachedHead(0), _highWater(0)
+    {
+        size_t rounded = 1;
+        while (rounded < capacity)
+        {
+            rounded *= 2;
+        }
+        _slots.resize(rounded);
+        _mask = rounded - 1;
+    }
+
+    /**
+     * adds an element, only the producer may call this.
+     * @param value- the element.
+     * @return- false if the ring is full.
+     */
+    bool push(const T &value)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _cachedHead > _mask)
+        {
+            _cachedHead = _head.load(std::memory_order_acquire);
+            if (tail - _cachedHead > _mask)
+            {
+                return false;
+            }
+        }
+        _slots[tail & _mask] = value;
+        _tail.store(tail + 1, std::memory_order_release);
+        if ((tail & (RING_SAMPLE_EVERY - 1)) == 0)
+        {
+            // sampled, reading the consumer's index on every push would bounce its cache line
+            size_t used = tail + 1 - _head.load(std::memory_order_relaxed);
+            if (used > _highWater.load(std::memory_order_relaxed))
+            {
+                _highWater.store(used, std::memory_order_relaxed);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * takes the oldest element, only the consumer may call this.
+     * @param value- set to the element.
+     * @return- false if the ring is empty.
+     */
+    bool pop(T &value)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _cachedTail)
+        {
+            _cachedTail = _tail.load(std::memory_order_acquire);
+            if (head == _cachedTail)
+            {
+                return false;
+            }
+        }
+        value = _slots[head & _mask];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * the number of elements in the ring, only a snapshot when the ring is in use.
+     * @return- the number of elements.
+     */
+    size_t size() const
+    {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+    }
+
+    /**
+     * the most elements the producer has seen in the ring, sampled every RING_SAMPLE_EVERY pushes.
+     * @return- the high water mark.
+     */
+    size_t highWater() const
+    {
+        return _highWater.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the capacity.
+     * @return- the capacity.
+     */
+    size_t capacity() const
+    {
+        return _mask + 1;
+    }
+};
+
+/**
+ * a pipeline of stages, each run by its own number of threads, connected by SPSC rings: every thread of a stage
+ * has a ring to every thread of the next stage (and the feeding thread has one to every thread of the first
+ * stage), so every ring keeps a single producer and a single consumer however the stages are scaled.
+ * a thread deals what it produces round robin over its outgoing rings, and when all of them are full it waits,
+ * which backs pressure up all the way to the feeding thread. a thread with nothing to do spins for a while and
+ * then parks on a condition variable of its own, woken by the next item pushed to it or by the end of its input,
+ * so an idle pipeline (a daemon between requests) costs no CPU.
+ * every thread counts the items it processed, the time it spent processing and the time it spent stalled on full
+ * rings, and every ring remembers its high water mark, so report() shows which stage is the bottleneck.
+ * @tparam itemT- the type of the items, the pipeline passes pointers to them along.
+ */
+template<typename itemT>
+class StagePipeline
+{
+public:
+    typedef std::function<void(itemT &)> workT;
+    typedef std::function<void(itemT *)> sinkT;
+
+private:
+    typedef SpscRing<itemT *> ringT;
+
+    /**
+     * one thread of a stage.
+     */
+    struct Worker
+    {
+        std::vector<ringT *> inputs;
+        std::vector<ringT *> outputs;
+        std::vector<Worker *> consumers;
+        size_t nextOutput = 0;
+        std::mutex idleLock;
+        std::condition_variable idle;
+        std::atomic<bool> parked{false};
+        std::atomic<uint64_t> items{0};
+        std::atomic<uint64_t> busyNanos{0};
+        std::atomic<uint64_t> stallNanos{0};
+    };
+
+    /**
+     * a stage and its threads.
+     */
+    struct Stage
+    {
+        std::string name;
+        unsigned int threads;
+        workT work;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::atomic<unsigned int> finished{0};
+    };
+
+    size_t _ringCapacity;
+    bool _pin;
+    std::vector<std::unique_ptr<Stage>> _stages;
+    std::vector<std::unique_ptr<ringT>> _rings;
+    Worker _source;
+    std::atomic<bool> _closed;
+    sinkT _sink;
+    std::vector<std::thread> _threads;
+    std::chrono::steady_clock::time_point _started;
+    std::chrono::steady_clock::time_point _stopped;
+
+    /**
+     * nanoseconds since some point, for timing.
+     * @return- the time.
+     */
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * waits a little, spinning at first and then sleeping.
+     * @param rounds- how many times in a row the caller has waited.
+     */
+    static void pause(unsigned int rounds)
+    {
+        if (rounds < STAGE_SPINS)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(STAGE_IDLE_MICROS));
+        }
+    }
+
+    /**
+     * wakes a thread if it is parked.
+     * @param worker- the thread.
+     */
+    static void wake(Worker &worker)
+    {
+        // pairs with the fence in park(): either the thread sees what was published before this, or this sees it
+        // parked
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (worker.parked.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(worker.idleLock);
+            worker.idle.notify_one();
+        }
+    }
+
+    /**
+     * states wether every producer feeding a stage is done, which also means it has published all its items.
+     * @param index- the index of the stage.
+     * @return- true if they are.
+     */
+    bool upstreamDone(size_t index) const
+    {
+        return index == 0 ? _closed.load(std::memory_order_acquire) :
+               _stages[index - 1]->finished.load(std::memory_order_acquire) == _stages[index - 1]->threads;
+    }
+
+    /**
+     * blocks an idle thread until an item is pushed to it or its producers are done.
+     * @param index- the index of the stage.
+     * @param worker- the thread.
+     */
+    void park(size_t index, Worker &worker)
+    {
+        std::unique_lock<std::mutex> lock(worker.idleLock);
+        worker.parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // checked again once parked is visible, so an item or an end that came in just before isn't slept through
+        bool pending = upstreamDone(index);
+        for (const ringT *ring : worker.inputs)
+        {
+            pending = pending || ring->size() != 0;
+        }
+        if (!pending)
+        {
+            worker.idle.wait(lock);
+        }
+        worker.parked.store(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * hands an item to the next stage (or the sink), waiting while every outgoing ring is full.
+     * @param worker- the producing thread.
+     * @param item- the item.
+     */
+    void forward(Worker &worker, itemT *item)
+    {
+        if (worker.outputs.empty())
+        {
+            _sink(item);
+            return;
+        }
+        size_t count = worker.outputs.size();
+        uint64_t stalledSince = 0;
+        for (unsigned int rounds = 0; ; rounds++)
+        {
+            for (size_t k = 0; k < count; k++)
+            {
+                size_t ring = (worker.nextOutput + k) % count;
+                if (worker.outputs[ring]->push(item))
+                {
+                    wake(*worker.consumers[ring]);
+                    worker.nextOutput = ring + 1;
+                    if (stalledSince != 0)
+                    {
+                        worker.stallNanos.fetch_add(now() - stalledSince, std::memory_order_relaxed);
+                    }
+                    return;
+                }
+            }
+            if (stalledSince == 0)
+            {
+                stalledSince = now();
+            }
+            pause(rounds);
+        }
+    }
+
+    /**
+     * takes the next item off any of a thread's incoming rings.
+     * @param worker- the consuming thread.
+     * @return- the item, or nullptr if all of them are empty.
+     */
+    static itemT *take(Worker &worker)
+    {
+        itemT *item = nullptr;
+        for (ringT *ring : worker.inputs)
+        {
+            if (ring->pop(item))
+            {
+                return item;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * the loop of one thread of a stage. it ends once every producer feeding it is done and its rings are empty.
+     * @param index- the index of the stage.
+     * @param worker- the thread.
+     * @param cpu- the CPU to pin the thread to, if pinning.
+     */
+    void runWorker(size_t index, Worker &worker, unsigned int cpu)
+    {
+        if (_pin)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+        Stage &stage = *_stages[index];
+        for (unsigned int rounds = 0; ; rounds++)
+        {
+            // read before looking at the rings, so a producer that is done has published all its items
+            bool done = upstreamDone(index);
+            itemT *item = take(worker);
+            if (item == nullptr)
+            {
+                if (done)
+                {
+                    break;
+                }
+                if (rounds < STAGE_SPINS)
+                {
+                    pause(rounds);
+                }
+                else
+                {
+                    park(index, worker);
+                }
+                continue;
+            }
+            rounds = 0;
+            uint64_t started = now();
+            stage.work(*item);
+            worker.busyNanos.fetch_add(now() - started, std::memory_order_relaxed);
+            worker.items.fetch_add(1, std::memory_order_relaxed);
+            forward(worker, item);
+        }
+        if (stage.finished.fetch_add(1, std::memory_order_acq_rel) + 1 == stage.threads && index + 1 < _stages.size())
+        {
+            for (auto &next : _stages[index + 1]->workers)
+            {
+                wake(*next);
+            }
+        }
+    }
+
+    /**
+     * connects every producer to every consumer with a ring of its own.
+     * @param producers- the producing threads.
+     * @param consumers- the consuming threads.
+     */
+    void connect(const std::vector<Worker *> &producers, const std::vector<Worker *> &consumers)
+    {
+        for (Worker *producer : producers)
+        {
+            for (Worker *consumer : consumers)
+            {
+                _rings.emplace_back(new ringT(_ringCapacity));
+                producer->outputs.push_back(_rings.back().get());
+                producer->consumers.push_back(consumer);
+                consumer->inputs.push_back(_rings.back().get());
+            }
+        }
+    }
+
+public:
+    /**
+     * constructor for a pipeline with no stages yet.
+     * @param ringCapacity- the capacity of every ring.
+     * @param pin- true to pin every thread to a CPU of its own (as far as there are enough of them).
+     */
+    explicit StagePipeline(size_t ringCapacity = RING_DEF_CAPACITY, bool pin = false) :
+            _ringCapacity(ringCapacity), _pin(pin), _closed(false)
+    {
+    }
+
+    StagePipeline(const StagePipeline &) = delete;
+
+    StagePipeline &operator=(const StagePipeline &) = delete;
+
+    /**
+     * destructor, stops the pipeline if it is still running.
+     */
+    ~StagePipeline()
+    {
+        finish();
+    }
+
+    /**
+     * adds a stage after the existing ones, before start().
+     * @param name- the name of the stage, for the report.
+     * @param threads- the number of threads running it.
+     * @param work- what the stage does to an item, called from its threads.
+     */
+    void addStage(const std::string &name, unsigned int threads, const workT &work)
+    {
+        _stages.emplace_back(new Stage());
+        Stage &stage = *_stages.back();
+        stage.name = name;
+        stage.threads = std::max(threads, 1U);
+        stage.work = work;
+        for (unsigned int t = 0; t < stage.threads; t++)
+        {
+            stage.workers.emplace_back(new Worker());
+        }
+    }
+
+    /**
+     * wires up the rings and starts the threads of every stage.
+     * @param sink- called with every item that made it through the last stage, from that stage's threads.
+     */
+    void start(const sinkT &sink)
+    {
+        _sink = sink;
+        std::vector<Worker *> producers = {&_source};
+        for (auto &stage : _stages)
+        {
+            std::vector<Worker *> consumers;
+            for (auto &worker : stage->workers)
+            {
+                consumers.push_back(worker.get());
+            }
+            connect(producers, consumers);
+            producers = consumers;
+        }
+        unsigned int cpus = std::max(std::thread::hardware_concurrency(), 1U);
+        unsigned int cpu = 0;
+        _started = std::chrono::steady_clock::now();
+        for (size_t s = 0; s < _stages.size(); s++)
+        {
+            for (auto &worker : _stages[s]->workers)
+            {
+                Worker *running = worker.get();
+                unsigned int pinned = cpu++ % cpus;
+                _threads.emplace_back([this, s, running, pinned]
+                                      { runWorker(s, *running, pinned); });
+            }
+        }
+    }
+
+    /**
+     * feeds an item into the first stage, waiting while the first stage is backed up. only one thread may feed
+     * a pipeline.
+     * @param item- the item.
+     */
+    void submit(itemT *item)
+    {
+        if (_stages.empty())
+        {
+            _sink(item);
+            return;
+        }
+        forward(_source, item);
+    }
+
+    /**
+     * tells the pipeline no more items are coming, and waits until every item went through.
+     */
+    void finish()
+    {
+        if (_threads.empty())
+        {
+            return;
+        }
+        _closed.store(true, std::memory_order_release);
+        for (auto &worker : _stages.front()->workers)
+        {
+            wake(*worker);
+        }
+        for (auto &thread : _threads)
+        {
+            thread.join();
+        }
+        _threads.clear();
+        _stopped = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * getter for the time the threads of a stage spent processing items.
+     * @param stage- the index of the stage, in the order they were added.
+     * @return- the nanoseconds of all its threads together.
+     */
+    uint64_t busyNanos(size_t stage) const
+    {
+        uint64_t busy = 0;
+        for (const auto &worker : _stages[stage]->workers)
+        {
+            busy += worker->busyNanos.load(std::memory_order_relaxed);
+        }
+        return busy;
+    }
+
+    /**
+     * writes a line per stage: its threads, the items it processed, how busy and how stalled its threads were
+     * (as a share of the time the pipeline ran), and how full the rings into it are and got.
+     * @param out- the stream to write to.
+     */
+    void report(std::ostream &out) const
+    {
+        auto end = _threads.empty() ? _stopped : std::chrono::steady_clock::now();
+        double wall = std::max<double>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(end - _started).count(), 1);
+        std::ios state(nullptr);
+        state.copyfmt(out);
+        out << std::fixed << std::setprecision(1);
+        for (const auto &stage : _stages)
+        {
+            uint64_t items = 0;
+            uint64_t busy = 0;
+            uint64_t stall = 0;
+            size_t queued = 0;
+            size_t highWater = 0;
+            size_t capacity = 0;
+            for (const auto &worker : stage->workers)
+            {
+                items += worker->items.load(std::memory_order_relaxed);
+                busy += worker->busyNanos.load(std::memory_order_relaxed);
+                stall += worker->stallNanos.load(std::memory_order_relaxed);
+                for (const ringT *ring : worker->inputs)
+                {
+                    queued += ring->size();
+                    highWater = std::max(highWater, ring->highWater());
+                    capacity += ring->capacity();
+                }
+            }
+            out << stage->name << ": threads " << stage->threads << ", items " << items
+                << ", busy " << 100 * busy / (wall * stage->threads) << "%"
+                << ", stalled " << 100 * stall / (wall * stage->threads) << "%"
+                << ", queued " << queued << "/" << capacity << " (ring high water " << highWater << ")" << '\n';
+        }
+        out.copyfmt(state);
+    }
+};
+
+#endif //SPAMDETECTOR_STAGEPIPELINE_HPP
@@ -0,0 +1,264 @@
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "hashMap.hpp"
+
+#ifndef SPAMDETECTOR_STRINGPOOL_HPP
+#define SPAMDETECTOR_STRINGPOOL_HPP
+
+#define POOL_MAX_BYTES 0xFFFFFFFFUL
+#define POOL_DEF_SLOTS 64
+
+/**
+ * a key that was interned in a StringPool: the offset and length of its characters in the pool plus its cached
+ * hash, 12 bytes in total no matter how long the string is.
+ * the pool stores every distinct string once, so two keys of the same pool are equal exactly when they point
+ * to the same characters, and comparing them never looks at the characters themselves.
+ */
+struct InternedKey
+{
+    uint32_t offset;
+    uint32_t length;
+    uint32_t hash;
+
+    /**
+     * ==operator, keys of the same pool are equal if they point to the same characters.
+     * @param rhs- the other key.
+     * @return- true if both keys are the same string and false otherwise.
+     */
+    bool operator==(const InternedKey &rhs) const
+    {
+        return offset == rhs.offset && length == rhs.length;
+    }
+
+    /**
+     * !=operator, keys of the same pool are different if they point to different characters.
+     * @param rhs- the other key.
+     * @return- true if the keys are different strings and false otherwise.
+     */
+    bool operator!=(const InternedKey &rhs) const
+    {
+        return !(*this == rhs);
+    }
+};
+
+namespace std
+{
+    /**
+     * std::hash for InternedKey, hands out the hash that was cached when the key was interned.
+     */
+    template<>
+    struct hash<InternedKey>
+    {
+        size_t operator()(const InternedKey &key) const
+        {
+            return key.hash;
+        }
+    };
+}
+
+/**
+ * an append-only pool of distinct strings, shared by all the maps that key on the same phrases.
+ * every string is stored once, back to back in one char array, and is handed out as an InternedKey.
+ * a small open addressing table of key indices finds strings that were already interned.
+ * interning is not thread safe, but once a pool is built any number of threads can look strings up in it.
+ */
+class StringPool
+{
+private:
+    std::vector<char> _chars;
+    std::vector<InternedKey> _keys;
+    std::vector<uint32_t> _slots;
+
+    /**
+     * the hash of a string, FNV-1a followed by murmur3's finalizer so that the low bits (which HashMap masks
+     * with) are well mixed.
+     * @param str- the characters.
+     * @param length- the number of characters.
+     * @return- the 32 bit hash.
+     */
+    static uint32_t hashOf(const char *str, size_t length)
+    {
+        uint32_t h = 2166136261U;
+        for (size_t i = 0; i < length; i++)
+        {
+            h = (h ^ (unsigned char) str[i]) * 16777619U;
+        }
+        h ^= h >> 16;
+        h *= 0x85ebca6bU;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35U;
+        h ^= h >> 16;
+        return h;
+    }
+
+    /**
+     * finds the slot of the given string, or the empty slot it would go to.
+     * @param str- the characters.
+     * @param length- the number of characters.
+     * @param h- the hash of the string.
+     * @return- the index of the slot.
+     */
+    size_t slotOf(const char *str, size_t length, uint32_t h) const
+    {
+        size_t mask = _slots.size() - 1;
+        size_t i = h & mask;
+        while (_slots[i] != 0)
+        {
+            const InternedKey &key = _keys[_slots[i] - 1];
+            if (key.hash == h && key.length == length && std::memcmp(_chars.data() + key.offset, str, length) == 0)
+            {
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    /**
+     * doubles the slot table and reinserts all the keys into it.
+     */
+    void grow()
+    {
+        std::vector<uint32_t> slots(_slots.size() * 2, 0);
+        size_t mask = slots.size() - 1;
+        for (size_t k = 0; k < _keys.size(); k++)
+        {
+            size_t i = _keys[k].hash & mask;
+            while (slots[i] != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            slots[i] = (uint32_t) (k + 1);
+        }
+        _slots.swap(slots);
+    }
+
+public:
+    /**
+     * constructor for an empty pool.
+     */
+    StringPool() : _slots(POOL_DEF_SLOTS, 0)
+    {
+    }
+
+    /**
+     * interns a string, storing its characters if the pool doesn't have them yet.
+     * @param str- the characters.
+     * @param length- the number of characters.
+     * @return- the key of the string, the same key every time for the same string.
+     */
+    InternedKey intern(const char *str, size_t length)
+    {
+        uint32_t h = hashOf(str, length);
+        size_t i = slotOf(str, length, h);
+        if (_slots[i] != 0)
+        {
+            return _keys[_slots[i] - 1];
+        }
+        if (_chars.size() + length > POOL_MAX_BYTES)
+        {
+            throw std::length_error("string pool is full");
+        }
+        InternedKey key = {(uint32_t) _chars.size(), (uint32_t) length, h};
+        _chars.insert(_chars.end(), str, str + length);
+        _keys.push_back(key);
+        _slots[i] = (uint32_t) _keys.size();
+        if (_keys.size() * 2 > _slots.size())
+        {
+            grow();
+        }
+        return key;
+    }
+
+    /**
+     * interns a string, storing its characters if the pool doesn't have them yet.
+     * @param str- the string.
+     * @return- the key of the string, the same key every time for the same string.
+     */
+    InternedKey intern(const std::string &str)
+    {
+        return intern(str.data(), str.size());
+    }
+
+    /**
+     * looks a string up without interning it, so messages can be checked against interned maps without
+     * growing the pool.
+     * @param str- the characters.
+     * @param length- the number of characters.
+     * @param key- set to the key of the string if it was found.
+     * @return- true if the string is in the pool and false otherwise.
+     */
+    bool find(const char *str, size_t length, InternedKey &key) const
+    {
+        size_t i = slotOf(str, length, hashOf(str, length));
+        if (_slots[i] == 0)
+        {
+            return false;
+        }
+        key = _keys[_slots[i] - 1];
+        return true;
+    }
+
+    /**
+     * looks a string up without interning it.
+     * @param str- the string.
+     * @param key- set to the key of the string if it was found.
+     * @return- true if the string is in the pool and false otherwise.
+     */
+    bool find(const std::string &str, InternedKey &key) const
+    {
+        return find(str.data(), str.size(), key);
+    }
+
+    /**
+     * the characters of an interned key, valid until the next call to intern.
+     * @param key- the key.
+     * @return- a pointer to the first of key.length characters.
+     */
+    const char *data(const InternedKey &key) const
+    {
+        return _chars.data() + key.offset;
+    }
+
+    /**
+     * the string of an interned key.
+     * @param key- the key.
+     * @return- a copy of the characters as a std::string.
+     */
+    std::string str(const InternedKey &key) const
+    {
+        return std::string(data(key), key.length);
+    }
+
+    /**
+     * getter for the number of distinct strings in the pool.
+     * @return- the number of strings.
+     */
+    size_t size() const
+    {
+        return _keys.size();
+    }
+
+    /**
+     * getter for the number of characters stored in the pool.
+     * @return- the number of bytes of string data.
+     */
+    size_t bytes() const
+    {
+        return _chars.size();
+    }
+};
+
+/**
+ * the interned key mode of HashMap<std::string, valueT>: the map stores 12 byte InternedKeys of a shared
+ * StringPool instead of std::strings, which more than halves the size of every pair and turns key comparison
+ * into an offset and length check.
+ * keys are made with pool.intern(str) on the writing side and pool.find(str, key) on the reading side.
+ */
+template<typename valueT>
+using InternedMap = HashMap<InternedKey, valueT>;
+
+#endif //SPAMDETECTOR_STRINGPOOL_HPP
@@ -0,0 +1,281 @@
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "hashMap.hpp"
+#include "multiplyFold.hpp"
+
+#ifndef SPAMDETECTOR_VERDICTCACHE_HPP
+#define SPAMDETECTOR_VERDICTCACHE_HPP
+
+#define VERDICT_CACHE_SHARDS 16
+#define VERDICT_ENTRY_BYTES 160
+#define FINGERPRINT_STRIPE 32
+
+/**
+ * a 128 bit fingerprint of the content of a message.
+ */
+struct Fingerprint
+{
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const Fingerprint &other) const
+    {
+        return low == other.low && high == other.high;
+    }
+};
+
+namespace std
+{
+    /**
+     * a fingerprint is already a hash, its low half is used as is.
+     */
+    template<>
+    struct hash<Fingerprint>
+    {
+        size_t operator()(const Fingerprint &fingerprint) const
+        {
+            return (size_t) fingerprint.low;
+        }
+    };
+}
+
+/**
+ * the keys of the fingerprint, drawn at random once per process so nobody can make up two messages with the same
+ * fingerprint ahead of time (a spam message that collides with a cached clean one would get its verdict).
+ */
+struct FingerprintKey
+{
+    uint64_t k[6];
+
+    FingerprintKey() : k()
+    {
+        std::random_device random;
+        for (uint64_t &key : k)
+        {
+            key = ((uint64_t) random() << 32 | random()) | 1;
+        }
+    }
+};
+
+/**
+ * fingerprints the content of a message: two keyed multiply-fold lanes (in the style of wyhash) take 16 bytes
+ * each out of every 32 byte stripe and fold them into their state, so the two products of a stripe are
+ * computed in parallel, and the 128 bit fingerprint is folded out of both lanes at the end. it runs at memory
+ * speed, which is what makes checking the cache before scoring cheap. it isn't a cryptographic hash, the
+ * random keys are what keeps collisions from being made on purpose.
+ * @param message- the message.
+ * @return- its fingerprint.
+ */
+inline Fingerprint fingerprint(std::string_view message)
+{
+    static const FingerprintKey key;
+    const char *bytes = message.data();
+    size_t length = message.size();
+    uint64_t a = key.k[0] ^ length;
+    uint64_t b = key.k[1];
+    uint64_t word[4];
+    size_t i = 0;
+    for (; i + FINGERPRINT_STRIPE <= length; i += FINGERPRINT_STRIPE)
+    {
+        std::memcpy(word, bytes + i, sizeof(word));
+        a = foldMultiply(word[0] ^ key.k[2], word[1] ^ a);
+        b = foldMultiply(word[2] ^ key.k[3], word[3] ^ b);
+    }
+    // the tail is padded with zeros, the length that went into the state tells paddings apart
+    std::memset(word, 0, sizeof(word));
+    std::memcpy(word, bytes + i, length - i);
+    a = foldMultiply(word[0] ^ key.k[2], word[1] ^ a);
+    b = foldMultiply(word[2] ^ key.k[3], word[3] ^ b);
+    return {foldMultiply(a ^ key.k[4], b ^ key.k[5]), foldMultiply(a ^ key.k[5], b ^ key.k[4])};
+}
+
+/**
+ * a bounded cache of the verdicts of messages by their fingerprints, so the copies of a message that comes in a
+ * flood are scored once. it is split into shards by fingerprint, each with its own lock, HashMap from
+ * fingerprint to slot and fixed array of slots, and a full shard evicts with CLOCK: the hand goes around the
+ * slots, giving a slot that was hit since it last went by a second chance and taking the first one that wasn't.
+ * a new verdict starts without that second chance, so a message seen once is the first to go and a flood that
+ * keeps hitting stays.
+ * every verdict is tagged with the version of the engine that scored it. a newer version empties a shard the
+ * first time it gets there (so a reload or a delta invalidates the whole cache without anything having to tell
+ * it), and a lookup by an older version (a message that took its engine snapshot before the reload) misses.
+ */
+class VerdictCache
+{
+private:
+    /**
+     * a cached verdict.
+     */
+    struct Slot
+    {
+        Fingerprint key;
+        long long score;
+        bool stopped;
+        bool referenced;
+    };
+
+    /**
+     * a shard of the cache.
+     */
+    struct Shard
+    {
+        std::mutex lock;
+        HashMap<Fingerprint, uint32_t> index;
+        std::vector<Slot> slots;
+        size_t hand = 0;
+        uint64_t version = 0;
+    };
+
+    std::unique_ptr<Shard[]> _shards;
+    size_t _perShard;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+    std::atomic<uint64_t> _evictions;
+
+    /**
+     * the shard a fingerprint goes to.
+     * @param key- the fingerprint.
+     * @return- its shard.
+     */
+    Shard &shardOf(const Fingerprint &key) const
+    {
+        return _shards[key.high % VERDICT_CACHE_SHARDS];
+    }
+
+    /**
+     * brings a shard up to a version, emptying it if the version is newer than the verdicts in it.
+     * @param shard- the shard, locked.
+     * @param version- the version of the engine at hand.
+     * @return- false if the version is older than the verdicts in the shard.
+     */
+    static bool catchUp(Shard &shard, uint64_t version)
+    {
+        if (version > shard.version)
+        {
+            shard.index.clear();
+            shard.slots.clear();
+            shard.hand = 0;
+            shard.version = version;
+        }
+        return version == shard.version;
+    }
+
+public:
+    /**
+     * constructor.
+     * @param budget- about how many bytes the cache may take, all of its shards and their maps included.
+     */
+    explicit VerdictCache(size_t budget) : _shards(new Shard[VERDICT_CACHE_SHARDS]),
+            _perShard(std::max<size_t>(budget / VERDICT_ENTRY_BYTES / VERDICT_CACHE_SHARDS, 1)), _hits(0),
+            _misses(0), _evictions(0)
+    {
+    }
+
+    /**
+     * looks the verdict of a message up.
+     * @param key- the fingerprint of the message.
+     * @param version- the version of the engine the message is scored with.
+     * @param score- set to the cached score if there is one.
+     * @param stopped- set to wether the cached score stopped early.
+     * @return- true if the verdict was cached.
+     */
+    bool find(const Fingerprint &key, uint64_t version, long long &score, bool &stopped)
+    {
+        Shard &shard = shardOf(key);
+        {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            const uint32_t *at = catchUp(shard, version) ? shard.index.find(key) : nullptr;
+            if (at != nullptr)
+            {
+                Slot &slot = shard.slots[*at];
+                slot.referenced = true;
+                score = slot.score;
+                stopped = slot.stopped;
+                _hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        _misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    /**
+     * caches the verdict of a message, evicting one if the shard is full.
+     * @param key- the fingerprint of the message.
+     * @param version- the version of the engine the message was scored with.
+     * @param score- its score.
+     * @param stopped- true if the score stopped early.
+     */
+    void insert(const Fingerprint &key, uint64_t version, long long score, bool stopped)
+    {
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        // two copies of a message scored at once both get here, the first one's verdict stays
+        if (!catchUp(shard, version) || shard.index.containsKey(key))
+        {
+            return;
+        }
+        if (shard.slots.size() < _perShard)
+        {
+            shard.index.insert(key, (uint32_t) shard.slots.size());
+            shard.slots.push_back({key, score, stopped, false});
+            return;
+        }
+        while (shard.slots[shard.hand].referenced)
+        {
+            shard.slots[shard.hand].referenced = false;
+            shard.hand = (shard.hand + 1) % _perShard;
+        }
+        Slot &victim = shard.slots[shard.hand];
+        shard.index.erase(victim.key);
+        shard.index.insert(key, (uint32_t) shard.hand);
+        victim = {key, score, stopped, false};
+        shard.hand = (shard.hand + 1) % _perShard;
+        _evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the number of lookups that found a verdict.
+     * @return- the number of hits.
+     */
+    uint64_t hits() const
+    {
+        return _hits.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the number of lookups that didn't.
+     * @return- the number of misses.
+     */
+    uint64_t misses() const
+    {
+        return _misses.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the number of verdicts evicted to make room for others.
+     * @return- the number of evictions.
+     */
+    uint64_t evictions() const
+    {
+        return _evictions.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * getter for the most verdicts the cache holds.
+     * @return- the capacity.
+     */
+    size_t capacity() const
+    {
+        return _perShard * VERDICT_CACHE_SHARDS;
+    }
+};
+
+#endif //SPAMDETECTOR_VERDICTCACHE_HPP
@@ -0,0 +1,190 @@
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include "multiplyFold.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WORDSPLITTER_X86 1
+#endif
+
+#ifndef SPAMDETECTOR_WORDSPLITTER_HPP
+#define SPAMDETECTOR_WORDSPLITTER_HPP
+
+/**
+ * states wether a byte is part of a word: an ASCII letter or digit, or a byte of a non ASCII character.
+ */
+struct WordBytes
+{
+    bool word[256];
+
+    WordBytes() : word()
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            word[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+        }
+    }
+};
+
+/**
+ * marks the word bytes of a text in a bitmask, one byte at a time.
+ * @param text- the text.
+ * @param length- its length.
+ * @param mask- gets a bit per byte, set for the word bytes, 64 to an element.
+ */
+inline void wordMaskScalar(const unsigned char *text, size_t length, uint64_t *mask)
+{
+    static const WordBytes bytes;
+    for (size_t i = 0; i < length; i += 64)
+    {
+        uint64_t bits = 0;
+        for (size_t j = 0; j < 64 && i + j < length; j++)
+        {
+            bits |= (uint64_t) bytes.word[text[i + j]] << j;
+        }
+        mask[i / 64] = bits;
+    }
+}
+
+#ifdef WORDSPLITTER_X86
+
+/**
+ * marks the word bytes of a text in a bitmask with AVX2, 32 bytes at a time, the tail one byte at a time.
+ * @param text- the text.
+ * @param length- its length.
+ * @param mask- gets a bit per byte, set for the word bytes, 64 to an element.
+ */
+__attribute__((target("avx2")))
+inline void wordMaskAvx2(const unsigned char *text, size_t length, uint64_t *mask)
+{
+    // signed compares: the bytes of non ASCII characters are negative, and are words by being negative alone
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lower = _mm256_set1_epi8(0x20);
+    const __m256i beforeA = _mm256_set1_epi8('a' - 1);
+    const __m256i afterZ = _mm256_set1_epi8('z' + 1);
+    const __m256i before0 = _mm256_set1_epi8('0' - 1);
+    const __m256i after9 = _mm256_set1_epi8('9' + 1);
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        uint64_t bits = 0;
+        for (size_t half = 0; half < 2; half++)
+        {
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i + 32 * half));
+            __m256i folded = _mm256_or_si256(c, lower);
+            __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(folded, beforeA), _mm256_cmpgt_epi8(afterZ, folded));
+            __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, before0), _mm256_cmpgt_epi8(after9, c));
+            __m256i word = _mm256_or_si256(_mm256_or_si256(letter, digit), _mm256_cmpgt_epi8(zero, c));
+            bits |= (uint64_t) (uint32_t) _mm256_movemask_epi8(word) << (32 * half);
+        }
+        mask[i / 64] = bits;
+    }
+    if (i < length)
+    {
+        wordMaskScalar(text + i, length - i, mask + i / 64);
+    }
+}
+
+#endif
+
+/**
+ * hashes a word, case insensitive for ASCII (every word byte is hashed with its 0x20 bit set, which lowercases
+ * the letters and leaves the digits alone).
+ * @param word- the word.
+ * @param length- its length.
+ * @param end- the end of the text the word is in, the tail of the word is read 8 bytes at once if they are in it.
+ * @return- the hash.
+ */
+inline uint64_t hashWord(const char *word, size_t length, const char *end)
+{
+    const uint64_t lower = 0x2020202020202020ULL;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ length;
+    uint64_t chunk;
+    size_t i = 0;
+    for (; i + sizeof(chunk) <= length; i += sizeof(chunk))
+    {
+        std::memcpy(&chunk, word + i, sizeof(chunk));
+        h = foldMultiply(h ^ (chunk | lower), 0xA0761D6478BD642FULL);
+    }
+    size_t tail = length - i;
+    if (tail == 0)
+    {
+        return h;
+    }
+    if (end - (word + i) >= (ptrdiff_t) sizeof(chunk))
+    {
+        std::memcpy(&chunk, word + i, sizeof(chunk));
+        chunk &= ~0ULL >> (64 - 8 * tail);
+    }
+    else
+    {
+        chunk = 0;
+        for (size_t shift = 0; i < length; i++, shift += 8)
+        {
+            chunk |= (uint64_t) (unsigned char) word[i] << shift;
+        }
+    }
+    return foldMultiply(h ^ (chunk | lower), 0xE7037ED1A0B428DBULL);
+}
+
+/**
+ * splits the start of a text into words (runs of word bytes, see WordBytes) and hashes every one of them with
+ * hashWord. the word bytes are marked in a bitmask first (with AVX2 if the CPU has it), and the words are found
+ * by the edges of their runs of bits (where a bit differs from the one before it) a set bit at a time, so there
+ * is no branch per byte and the one per edge alternates.
+ * @tparam callbackT- a callable taking the hash of a word.
+ * @param text- the text.
+ * @param max- the most bytes of it to split, a word that runs past them is cut there.
+ * @param each- called with the hash of every word, in order.
+ */
+template<typename callbackT>
+inline void splitWords(std::string_view text, size_t max, const callbackT &each)
+{
+#ifdef WORDSPLITTER_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    thread_local std::vector<uint64_t> mask;
+    const auto *bytes = reinterpret_cast<const unsigned char *>(text.data());
+    const char *end = text.data() + text.size();
+    size_t length = std::min(text.size(), max);
+    mask.resize((length + 63) / 64);
+#ifdef WORDSPLITTER_X86
+    if (avx2)
+    {
+        wordMaskAvx2(bytes, length, mask.data());
+    }
+    else
+#endif
+    {
+        wordMaskScalar(bytes, length, mask.data());
+    }
+    size_t start = 0;
+    bool inWord = false;
+    uint64_t carry = 0;
+    for (size_t element = 0; element < mask.size(); element++)
+    {
+        uint64_t bits = mask[element];
+        uint64_t edges = bits ^ (bits << 1 | carry);
+        carry = bits >> 63;
+        for (; edges != 0; edges &= edges - 1)
+        {
+            size_t at = element * 64 + __builtin_ctzll(edges);
+            if (inWord)
+            {
+                each(hashWord(text.data() + start, at - start, end));
+            }
+            start = at;
+            inWord = !inWord;
+        }
+    }
+    if (inWord)
+    {
+        each(hashWord(text.data() + start, length - start, end));
+    }
+}
+
+#endif //SPAMDETECTOR_WORDSPLITTER_HPP
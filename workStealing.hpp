@@ -0,0 +1,256 @@
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <cstdint>
+
+#ifndef SPAMDETECTOR_WORKSTEALING_HPP
+#define SPAMDETECTOR_WORKSTEALING_HPP
+
+#define DEQUE_DEF_CAPACITY 256
+#define STEAL_ROUNDS 64
+#define IDLE_SLEEP_MICROS 50
+
+/**
+ * a Chase-Lev work stealing deque of pointers (the C11 version of Le, Pop, Cohen and Zappa Nardelli).
+ * the owning worker pushes and pops at the bottom without any locking, other workers steal from the top with a
+ * single compare and swap. the ring grows when it fills up, the old rings are kept until the deque is destroyed
+ * because a thief may still be reading from one.
+ * @tparam taskT- the type of the tasks, the deque holds pointers to them.
+ */
+template<typename taskT>
+class ChaseLevDeque
+{
+private:
+    /**
+     * a ring of slots, its capacity a power of 2.
+     */
+    struct Ring
+    {
+        int64_t mask;
+        std::unique_ptr<std::atomic<taskT *>[]> slots;
+
+        explicit Ring(int64_t capacity) : mask(capacity - 1), slots(new std::atomic<taskT *>[capacity])
+        {
+        }
+
+        taskT *get(int64_t i) const
+        {
+            return slots[i & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, taskT *task)
+        {
+            slots[i & mask].store(task, std::memory_order_relaxed);
+        }
+    };
+
+    alignas(64) std::atomic<int64_t> _top;
+    alignas(64) std::atomic<int64_t> _bottom;
+    std::atomic<Ring *> _ring;
+    std::vector<std::unique_ptr<Ring>> _rings;
+
+    /**
+     * doubles the ring, copying over the tasks between top and bottom. only called by the owner.
+     * @param ring- the current ring.
+     * @param top- the top index.
+     * @param bottom- the bottom index.
+     * @return- the new ring.
+     */
+    Ring *grow(Ring *ring, int64_t top, int64_t bottom)
+    {
+        _rings.emplace_back(new Ring((ring->mask + 1) * 2));
+        Ring *bigger = _rings.back().get();
+        for (int64_t i = top; i < bottom; i++)
+        {
+            bigger->put(i, ring->get(i));
+        }
+        _ring.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+public:
+    /**
+     * constructor for an empty deque.
+     */
+    ChaseLevDeque() : _top(0), _bottom(0)
+    {
+        _rings.emplace_back(new Ring(DEQUE_DEF_CAPACITY));
+        _ring.store(_rings.back().get(), std::memory_order_relaxed);
+    }
+
+    /**
+     * pushes a task at the bottom, only the owner may call this.
+     * @param task- the task.
+     */
+    void push(taskT *task)
+    {
+        int64_t bottom = _bottom.load(std::memory_order_relaxed);
+        int64_t top = _top.load(std::memory_order_acquire);
+        Ring *ring = _ring.load(std::memory_order_relaxed);
+        if (bottom - top > ring->mask)
+        {
+            ring = grow(ring, top, bottom);
+        }
+        ring->put(bottom, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * pops the task at the bottom, only the owner may call this.
+     * @return- the task, or nullptr if the deque is empty (or a thief got the last task first).
+     */
+    taskT *pop()
+    {
+        int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+        Ring *ring = _ring.load(std::memory_order_relaxed);
+        _bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = _top.load(std::memory_order_relaxed);
+        if (top > bottom)
+        {
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        taskT *task = ring->get(bottom);
+        if (top == bottom)
+        {
+            // the last task, race the thieves for it
+            if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                task = nullptr;
+            }
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    /**
+     * steals the task at the top, any thread may call this.
+     * @return- the task, or nullptr if the deque is empty or another thread won the race for it.
+     */
+    taskT *steal()
+    {
+        int64_t top = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = _bottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+        {
+            return nullptr;
+        }
+        Ring *ring = _ring.load(std::memory_order_acquire);
+        taskT *task = ring->get(top);
+        if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+        return task;
+    }
+};
+
+/**
+ * a pool of workers that each own a Chase-Lev deque. a worker runs the tasks of its own deque newest first, and
+ * when it runs dry it steals the oldest task of a random other worker, so a worker that is stuck on something big
+ * gets its backlog (and the pieces it splits that big thing into) taken over by the idle ones.
+ * @tparam taskT- the type of the tasks, the pool only passes pointers to them around.
+ */
+template<typename taskT>
+class WorkStealingPool
+{
+private:
+    std::vector<std::unique_ptr<ChaseLevDeque<taskT>>> _deques;
+    std::atomic<size_t> _pending;
+
+    /**
+     * finds something to do for a worker: its own newest task, or else a task stolen from another worker.
+     * @param worker- the index of the worker.
+     * @param random- the worker's random generator, for picking victims.
+     * @return- the task, or nullptr if none was found.
+     */
+    taskT *take(unsigned int worker, std::minstd_rand &random)
+    {
+        taskT *task = _deques[worker]->pop();
+        size_t workers = _deques.size();
+        for (unsigned int round = 0; task == nullptr && round < STEAL_ROUNDS && workers > 1; round++)
+        {
+            size_t victim = random() % workers;
+            if (victim != worker)
+            {
+                task = _deques[victim]->steal();
+            }
+        }
+        return task;
+    }
+
+public:
+    /**
+     * constructor.
+     * @param workers- the number of workers.
+     */
+    explicit WorkStealingPool(unsigned int workers) : _pending(0)
+    {
+        for (unsigned int w = 0; w < std::max(workers, 1U); w++)
+        {
+            _deques.emplace_back(new ChaseLevDeque<taskT>());
+        }
+    }
+
+    /**
+     * adds a task to a worker's deque. before run() it may be called for any worker, during run() only from
+     * inside a task handler, for the worker running it.
+     * @param worker- the index of the worker.
+     * @param task- the task.
+     */
+    void spawn(unsigned int worker, taskT *task)
+    {
+        _pending.fetch_add(1, std::memory_order_relaxed);
+        _deques[worker]->push(task);
+    }
+
+    /**
+     * getter for the number of workers.
+     * @return- the number of workers.
+     */
+    unsigned int workers() const
+    {
+        return (unsigned int) _deques.size();
+    }
+
+    /**
+     * runs the workers until every task (the spawned ones included) is done.
+     * @param handler- called as handler(task, worker) for every task, may spawn more tasks for 'worker'.
+     */
+    template<typename handlerT>
+    void run(const handlerT &handler)
+    {
+        std::vector<std::thread> threads;
+        for (unsigned int w = 0; w < _deques.size(); w++)
+        {
+            threads.emplace_back([this, w, &handler]
+                                 {
+                                     std::minstd_rand random(w + 1);
+                                     while (_pending.load(std::memory_order_acquire) != 0)
+                                     {
+                                         taskT *task = take(w, random);
+                                         if (task == nullptr)
+                                         {
+                                             std::this_thread::sleep_for(
+                                                     std::chrono::microseconds(IDLE_SLEEP_MICROS));
+                                             continue;
+                                         }
+                                         handler(task, w);
+                                         _pending.fetch_sub(1, std::memory_order_acq_rel);
+                                     }
+                                 });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+};
+
+#endif //SPAMDETECTOR_WORKSTEALING_HPP